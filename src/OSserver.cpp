@@ -25,6 +25,7 @@
 #include "program.h"
 #include "OSserver.h"
 #include "weather.h"
+#include "oslog.h"
 
 // External variables defined in main ion file
 
@@ -43,6 +44,10 @@ extern char tmp_buffer[];
 extern OpenSprinkler os;
 extern ProgramData pd;
 extern ulong flow_count;
+extern ulong boot_options_ms;
+extern ForecastRun forecast_runs[];
+extern uint16_t forecast_nruns;
+static ulong boot_ready_ms = 0;	// millis() when the web server first started
 
 static byte return_code;
 static char* get_buffer = NULL;
@@ -59,7 +64,7 @@ void log_statistics(time_t curr_time);
 void delete_log(char *name);
 void reset_all_stations_immediate();
 void reset_all_stations();
-void make_logfile_name(char *name);
+ulong forecast_schedule(ulong curr_time, ulong end_time);
 
 /* Check available space (number of bytes) in the Ethernet buffer */
 int available_ether_buffer() {
@@ -444,8 +449,28 @@ void server_json_stations_main() {
 	server_json_stations_attrib(PSTR("stn_seq"), os.attrib_seq);
 	server_json_stations_attrib(PSTR("stn_spe"), os.attrib_spe);
 
-	bfill.emit_p(PSTR("\"snames\":["));
 	byte sid;
+	// sequential group of each station
+	bfill.emit_p(PSTR("\"stn_grp\":["));
+	for(sid=0;sid<os.nstations;sid++) {
+		bfill.emit_p((sid!=os.nstations-1)?PSTR("$D,"):PSTR("$D"), os.attrib_grp[sid]);
+		if (available_ether_buffer() < 60) {
+			send_packet();
+		}
+	}
+	bfill.emit_p(PSTR("],\"ngrp\":$D,"), NUM_SEQ_GROUPS);
+
+	// expected flow of each station in 0.1 flow units, 0 if unknown
+	bfill.emit_p(PSTR("\"stn_flow\":["));
+	for(sid=0;sid<os.nstations;sid++) {
+		bfill.emit_p((sid!=os.nstations-1)?PSTR("$D,"):PSTR("$D"), os.station_flow[sid]);
+		if (available_ether_buffer() < 60) {
+			send_packet();
+		}
+	}
+	bfill.emit_p(PSTR("],"));
+
+	bfill.emit_p(PSTR("\"snames\":["));
 	for(sid=0;sid<os.nstations;sid++) {
 		os.get_station_name(sid, tmp_buffer);
 		bfill.emit_p(PSTR("\"$S\""), tmp_buffer);
@@ -518,6 +543,7 @@ void server_change_stations_attrib(char *p, char header, byte *attrib)
  * d?: disable sation bit field
  * q?: station sequeitnal bit field
  * p?: station special flag bit field
+ * g?: station sequential group (? is station index, starting from 0)
  */
 void server_change_stations() {
 #if defined(ESP8266)
@@ -549,6 +575,16 @@ void server_change_stations() {
 	server_change_stations_attrib(p, 'q', os.attrib_seq); // sequential
 	server_change_stations_attrib(p, 'p', os.attrib_spe); // special
 
+	// process station sequential groups
+	tbuf2[0] = 'g';
+	for(sid=0;sid<os.nstations;sid++) {
+		itoa(sid, tbuf2+1, 10);
+		if(findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, tbuf2)) {
+			int gid = atoi(tmp_buffer);
+			if (gid>=0 && gid<NUM_SEQ_GROUPS) os.attrib_grp[sid] = gid;
+		}
+	}
+
 	/* handle special data */
 	if(findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("sid"), true)) {
 		sid = atoi(tmp_buffer);
@@ -582,8 +618,7 @@ void server_change_stations() {
 				}
 			}
 			// write spe data
-			file_write_block(STATIONS_FILENAME, tmp_buffer,
-				(uint32_t)sid*sizeof(StationData)+offsetof(StationData,type), STATION_SPECIAL_DATA_SIZE+1);
+			os.set_station_special(sid, (byte*)tmp_buffer);
 
 		} else {
 
@@ -699,11 +734,10 @@ void server_change_runonce() {
 		// if non-zero duration is given
 		// and if the station has not been disabled
 		if (dur>0 && !(os.attrib_dis[bid]&(1<<s))) {
-			RuntimeQueueStruct *q = pd.enqueue();
+			RuntimeQueueStruct *q = pd.enqueue(254);
 			if (q) {
 				q->st = 0;
 				q->dur = water_time_resolve(dur);
-				q->pid = 254;
 				q->sid = sid;
 				match_found = true;
 			}
@@ -778,6 +812,56 @@ void server_moveup_program() {
 	handle_return(HTML_SUCCESS);
 }
 
+/** Parse a comma separated list of program indices, returns the count or -1 if invalid */
+static int parse_program_list(char *s, byte *list) {
+	int n = 0;
+	while (*s) {
+		if (n >= MAX_NUM_PROGRAMS || *s<'0' || *s>'9') return -1;
+		ulong v = strtoul(s, &s, 10);
+		if (v >= pd.nprograms) return -1;
+		list[n++] = v;
+		if (*s == ',') s++;
+		else if (*s) return -1;
+	}
+	return n;
+}
+
+/**
+ * Reorder or delete programs in one request
+ * Command: /bp?pw=xxx&order=x,x,...
+ *          /bp?pw=xxx&del=x,x,...
+ *
+ * pw:		password
+ * order:	all program indices, in their new order
+ * del:		indices of the programs to delete
+*/
+void server_batch_programs() {
+#if defined(ESP8266)
+	char *p = NULL;
+	if(!process_password()) return;
+	if (m_client)
+		p = get_buffer;  
+#else
+	char *p = get_buffer;
+#endif
+
+	byte list[MAX_NUM_PROGRAMS];
+	int n;
+	if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("order"), true)) {
+		n = parse_program_list(tmp_buffer, list);
+		if (n != pd.nprograms || !pd.reorder(list))
+			handle_return(HTML_DATA_OUTOFBOUND);
+	} else if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("del"), true)) {
+		n = parse_program_list(tmp_buffer, list);
+		if (n <= 0 || !pd.del_list(list, n))
+			handle_return(HTML_DATA_OUTOFBOUND);
+	} else {
+		handle_return(HTML_DATA_MISSING);
+	}
+
+	handle_return(HTML_SUCCESS);
+}
+
 /**
  * Change a program
  * Command: /cp?pw=xxx&pid=x&v=[flag,days0,days1,[start0,start1,start2,start3],[dur0,dur1,dur2..]]&name=x
@@ -802,7 +886,7 @@ void server_change_program() {
 
 	byte i;
 
-	ProgramStruct prog;
+	ProgramStruct &prog = pd.scratch;
 
 	// parse program index
 	if (!findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("pid"), true)) handle_return(HTML_DATA_MISSING);
@@ -914,7 +998,8 @@ void server_json_options_main() {
 		int32_t v=os.iopts[oid];
 		if (oid==IOPT_MASTER_OFF_ADJ || oid==IOPT_MASTER_OFF_ADJ_2 ||
 				oid==IOPT_MASTER_ON_ADJ  || oid==IOPT_MASTER_ON_ADJ_2 ||
-				oid==IOPT_STATION_DELAY_TIME) {
+				oid==IOPT_STATION_DELAY_TIME || oid==IOPT_STATION_DELAY_TIME_1 ||
+				oid==IOPT_STATION_DELAY_TIME_2 || oid==IOPT_STATION_DELAY_TIME_3) {
 			v=water_time_decode_signed(v);
 		}
 		
@@ -976,27 +1061,34 @@ void server_json_programs_main() {
 	bfill.emit_p(PSTR("\"nprogs\":$D,\"nboards\":$D,\"mnp\":$D,\"mnst\":$D,\"pnsize\":$D,\"pd\":["),
 							 pd.nprograms, os.nboards, MAX_NUM_PROGRAMS, MAX_NUM_STARTTIMES, PROGRAM_NAME_SIZE);
 	byte pid, i;
-	ProgramStruct prog;
+	ProgramEntry *prog;
+	byte days[2];
 	for(pid=0;pid<pd.nprograms;pid++) {
-		pd.read(pid, &prog);
-		if (prog.type == PROGRAM_TYPE_INTERVAL && prog.days[1] > 1) {
-			pd.drem_to_relative(prog.days);
+		prog = pd.programs + pid;
+		days[0] = prog->days[0];
+		days[1] = prog->days[1];
+		if (prog->type == PROGRAM_TYPE_INTERVAL && days[1] > 1) {
+			pd.drem_to_relative(days);
 		}
 
-		byte bytedata = *(char*)(&prog);
-		bfill.emit_p(PSTR("[$D,$D,$D,["), bytedata, prog.days[0], prog.days[1]);
+		byte bytedata = *(char*)prog;
+		bfill.emit_p(PSTR("[$D,$D,$D,["), bytedata, days[0], days[1]);
 		// start times data
 		for (i=0;i<(MAX_NUM_STARTTIMES-1);i++) {
-			bfill.emit_p(PSTR("$D,"), prog.starttimes[i]);
+			bfill.emit_p(PSTR("$D,"), prog->starttimes[i]);
 		}
-		bfill.emit_p(PSTR("$D],["), prog.starttimes[i]);	// this is the last element
-		// station water time
-		for (i=0; i<os.nstations-1; i++) {
-			bfill.emit_p(PSTR("$L,"),(unsigned long)prog.durations[i]);
+		bfill.emit_p(PSTR("$D],["), prog->starttimes[i]);	// this is the last element
+		// station water time: stations that are not in the program's station list have 0
+		ProgramStation *ps = pd.pstations + prog->sidx;
+		ProgramStation *pe = ps + prog->nsta;
+		for (i=0; i<os.nstations; i++) {
+			uint16_t dur = 0;
+			if (ps<pe && ps->sid==i) dur = (ps++)->dur;
+			if (i<os.nstations-1) bfill.emit_p(PSTR("$L,"),(unsigned long)dur);
+			else bfill.emit_p(PSTR("$L],\""),(unsigned long)dur); // this is the last element
 		}
-		bfill.emit_p(PSTR("$L],\""),(unsigned long)prog.durations[i]); // this is the last element
 		// program name
-		strncpy(tmp_buffer, prog.name, PROGRAM_NAME_SIZE);
+		strncpy(tmp_buffer, prog->name, PROGRAM_NAME_SIZE);
 		tmp_buffer[PROGRAM_NAME_SIZE] = 0;	// make sure the string ends
 		bfill.emit_p(PSTR("$S"), tmp_buffer);
 		if(pid!=pd.nprograms-1) {
@@ -1103,10 +1195,30 @@ void server_json_controller_main() {
 			rem = (curr_time >= q->st) ? (q->st+q->dur-curr_time) : q->dur;
 			if(rem>65535) rem = 0;
 		}
-		bfill.emit_p(PSTR("[$D,$L,$L]"), (qid<255)?q->pid:0, rem, (qid<255)?q->st:0);
+		bfill.emit_p(PSTR("[$D,$L,$L,$D]"), (qid<255)?q->pid:0, rem, (qid<255)?q->st:0, os.attrib_grp[sid]);
 		bfill.emit_p((sid<os.nstations-1)?PSTR(","):PSTR("]"));
 	}
-	
+
+	// print master on/off times: [[on,off],...] for master (mw) and master2 (mw2)
+	pd.update_master_intervals();
+	for(byte mi=0;mi<2;mi++) {
+		bfill.emit_p(mi?PSTR(",\"mw2\":["):PSTR(",\"mw\":["));
+		for(byte i=pd.mas_first[mi];i<pd.nmas_intervals[mi];i++) {
+			if(available_ether_buffer() < 60) {
+				send_packet();
+			}
+			bfill.emit_p(PSTR("[$L,$L]"), pd.mas_intervals[mi][i].on, pd.mas_intervals[mi][i].off);
+			if (i<pd.nmas_intervals[mi]-1) bfill.emit_p(PSTR(","));
+		}
+		bfill.emit_p(PSTR("]"));
+	}
+
+	// print the last stop time of each sequential group
+	bfill.emit_p(PSTR(",\"lss\":["));
+	for(byte g=0;g<NUM_SEQ_GROUPS;g++) {
+		bfill.emit_p((g<NUM_SEQ_GROUPS-1)?PSTR("$L,"):PSTR("$L]"), pd.last_seq_stop_times[g]);
+	}
+
 	//bfill.emit_p(PSTR(",\"blynk\":\"$O\""), SOPT_BLYNK_TOKEN);
 	//bfill.emit_p(PSTR(",\"mqtt\":\"$O\""), SOPT_MQTT_IP);
 	
@@ -1315,7 +1427,8 @@ void server_change_options()
 			int32_t v = atol(tmp_buffer);
 			if (oid==IOPT_MASTER_OFF_ADJ || oid==IOPT_MASTER_OFF_ADJ_2 ||
 					oid==IOPT_MASTER_ON_ADJ  || oid==IOPT_MASTER_ON_ADJ_2  ||
-					oid==IOPT_STATION_DELAY_TIME) {
+					oid==IOPT_STATION_DELAY_TIME || oid==IOPT_STATION_DELAY_TIME_1 ||
+					oid==IOPT_STATION_DELAY_TIME_2 || oid==IOPT_STATION_DELAY_TIME_3) {
 				v=water_time_encode_signed(v);
 			} // encode station delay time
 			if(oid==IOPT_BOOST_TIME) {
@@ -1535,7 +1648,7 @@ void server_change_manual() {
 			if (sqi!=0xFF) {	// if we, we will overwrite the schedule
 				q = pd.queue+sqi;
 			} else {	// otherwise create a new queue element
-				q = pd.enqueue();
+				q = pd.enqueue(99);
 			}
 			// if the queue is not full
 			if (q) {
@@ -1557,32 +1670,20 @@ void server_change_manual() {
 }
 
 
-#if defined(ESP8266)
-int file_fgets(File file, char* buf, int maxsize) {
-	int index=0;
-	while(index<maxsize) {
-		int c = file.read();
-		if(c<0||c=='\n') break;
-		if(c=='\r') continue; // skip \r
-		*buf++ = (char)c;
-		index++;
-	}
-	return index;
-}
-#endif
-
 /**
  * Get log data
- * Command: /jl?start=x&end=x&hist=x&type=x
+ * Command: /jl?start=x&end=x&hist=x&type=x&limit=x
  *
  * hist:	history (past n days)
  *				when hist is speceified, the start
  *				and end parameters below will be ignored
  * start: start time (epoch time)
  * end:		end time (epoch time)
+ *				only records that end between start and end are output
  * type:	type of log records (optional)
  *				rs, rd, wl
  *				if unspecified, output all records
+ * limit: maximum number of records to output (optional)
  */
 void server_json_log() {
 
@@ -1595,34 +1696,43 @@ void server_json_log() {
 	char *p = get_buffer;
 #endif
 
-	unsigned int start, end;
+	ulong start, end;	// in seconds
 
 	// past n day history
 	if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("hist"), true)) {
 		int hist = atoi(tmp_buffer);
 		if (hist< 0 || hist > 365) handle_return(HTML_DATA_OUTOFBOUND);
 		end = os.now_tz() / 86400L;
-		start = end - hist;
+		start = (end - hist) * 86400L;
+		end = end * 86400L + 86399L;
 	}
 	else
 	{
 		if (!findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("start"), true)) handle_return(HTML_DATA_MISSING);
 
-		start = atol(tmp_buffer) / 86400L;
+		start = atol(tmp_buffer);
 
 		if (!findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("end"), true)) handle_return(HTML_DATA_MISSING);
 		
-		end = atol(tmp_buffer) / 86400L;
+		end = atol(tmp_buffer);
 
 		// start must be prior to end, and can't retrieve more than 365 days of data
-		if ((start>end) || (end-start)>365)  handle_return(HTML_DATA_OUTOFBOUND);
+		if ((start>end) || (end/86400L-start/86400L)>365)  handle_return(HTML_DATA_OUTOFBOUND);
 	}
 
+	ulong limit = 0;
+	if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("limit"), true))
+		limit = atol(tmp_buffer);
+
 	// extract the type parameter
+	// if type is specified, output only the special records of that type
+	// if type is not specified, output everything except "wl" and "fl" records
 	char type[4] = {0};
-	bool type_specified = false;
-	if (findKeyVal(p, type, 4, PSTR("type"), true))
-		type_specified = true;
+	uint16_t types = LOG_TYPE_ALL & ~((1<<LOGDATA_WATERLEVEL) | (1<<LOGDATA_FLOWSENSE));
+	if (findKeyVal(p, type, 4, PSTR("type"), true)) {
+		byte type_index = log_type_index(type);
+		types = (type_index<LOG_NUM_TYPES) ? (1<<type_index) : 0;
+	}
 
 #if defined(ESP8266)
 	// as the log data can be large, we will use ESP8266's sendContent function to
@@ -1638,81 +1748,186 @@ void server_json_log() {
 	bfill.emit_p(PSTR("["));
 
 	bool comma = 0;
-	for(unsigned int i=start;i<=end;i++) {
-		itoa(i, tmp_buffer, 10);
-		make_logfile_name(tmp_buffer);
-
-#if defined(ESP8266)
-		File file = SPIFFS.open(tmp_buffer, "r");
-		if(!file) continue;
-#elif defined(ARDUINO)
-		if (!sd.exists(tmp_buffer)) continue;
-		SdFile file;
-		file.open(tmp_buffer, O_READ);
-#else // prepare to open log file for RPI/BBB
-		FILE *file = fopen(get_filename_fullpath(tmp_buffer), "rb");
-		if(!file) continue;
-#endif // prepare to open log file
-
-		int res;
-		while(true) {
-		#if defined(ESP8266)
-			// do not use file.readBytes or readBytesUntil because it's very slow
-			int res = file_fgets(file, tmp_buffer, TMP_BUFFER_SIZE);
-			if (res <= 0) {
-				file.close();
-				break;
-			}
-			tmp_buffer[res]=0;
-		#elif defined(ARDUINO)
-			res = file.fgets(tmp_buffer, TMP_BUFFER_SIZE);
-			if (res <= 0) {
-				file.close();
-				break;
-			}
-		#else
-			if(fgets(tmp_buffer, TMP_BUFFER_SIZE, file)) {
-				res = strlen(tmp_buffer);
-			} else {
-				res = 0;
-			}
-			if (res <= 0) {
-				fclose(file);
-				break;
-			}
-		#endif
-			// check record type
-			// records are all in the form of [x,"xx",...]
-			// where x is program index (>0) if this is a station record
-			// and "xx" is the type name if this is a special record (e.g. wl, fl, rs)
-
-			// search string until we find the first comma
-			char *ptype = tmp_buffer;
-			tmp_buffer[TMP_BUFFER_SIZE-1]=0; // make sure the search will end
-			while(*ptype && *ptype != ',') ptype++;
-			if(*ptype != ',') continue; // didn't find comma, move on
-			ptype++;	// move past comma
-
-			if (type_specified && strncmp(type, ptype+1, 2))
-				continue;
-			// if type is not specified, output everything except "wl" and "fl" records
-			if (!type_specified && (!strncmp("wl", ptype+1, 2) || !strncmp("fl", ptype+1, 2)))
-				continue;
+	ulong count = 0;
+	LogReader reader;
+	LogRecord r;
+	log_flush();	// so that the queued records are included
+	reader.filter(types, start, end);
+	for(ulong i=start/86400L;i<=end/86400L && (!limit || count<limit);i++) {
+		// days without a log are skipped by the index, without touching the file system
+		if(!reader.open(i)) continue;
+		while((!limit || count<limit) && reader.next(r)) {
 			// if this is the first record, do not print comma
 			if (comma)	bfill.emit_p(PSTR(","));
 			else {comma=1;}
+			log_render(r, tmp_buffer);
 			bfill.emit_p(PSTR("$S"), tmp_buffer);
+			count++;
 			// if the available ether buffer size is getting small
 			// push out a packet
 			if (available_ether_buffer() < 60) {
 				send_packet();
 			}
 		}
+		reader.close();
 	}
 
 	bfill.emit_p(PSTR("]"));
 	handle_return(HTML_OK);
 }
+/**
+ * Get daily rollups
+ * Command: /jr?start=x&end=x&hist=x
+ *
+ * hist:	history (past n days)
+ *				when hist is speceified, the start
+ *				and end parameters below will be ignored
+ * start: start time (epoch time)
+ * end:		end time (epoch time)
+ *
+ * Returns one element per day and counting chunk: [day,pulses,[[sid,runs,seconds,skips],...]]
+ * Elements of the same day add up.
+ */
+void server_json_rollups() {
+
+#if defined(ESP8266)
+	char *p = NULL;
+	if(!process_password()) return;
+	if (m_client)
+		p = get_buffer;  
+#else
+	char *p = get_buffer;
+#endif
+
+	ulong start, end;	// in days
+
+	if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("hist"), true)) {
+		int hist = atoi(tmp_buffer);
+		if (hist< 0 || hist > 365) handle_return(HTML_DATA_OUTOFBOUND);
+		end = os.now_tz() / 86400L;
+		start = end - hist;
+	} else {
+		if (!findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("start"), true)) handle_return(HTML_DATA_MISSING);
+		start = atol(tmp_buffer) / 86400L;
+		if (!findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("end"), true)) handle_return(HTML_DATA_MISSING);
+		end = atol(tmp_buffer) / 86400L;
+		// start must be prior to end, and can't retrieve more than 365 days of data
+		if ((start>end) || (end-start)>365) handle_return(HTML_DATA_OUTOFBOUND);
+	}
+
+#if defined(ESP8266)
+	rewind_ether_buffer();
+#endif
+	print_json_header(false);
+
+	bfill.emit_p(PSTR("["));
+	rollup_flush();	// so that today's counters are included
+	RollupReader reader;
+	RollupEntry e;
+	ulong day, pulses;
+	bool comma = 0;
+	if (reader.open(start, end)) {
+		while (reader.next_day(day, pulses)) {
+			bfill.emit_p(comma?PSTR(",[$L,$L,["):PSTR("[$L,$L,["), day, pulses);
+			comma = 1;
+			bool ecomma = 0;
+			while (reader.next_entry(e)) {
+				bfill.emit_p(ecomma?PSTR(",[$D,$L,$L,$L]"):PSTR("[$D,$L,$L,$L]"), e.sid, e.runs, e.secs, e.skips);
+				ecomma = 1;
+				if (available_ether_buffer() < 60) {
+					send_packet();
+				}
+			}
+			bfill.emit_p(PSTR("]]"));
+		}
+		reader.close();
+	}
+	bfill.emit_p(PSTR("]"));
+	handle_return(HTML_OK);
+}
+
+#if defined(ESP8266)
+static WiFiClient raw_log_client;
+static bool raw_log_write(const byte *data, ulong len) {
+	return raw_log_client.write(data, len)==len;
+}
+#endif
+
+/**
+ * Download raw log files
+ * Command: /lr?start=x&end=x&hist=x
+ *
+ * hist:	history (past n days)
+ *				when hist is speceified, the start
+ *				and end parameters below will be ignored
+ * start: start time (epoch time)
+ * end:		end time (epoch time)
+ *
+ * Streams the binary log files (see oslog.h) of the days in the range back
+ * to back, with a Content-Length. A single "Range: bytes=" request header is
+ * honored with a 206 response, so an interrupted download can be resumed as
+ * long as the range of days is the same and no day of it has been pruned.
+ */
+void server_raw_log() {
+#if defined(ESP8266)
+	char *p = NULL;
+	if(!process_password()) return;
+	if (m_client) handle_return(HTML_NOT_PERMITTED);	// files are only streamed by the web server
+
+	ulong start, end;	// in days
+
+	if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("hist"), true)) {
+		int hist = atoi(tmp_buffer);
+		if (hist< 0 || hist > 365) handle_return(HTML_DATA_OUTOFBOUND);
+		end = os.now_tz() / 86400L;
+		start = end - hist;
+	} else {
+		if (!findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("start"), true)) handle_return(HTML_DATA_MISSING);
+		start = atol(tmp_buffer) / 86400L;
+		if (!findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("end"), true)) handle_return(HTML_DATA_MISSING);
+		end = atol(tmp_buffer) / 86400L;
+		if ((start>end) || (end-start)>365) handle_return(HTML_DATA_OUTOFBOUND);
+	}
+
+	// size of the download
+	ulong total = log_raw_size(start, end);
+
+	ulong from = 0, to = total-1;
+	bool ranged = wifi_server->hasHeader("Range");
+	wifi_server->sendHeader("Accept-Ranges", "bytes");
+	wifi_server->sendHeader("Access-Control-Allow-Origin", "*");
+	if (ranged && !log_parse_range(wifi_server->header("Range").c_str(), total, from, to)) {
+		strcpy_P(tmp_buffer, PSTR("bytes */"));
+		ultoa(total, tmp_buffer+strlen(tmp_buffer), 10);
+		wifi_server->sendHeader("Content-Range", tmp_buffer);
+		wifi_server->send(416, "text/plain", "");
+		return;
+	}
+	if (ranged) {
+		strcpy_P(tmp_buffer, PSTR("bytes "));
+		ultoa(from, tmp_buffer+strlen(tmp_buffer), 10);
+		strcat_P(tmp_buffer, PSTR("-"));
+		ultoa(to, tmp_buffer+strlen(tmp_buffer), 10);
+		strcat_P(tmp_buffer, PSTR("/"));
+		ultoa(total, tmp_buffer+strlen(tmp_buffer), 10);
+		wifi_server->sendHeader("Content-Range", tmp_buffer);
+	}
+	wifi_server->setContentLength(total ? to-from+1 : 0);
+	wifi_server->send(ranged ? 206 : 200, "application/octet-stream", "");
+	if (!total) return;
+
+	// stream the files in large blocks, using the ether buffer
+	raw_log_client = wifi_server->client();
+	if (!log_raw_copy(start, end, from, to, (byte*)ether_buffer, ETHER_BUFFER_SIZE, raw_log_write)) {
+		// read error or the client has gone: give up, it can resume with a range
+		raw_log_client.stop();
+	}
+	raw_log_client = WiFiClient();
+#else
+	handle_return(HTML_NOT_PERMITTED);
+#endif
+}
+
 /**
  * Delete log
  * Command: /dl?pw=xxx&day=xxx
@@ -1740,6 +1955,68 @@ void server_delete_log() {
 	handle_return(HTML_SUCCESS);
 }
 
+/**
+ * Schedule forecast
+ * Command: /jf?pw=xxx&days=x
+ *
+ * pw:	 password
+ * days: number of days to forecast (default 1)
+ *
+ * Output: {"start":x,"end":x,"runs":[[pid,sid,start,end],...]}
+ * Runs already in the runtime queue are listed first, followed by
+ * the projected runs of program schedules until "end".
+ */
+void server_json_forecast() {
+#if defined(ESP8266)
+	char *p = NULL;
+	if(!process_password()) return;
+	if (m_client)
+		p = get_buffer;
+#else
+	char *p = get_buffer;
+#endif
+
+	int days = 1;
+	if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("days"), true)) {
+		days = atoi(tmp_buffer);
+		if (days < 1 || days > FORECAST_MAX_DAYS) handle_return(HTML_DATA_OUTOFBOUND);
+	}
+
+	ulong curr_time = os.now_tz();
+	ulong end_time = forecast_schedule(curr_time, curr_time+(ulong)days*86400L);
+	if (end_time > curr_time+(ulong)days*86400L) end_time = curr_time+(ulong)days*86400L;
+
+#if defined(ESP8266)
+	rewind_ether_buffer();
+#endif
+	print_json_header();
+	bfill.emit_p(PSTR("\"start\":$L,\"end\":$L,\"runs\":["), curr_time, end_time);
+
+	bool comma = 0;
+	RuntimeQueueStruct *q;
+	for(byte i=0;i<pd.nqueue;i++) {
+		q = pd.queue + pd.qorder[i];
+		if(!q->st || !q->dur || curr_time>=q->st+q->dur) continue;
+		if (comma) bfill.emit_p(PSTR(","));
+		else {comma=1;}
+		bfill.emit_p(PSTR("[$D,$D,$L,$L]"), q->pid, q->sid, q->st, q->st+q->dur);
+	}
+	for(uint16_t i=0;i<forecast_nruns;i++) {
+		q = &forecast_runs[i].q;
+		if (forecast_runs[i].qt >= end_time) break;
+		if (comma) bfill.emit_p(PSTR(","));
+		else {comma=1;}
+		bfill.emit_p(PSTR("[$D,$D,$L,$L]"), q->pid, q->sid, q->st, q->st+q->dur);
+		// if the available ether buffer size is getting small
+		// push out a packet
+		if (available_ether_buffer() < 60) {
+			send_packet();
+		}
+	}
+	bfill.emit_p(PSTR("]}"));
+	handle_return(HTML_OK);
+}
+
 /** Output all JSON data, including jc, jp, jo, js, jn */
 void server_json_all() {
 #if defined(ESP8266)
@@ -1774,15 +2051,39 @@ static int freeHeap () {
 #endif
 
 #if defined(ARDUINO)
+static const char* const storage_op_names[NUM_STORAGE_OPS] = {
+	"open", "read", "write", "seek", "list", "remove", "stat"
+};
+
 void server_json_debug() {
   rewind_ether_buffer();
   print_json_header();
   bfill.emit_p(PSTR("\"date\":\"$S\",\"time\":\"$S\",\"heap\":$D"), __DATE__, __TIME__,
   #if defined(ESP8266)
   (uint16_t)ESP.getFreeHeap());
-  FSInfo fs_info;
-	SPIFFS.info(fs_info);
-  bfill.emit_p(PSTR(",\"flash\":$D,\"used\":$D}"), fs_info.totalBytes, fs_info.usedBytes);
+  ulong fs_total, fs_used;
+  storage_info(&fs_total, &fs_used);
+  bfill.emit_p(PSTR(",\"flash\":$L,\"used\":$L"), fs_total, fs_used);
+  // boot timing in ms: options setup, and from power-up until the web server started
+  bfill.emit_p(PSTR(",\"boot\":{\"opts\":$L,\"ready\":$L}"), boot_options_ms, boot_ready_ms);
+  // runtime queue usage: size, high-water mark, rejected elements and rejected runs per program
+  bfill.emit_p(PSTR(",\"queue\":{\"size\":$D,\"peak\":$D,\"rej\":$D,\"drops\":["),
+               RUNTIME_QUEUE_SIZE, pd.queue_peak, pd.queue_rejects);
+  for(byte pid=0;pid<pd.nprograms;pid++) {
+    bfill.emit_p(pid?PSTR(",$D"):PSTR("$D"), pd.prog_drops[pid]);
+  }
+  bfill.emit_p(PSTR("]}"));
+  // storage backend counters: [calls,bytes,microseconds] per operation
+  bfill.emit_p(PSTR(",\"storage\":{"));
+  for(byte op=0;op<NUM_STORAGE_OPS;op++) {
+    StorageStat &st = storage_stats[op];
+    bfill.emit_p(PSTR("$S\"$S\":[$L,$L,$L]"), op?",":"", storage_op_names[op], st.calls, st.bytes, st.micros);
+  }
+  bfill.emit_p(PSTR("}"));
+  // log footprint and pruning
+  const LogStats &ls = log_get_stats();
+  bfill.emit_p(PSTR(",\"logs\":{\"files\":$L,\"bytes\":$L,\"oldest\":$L,\"pruned\":$L,\"prune\":$L}}"),
+               ls.files, ls.bytes, ls.oldest, ls.pruned, ls.prune_time);
   #else
   (uint16_t)freeHeap());
   bfill.emit_p(PSTR("}"));
@@ -1821,6 +2122,10 @@ const char _url_keys[] PROGMEM =
 	"su"
 	"cu"
 	"ja"
+	"jf"
+	"bp"
+	"jr"
+	"lr"
 #if defined(ARDUINO)  
   "db"
 #endif	
@@ -1849,6 +2154,10 @@ URLHandler urls[] = {
 	server_view_scripturl,	// su
 	server_change_scripturl,// cu
 	server_json_all,				// ja
+	server_json_forecast,		// jf
+	server_batch_programs,	// bp
+	server_json_rollups,		// jr
+	server_raw_log,					// lr
 #if defined(ARDUINO)  
   server_json_debug,			// db
 #endif	
@@ -1938,6 +2247,12 @@ void on_ap_upload() {
 	delay(0);
 }
 
+/** Request headers read by the handlers */
+static void collect_request_headers() {
+	static const char *headers[] = {"Range"};
+	wifi_server->collectHeaders(headers, 1);
+}
+
 void start_server_client() {
 	if(!wifi_server) return;
 	
@@ -1945,6 +2260,8 @@ void start_server_client() {
 	wifi_server->on("/index.html", server_home);
 	wifi_server->on("/update", HTTP_GET, on_sta_update); // handle firmware update
 	wifi_server->on("/update", HTTP_POST, on_sta_upload_fin, on_sta_upload);	
+
+	collect_request_headers();
 	
 	// set up all other handlers
 	char uri[4];
@@ -1956,6 +2273,7 @@ void start_server_client() {
 		wifi_server->on(uri, urls[i]);
 	}
 	wifi_server->begin();
+	if(!boot_ready_ms) boot_ready_ms = millis();
 }
 
 void start_server_ap() {
@@ -1972,6 +2290,7 @@ void start_server_ap() {
 	wifi_server->on("/update", HTTP_GET, on_ap_update);
 	wifi_server->on("/update", HTTP_POST, on_ap_upload_fin, on_ap_upload);
 	wifi_server->onNotFound(on_ap_home);
+	collect_request_headers();
 
 	// set up all other handlers
 	char uri[4];
@@ -1984,6 +2303,7 @@ void start_server_ap() {
 	}
 	
 	wifi_server->begin();
+	if(!boot_ready_ms) boot_ready_ms = millis();
 	os.lcd.setCursor(0, -1);
 	os.lcd.print(F("OSAP:"));
 	os.lcd.print(ap_ssid);
@@ -68,7 +68,7 @@ public:
 			}
 			case 'O': {
 				uint16_t oid = va_arg(ap, int);
-				file_read_block(SOPTS_FILENAME, (char*) ptr, oid*MAX_SOPTS_SIZE, MAX_SOPTS_SIZE);
+				OpenSprinkler::sopt_load(oid, (char*) ptr);
 			}
 				break;
 			default:
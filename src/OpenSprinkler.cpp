@@ -23,6 +23,7 @@
 
 #include "OpenSprinkler.h"
 #include "OSserver.h"
+#include "oslog.h"
 
 /** Declare static data members */
 NVConData OpenSprinkler::nvdata;
@@ -33,7 +34,7 @@ byte OpenSprinkler::hw_rev;
 
 byte OpenSprinkler::nboards;
 byte OpenSprinkler::nstations;
-byte OpenSprinkler::station_bits[1+MAX_EXT_BOARDS];	//main station + external stations
+byte OpenSprinkler::station_bits[STATION_BYTES] __attribute__((aligned(4)));	//main station + external stations
 byte OpenSprinkler::engage_booster;
 uint16_t OpenSprinkler::baseline_current;
 
@@ -55,14 +56,24 @@ uint8_t OpenSprinkler::last_reboot_cause = REBOOT_CAUSE_NONE;
 byte OpenSprinkler::weather_update_flag;
 
 // todo future: the following attribute bytes are for backward compatibility
-byte OpenSprinkler::attrib_mas[1+MAX_EXT_BOARDS];
-byte OpenSprinkler::attrib_igs[1+MAX_EXT_BOARDS];
-byte OpenSprinkler::attrib_mas2[1+MAX_EXT_BOARDS];
-byte OpenSprinkler::attrib_igs2[1+MAX_EXT_BOARDS];
-byte OpenSprinkler::attrib_igrd[1+MAX_EXT_BOARDS];
-byte OpenSprinkler::attrib_dis[1+MAX_EXT_BOARDS];
-byte OpenSprinkler::attrib_seq[1+MAX_EXT_BOARDS];
-byte OpenSprinkler::attrib_spe[1+MAX_EXT_BOARDS];
+byte OpenSprinkler::attrib_mas[STATION_BYTES] __attribute__((aligned(4)));
+byte OpenSprinkler::attrib_igs[STATION_BYTES] __attribute__((aligned(4)));
+byte OpenSprinkler::attrib_mas2[STATION_BYTES] __attribute__((aligned(4)));
+byte OpenSprinkler::attrib_igs2[STATION_BYTES] __attribute__((aligned(4)));
+byte OpenSprinkler::attrib_igrd[STATION_BYTES] __attribute__((aligned(4)));
+byte OpenSprinkler::attrib_dis[STATION_BYTES] __attribute__((aligned(4)));
+byte OpenSprinkler::attrib_seq[STATION_BYTES] __attribute__((aligned(4)));
+byte OpenSprinkler::attrib_spe[STATION_BYTES] __attribute__((aligned(4)));
+byte OpenSprinkler::attrib_grp[MAX_NUM_STATIONS];
+uint16_t OpenSprinkler::station_flow[MAX_NUM_STATIONS];
+byte OpenSprinkler::station_types[MAX_NUM_STATIONS];
+StringPool<STATION_NAMES_POOL_SIZE, MAX_NUM_STATIONS> OpenSprinkler::station_names;
+StringPool<SOPTS_POOL_SIZE, NUM_SOPTS> OpenSprinkler::sopts_cache;
+byte OpenSprinkler::dirty = 0;
+byte OpenSprinkler::attrib_dirty[STATION_BYTES];
+ConfigHeader OpenSprinkler::config_head;
+byte OpenSprinkler::config_slot = 1;
+ulong OpenSprinkler::dirty_millis = 0;
 	
 extern char tmp_buffer[];
 extern char ether_buffer[];
@@ -70,8 +81,8 @@ extern char ether_buffer[];
 
 SSD1306Display OpenSprinkler::lcd(LCD_I2CADDR, SDA, SCL);
 byte OpenSprinkler::state = OS_STATE_INITIAL;
-byte OpenSprinkler::prev_station_bits[1+MAX_EXT_BOARDS];
-MCP23017* OpenSprinkler::expanders[MAX_EXT_BOARDS];
+byte OpenSprinkler::prev_station_bits[STATION_BYTES];
+MCP23017* OpenSprinkler::expanders[MAX_NUM_EXPANDERS];
 MCP23017* OpenSprinkler::mainio;
 byte OpenSprinkler::expanders_detected = 0;
 String OpenSprinkler::wifi_ssid="";
@@ -149,6 +160,12 @@ const char iopt_json_names[] PROGMEM =
 	"subn4"
 	"wimod"
 	"reset"
+	"flim\0"
+	"ldays"
+	"lpct\0"
+	"sdt1\0"
+	"sdt2\0"
+	"sdt3\0"
 	;
 
 // for String options
@@ -233,7 +250,13 @@ const char iopt_prompts[] PROGMEM =
 	"Subnet mask3:   "
 	"Subnet mask4:   "
 	"WiFi mode?      "
-	"Factory reset?  ";
+	"Factory reset?  "
+	"Flow limit:     "
+	"Log max days:   "
+	"Log max flash %:"
+	"Grp1 delay (sec)"
+	"Grp2 delay (sec)"
+	"Grp3 delay (sec)";
 	
 // string options do not have prompts 
 
@@ -302,7 +325,13 @@ const byte iopt_max[] PROGMEM = {
 	255,
 	255,
 	255,
-	1
+	1,
+	255,
+	255,
+	90,
+	240,
+	240,
+	240
 };
 
 // string options do not have maximum values
@@ -377,7 +406,13 @@ byte OpenSprinkler::iopts[] = {
 	255,// subnet mask 3
 	0,
 	WIFI_MODE_AP, // wifi mode
-	0		// reset
+	0,	// reset
+	0,	// flow limit: total expected flow of concurrent stations (0: no limit)
+	0,	// log max days: delete logs older than this many days (0: no limit)
+	25,	// log max flash %: delete the oldest logs when they take more of the flash (0: no limit)
+	120,// station delay time of sequential group 1
+	120,// station delay time of sequential group 2
+	120	// station delay time of sequential group 3
 };
 
 /** String option values (stored in RAM) */
@@ -464,6 +499,10 @@ void OpenSprinkler::reboot_dev(uint8_t cause) {
 		nvdata.reboot_cause = cause;
 		nvdata_save();
 	}
+	log_flush();
+	rollup_flush();
+	flush_dirty(true);
+	file_flush_all();
 	ESP.restart();
 }
 
@@ -512,7 +551,7 @@ void OpenSprinkler::begin() {
 	PIN_SENSOR2 = V1_PIN_SENSOR2;
 	#endif
 	/* detect expanders */
-	for(byte i=0;i<MAX_EXT_BOARDS;i++)
+	for(byte i=0;i<MAX_NUM_EXPANDERS;i++)
 		expanders[i] = NULL;
 	detect_expanders();		
 
@@ -561,7 +600,7 @@ void OpenSprinkler::begin() {
 	lcd.print(F("Init file system"));
 	lcd.setCursor(0,1);
 	
-	if(!SPIFFS.begin()) {
+	if(!storage_begin()) {
 		// !!! flash init failed, stall as we cannot proceed
 		lcd.setCursor(0, 0);
 		lcd_print_pgm(PSTR("Error Code: 0x2D"));
@@ -603,7 +642,8 @@ void OpenSprinkler::apply_all_station_bits() {
 		mainio->portWrite(PORTA, reg); 
 			
 		// Handle expansion boards
-		for(int i=0;i<MAX_EXT_BOARDS;i++) {				//TODO check that
+		// boards without an expander are only used by special stations
+		for(int i=0;i<MAX_NUM_EXPANDERS;i++) {				//TODO check that
 			uint16_t data = station_bits[i+1];	//
 			//data = (data<<8) + station_bits[i*2+1];
 			if(expanders[i] !=NULL) {
@@ -615,9 +655,9 @@ void OpenSprinkler::apply_all_station_bits() {
 
 	if(iopts[IOPT_SPE_AUTO_REFRESH]) {
 		// handle refresh of RF and remote stations
-		// we refresh the station whose index is the current time modulo MAX_NUM_STATIONS
+		// we refresh the station whose index is the current time modulo the number of stations
 		static byte last_sid = 0;
-		byte sid = now() % MAX_NUM_STATIONS;
+		byte sid = now() % nstations;
 		if (sid != last_sid) {	// avoid refreshing the same station twice in a roll
 			last_sid = sid;
 			bid=sid>>3;
@@ -791,70 +831,189 @@ static ulong hex2ulong(byte *code, byte len) {
 	return v;
 }
 
+/** Name of the special data file of station sid */
+static void special_file_name(char *buf, byte sid) {
+	strcpy_P(buf, PSTR(SPECIAL_FILE_PREFIX));
+	ultoa(sid, buf+strlen(buf), 10);
+	strcat_P(buf, PSTR(".dat"));
+}
+
 /** Get station data */
 void OpenSprinkler::get_station_data(byte sid, StationData* data) {
-	file_read_block(STATIONS_FILENAME, data, (uint32_t)sid*sizeof(StationData), sizeof(StationData));
+	file_read_block(STATIONS_FILENAME, data, (uint32_t)sid*STATION_RECORD_SIZE, STATION_RECORD_SIZE);
+	data->sped[0]='0';
+	data->sped[1]=0;
+	if(data->type!=STN_TYPE_STANDARD) {
+		char fn[16];
+		special_file_name(fn, sid);
+		file_read_block(fn, data->sped, 0, STATION_SPECIAL_DATA_SIZE);
+	}
 }
 
 /** Set station data */
 void OpenSprinkler::set_station_data(byte sid, StationData* data) {
-	file_write_block(STATIONS_FILENAME, data, (uint32_t)sid*sizeof(StationData), sizeof(StationData));
-}
+	set_station_special(sid, &data->type);
+	file_write_block(STATIONS_FILENAME, data, (uint32_t)sid*STATION_RECORD_SIZE, STATION_RECORD_SIZE);
+	char name[STATION_NAME_SIZE+1];
+	strncpy(name, data->name, STATION_NAME_SIZE);
+	name[STATION_NAME_SIZE]=0;
+	station_names.set(sid, name);
+}
+
+/** Station table
+ * Station names and types are kept in RAM, loaded by attribs_load and
+ * written through to flash, so listing stations or switching a special station
+ * does not read the station file. If the name pool is full, the names that do not fit
+ * are read from flash.
+ */
 
 /** Get station name */
 void OpenSprinkler::get_station_name(byte sid, char tmp[]) {
+	const char *name = station_names.get(sid);
+	if(name) {
+		strcpy(tmp, name);
+		return;
+	}
 	tmp[STATION_NAME_SIZE]=0;
-	file_read_block(STATIONS_FILENAME, tmp, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, name), STATION_NAME_SIZE); 
+	file_read_block(STATIONS_FILENAME, tmp, (uint32_t)sid*STATION_RECORD_SIZE+offsetof(StationData, name), STATION_NAME_SIZE); 
 }
 
 /** Set station name */
 void OpenSprinkler::set_station_name(byte sid, char tmp[]) {
 	// todo: store the right size
 	tmp[STATION_NAME_SIZE]=0;
-	file_write_block(STATIONS_FILENAME, tmp, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, name), STATION_NAME_SIZE);
+	file_write_block(STATIONS_FILENAME, tmp, (uint32_t)sid*STATION_RECORD_SIZE+offsetof(StationData, name), STATION_NAME_SIZE);
+	station_names.set(sid, tmp);
 }
 
 /** Get station type */
 byte OpenSprinkler::get_station_type(byte sid) {
-	return file_read_byte(STATIONS_FILENAME, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, type));
+	return station_types[sid];
+}
+
+/** Set station type and special data
+ * The special data is written before the type, so a special station always has its data */
+void OpenSprinkler::set_station_special(byte sid, const byte *buf) {
+	char fn[16];
+	special_file_name(fn, sid);
+	if(buf[0]!=STN_TYPE_STANDARD) {
+		file_write_block(fn, buf+1, 0, STATION_SPECIAL_DATA_SIZE);
+	}
+	file_write_block(STATIONS_FILENAME, buf, (uint32_t)sid*STATION_RECORD_SIZE+offsetof(StationData,type), 1);
+	if(buf[0]==STN_TYPE_STANDARD && station_types[sid]!=STN_TYPE_STANDARD) {
+		remove_file(fn);
+	}
+	station_types[sid] = buf[0];
 }
 
 /** Get station attribute */
 /*void OpenSprinkler::get_station_attrib(byte sid, StationAttrib *attrib); {
-	file_read_block(STATIONS_FILENAME, attrib, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, attrib), sizeof(StationAttrib));
+	file_read_block(STATIONS_FILENAME, attrib, (uint32_t)sid*STATION_RECORD_SIZE+offsetof(StationData, attrib), sizeof(StationAttrib));
 }*/
 
 /** Save all station attribs to file (backward compatibility) */
 void OpenSprinkler::attribs_save() {
-	// re-package attribute bits and save
+	// the attribute bits are written back by flush_dirty
 	byte bid, s, sid=0;
-	StationAttrib at;
 	byte ty = STN_TYPE_STANDARD;
 	for(bid=0;bid<(1+MAX_EXT_BOARDS);bid++) {	//for(bid=0;bid<(1+MAX_NUM_BOARDS;bid++) {
 		for(s=0;s<8;s++,sid++) {
+			if(attrib_spe[bid]>>s==0 && get_station_type(sid)!=STN_TYPE_STANDARD) {
+				// if station special bit is 0, make sure to write type STANDARD
+				set_station_special(sid, &ty);
+			}
+		}
+	}
+	memset(attrib_dirty, 0xFF, STATION_BYTES);
+	mark_dirty(DIRTY_ATTRIBS);
+}
+
+/** Write the bytes of src that differ from the file content as one block */
+static void file_write_changes(const char *fn, const void *src, ulong pos, ulong len) {
+	byte buf[32];
+	const byte *p = (const byte*)src;
+	ulong size = file_size(fn);
+	long lo = -1, hi = -1;
+	for(ulong i=0;i<len;i+=sizeof(buf)) {
+		ulong n = (len-i<sizeof(buf)) ? len-i : sizeof(buf);
+		file_read_block(fn, buf, pos+i, n);
+		for(ulong k=0;k<n;k++) {
+			// bytes beyond the end of the file always count as changed
+			if(pos+i+k>=size || buf[k]!=p[i+k]) {
+				if(lo<0) lo = i+k;
+				hi = i+k;
+			}
+		}
+	}
+	if(lo>=0) file_write_block(fn, p+lo, pos+lo, hi-lo+1);
+}
+
+/** Write-back
+ * iopts_save, nvdata_save and attribs_save only mark the data dirty. The data is
+ * written to flash once no save has happened for WRITEBACK_DELAY_MS, before the
+ * data is loaded again and before reboot, so several saves in a row cost one
+ * write, and only the bytes that changed are written.
+ */
+void OpenSprinkler::mark_dirty(byte flags) {
+	dirty |= flags;
+	dirty_millis = millis();
+}
+
+/** Mark the attributes of one station dirty, only its record is written back */
+void OpenSprinkler::mark_station_dirty(byte sid) {
+	attrib_dirty[sid>>3] |= (1<<(sid&0x07));
+	mark_dirty(DIRTY_ATTRIBS);
+}
+
+/** Write the dirty data selected by flags to flash, right away if force is set */
+void OpenSprinkler::flush_dirty(bool force, byte flags) {
+	if(!(dirty & flags)) return;
+	if(!force && millis()-dirty_millis < WRITEBACK_DELAY_MS) return;
+	if(dirty & flags & DIRTY_CONFIG) {
+		config_commit();
+	}
+	bool more = false;
+	if(dirty & flags & DIRTY_ATTRIBS) {
+		// re-package the attribute bits of the dirty stations and save their records,
+		// at most ATTRIB_FLUSH_MAX records per call unless forced
+		byte sid, n=0;
+		StationAttrib at;
+		for(sid=0;sid<MAX_NUM_STATIONS;sid++) {
+			byte bid = sid>>3, s = sid&0x07;
+			if(!(attrib_dirty[bid] & (1<<s))) continue;
+			if(!force && n==ATTRIB_FLUSH_MAX) { more = true; break; }
 			at.mas = (attrib_mas[bid]>>s) & 1;
 			at.igs = (attrib_igs[bid]>>s) & 1;
 			at.mas2= (attrib_mas2[bid]>>s)& 1;
 			at.igs2= (attrib_igs2[bid]>>s) & 1;
-			at.igrd= (attrib_igrd[bid]>>s) & 1;			 
+			at.igrd= (attrib_igrd[bid]>>s) & 1;
 			at.dis = (attrib_dis[bid]>>s) & 1;
 			at.seq = (attrib_seq[bid]>>s) & 1;
-			at.gid = 0;
-			file_write_block(STATIONS_FILENAME, &at, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, attrib), 1); // attribte bits are 1 byte long
-			if(attrib_spe[bid]>>s==0) {
-				// if station special bit is 0, make sure to write type STANDARD
-				file_write_block(STATIONS_FILENAME, &ty, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, type), 1); // attribte bits are 1 byte long
-			}
+			at.unused = 0;
+			at.gid = attrib_grp[sid];
+			at.dummy = 0;
+			at.flow[0] = station_flow[sid] & 0xFF;
+			at.flow[1] = station_flow[sid] >> 8;
+			file_write_changes(STATIONS_FILENAME, &at, (uint32_t)sid*STATION_RECORD_SIZE+offsetof(StationData, attrib), sizeof(StationAttrib));
+			attrib_dirty[bid] &= ~(1<<s);
+			n++;
+			delay(0);
 		}
 	}
+	dirty &= ~flags;
+	if(more) dirty |= DIRTY_ATTRIBS;
 }
 
 /** Load all station attribs from file (backward compatibility) */
 void OpenSprinkler::attribs_load() {
-	// load and re-package attributes
+	flush_dirty(true, DIRTY_ATTRIBS);
+	// load and re-package attributes, and fill the station table
 	byte bid, s, sid=0;
+	StationData *pdata = (StationData*)tmp_buffer;
 	StationAttrib at;
 	byte ty;
+	char name[STATION_NAME_SIZE+1];
+	station_names.clear();
 	memset(attrib_mas, 0, nboards);
 	memset(attrib_igs, 0, nboards);
 	memset(attrib_mas2, 0, nboards);
@@ -866,7 +1025,15 @@ void OpenSprinkler::attribs_load() {
 								
 	for(bid=0;bid<(1+MAX_EXT_BOARDS);bid++) {
 		for(s=0;s<8;s++,sid++) {
-			file_read_block(STATIONS_FILENAME, &at, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, attrib), sizeof(StationAttrib));
+			// read name, attributes and type at once
+			file_read_block(STATIONS_FILENAME, pdata, (uint32_t)sid*STATION_RECORD_SIZE, STATION_RECORD_SIZE);
+			at = pdata->attrib;
+			ty = pdata->type;
+			// names are not 0-terminated if 32 characters long
+			strncpy(name, pdata->name, STATION_NAME_SIZE);
+			name[STATION_NAME_SIZE] = 0;
+			station_names.set(sid, name);
+			station_types[sid] = ty;
 			attrib_mas[bid] |= (at.mas<<s);
 			attrib_igs[bid] |= (at.igs<<s);
 			attrib_mas2[bid]|= (at.mas2<<s);
@@ -874,7 +1041,8 @@ void OpenSprinkler::attribs_load() {
 			attrib_igrd[bid]|= (at.igrd<<s);
 			attrib_dis[bid] |= (at.dis<<s);
 			attrib_seq[bid] |= (at.seq<<s);
-			file_read_block(STATIONS_FILENAME, &ty, (uint32_t)sid*sizeof(StationData)+offsetof(StationData, type), 1);
+			attrib_grp[sid] = (at.gid<NUM_SEQ_GROUPS) ? at.gid : 0;
+			station_flow[sid] = at.flow[0] | ((uint16_t)at.flow[1]<<8);
 			if(ty!=STN_TYPE_STANDARD) {
 				attrib_spe[bid] |= (1<<s);
 			}
@@ -882,8 +1050,17 @@ void OpenSprinkler::attribs_load() {
 	}
 }
 
+/** Save the expected flow rate of a station */
+void OpenSprinkler::set_station_flow(byte sid, uint16_t flow) {
+	if(station_flow[sid] == flow) return;
+	station_flow[sid] = flow;
+	mark_station_dirty(sid);
+}
+
 /** verify if a string matches password */
 byte OpenSprinkler::password_verify(char *pw) {
+	const char *v = sopts_cache.get(SOPT_PASSWORD);
+	if(v) return (strcmp(pw, v)==0) ? 1 : 0;
 	return (file_cmp_block(SOPTS_FILENAME, pw, SOPT_PASSWORD*MAX_SOPTS_SIZE)==0) ? 1 : 0;
 }
 
@@ -959,11 +1136,17 @@ byte OpenSprinkler::set_station_bit(byte sid, byte value) {
 	return 0;
 }
 
-/** Clear all station bits */
+/** Clear all station bits
+ * Only the stations that are on are visited, one station bit word at a time
+ */
 void OpenSprinkler::clear_all_station_bits() {
-	byte sid;
-	for(sid=0;sid<=MAX_NUM_STATIONS;sid++) {
-		set_station_bit(sid, 0);
+	for(byte i=0;i<STATION_WORDS;i++) {
+		uint32_t w = station_word(station_bits, i);
+		while (w) {
+			byte sid = (i<<5) + __builtin_ctzl(w);
+			w &= w-1;
+			if (sid < MAX_NUM_STATIONS) set_station_bit(sid, 0);
+		}
 	}
 }
 
@@ -1196,10 +1379,15 @@ void OpenSprinkler::switch_httpstation(HTTPStationData *data, bool turnon) {
 /** Setup function for options */
 void OpenSprinkler::options_setup() {
 
+	// Load the configuration, keeping the default options for a reset
+	byte defaults[NUM_IOPTS];
+	memcpy(defaults, iopts, NUM_IOPTS);
+	bool loaded = iopts_load();
+
 	// Check reset conditions:
-	if (file_read_byte(IOPTS_FILENAME, IOPT_FW_VERSION)<219 ||	// fw version is invalid (<219)
-			!file_exists(DONE_FILENAME) ||													// done file doesn't exist
-			file_read_byte(IOPTS_FILENAME, IOPT_RESET)==0xAA)  {	 // reset flag is on
+	if (!loaded ||												// no valid configuration
+			iopts[IOPT_FW_VERSION]<219 ||			// fw version is invalid (<219)
+			iopts[IOPT_RESET]==0xAA)  {	 			// reset flag is on
 
 #if defined(ARDUINO)
 		lcd_print_line_clear_pgm(PSTR("Resetting..."), 0);
@@ -1209,16 +1397,20 @@ void OpenSprinkler::options_setup() {
 #endif		
 
 		// 0. remove existing files
-		if(file_read_byte(IOPTS_FILENAME, IOPT_RESET)==0xAA) {
+		if(loaded && iopts[IOPT_RESET]==0xAA) {
 			// this is an explicit reset request, simply perform a format
 			#if defined(ESP8266)
-			SPIFFS.format();
+			file_flush_all();
+			storage_format();
 			#else
 			// todo future: delete log files
 			#endif
 		}
 
-		remove_file(DONE_FILENAME);
+		remove_file(CONFIG_FILENAME);
+		memset(&config_head, 0, sizeof(ConfigHeader));
+		memcpy(iopts, defaults, NUM_IOPTS);
+		memset(&nvdata, 0, sizeof(NVConData));
 		/*remove_file(IOPTS_FILENAME);
 		remove_file(SOPTS_FILENAME);
 		remove_file(STATIONS_FILENAME);
@@ -1233,35 +1425,14 @@ void OpenSprinkler::options_setup() {
 			file_write_block(SOPTS_FILENAME, tmp_buffer, (ulong)MAX_SOPTS_SIZE*i, MAX_SOPTS_SIZE);
 		}
 		// write string options 
+		sopts_cache.clear();
 		for(int i=0; i<NUM_SOPTS; i++) {
 			sopt_save(i, sopts[i]);
 		}
 		
 		// 2. write station data
-		StationData *pdata=(StationData*)tmp_buffer;
-		pdata->name[0]='S';
-		pdata->name[3]=0;
-		pdata->name[4]=0;
-		StationAttrib at;
-		memset(&at, 0, sizeof(StationAttrib));
-		at.mas=1;
-		at.seq=1;
-		pdata->attrib=at; // mas:1 seq:1
-		pdata->type=STN_TYPE_STANDARD;
-		pdata->sped[0]='0';
-		pdata->sped[1]=0;
-		for(int i=0; i<MAX_NUM_STATIONS; i++) {
-			int sid=i+1;
-			if(i<99) {
-				pdata->name[1]='0'+(sid/10); // default station name
-				pdata->name[2]='0'+(sid%10);
-			} else {
-				pdata->name[1]='0'+(sid/100);
-				pdata->name[2]='0'+((sid%100)/10);
-				pdata->name[3]='0'+(sid%10);
-			}
-			file_write_block(STATIONS_FILENAME, pdata, sizeof(StationData)*i, sizeof(StationData));
-		}
+		remove_file(STATIONS_V1_FILENAME);
+		stations_setup(0);
 		
 		attribs_load(); // load and repackage attrib bits (for backward compatibility)
 		
@@ -1273,20 +1444,25 @@ void OpenSprinkler::options_setup() {
 		// 4. write program data: just need to write a program counter: 0
 		file_write_byte(PROG_FILENAME, 0, 0);
 		
-		// 5. write 'done' file
-		file_write_byte(DONE_FILENAME, 0, 1);
+		// 5. commit the configuration last: a valid configuration marks a completed reset
+		flush_dirty(true);
 		
 	} else	{
 
-		iopts_load();
-		nvdata_load();
+		iopts[IOPT_FW_VERSION] = OS_FW_VERSION;
+		iopts[IOPT_FW_MINOR] = OS_FW_MINOR;
 		last_reboot_cause = nvdata.reboot_cause;
 		nvdata.reboot_cause = REBOOT_CAUSE_POWERON;
 		nvdata_save();
+		sopts_load();
 		#if defined(ESP8266)
 		wifi_ssid = sopt_load(SOPT_STA_SSID);
 		wifi_pass = sopt_load(SOPT_STA_PASS);
 		#endif
+		// add default data for stations beyond the end of the station file
+		// (the file was written with a smaller maximum number of stations)
+		stations_convert();
+		stations_setup(file_size(STATIONS_FILENAME)/STATION_RECORD_SIZE);
 		attribs_load();
 	}
 
@@ -1375,30 +1551,148 @@ void OpenSprinkler::options_setup() {
 	}
 }
 
-/** Load non-volatile controller status data from file */
-void OpenSprinkler::nvdata_load() {
+/** Write default station data for stations from..MAX_NUM_STATIONS-1 */
+void OpenSprinkler::stations_setup(uint16_t from) {
+	if (from >= MAX_NUM_STATIONS) return;
+	StationData *pdata=(StationData*)tmp_buffer;
+	pdata->name[0]='S';
+	pdata->name[3]=0;
+	pdata->name[4]=0;
+	StationAttrib at;
+	memset(&at, 0, sizeof(StationAttrib));
+	at.mas=1;
+	at.seq=1;
+	pdata->attrib=at; // mas:1 seq:1
+	pdata->type=STN_TYPE_STANDARD;
+	char fn[16];
+	for(int i=from; i<MAX_NUM_STATIONS; i++) {
+		int sid=i+1;
+		if(i<99) {
+			pdata->name[1]='0'+(sid/10); // default station name
+			pdata->name[2]='0'+(sid%10);
+		} else {
+			pdata->name[1]='0'+(sid/100);
+			pdata->name[2]='0'+((sid%100)/10);
+			pdata->name[3]='0'+(sid%10);
+		}
+		file_write_block(STATIONS_FILENAME, pdata, STATION_RECORD_SIZE*i, STATION_RECORD_SIZE);
+		special_file_name(fn, i);
+		if(file_exists(fn)) remove_file(fn);
+		delay(0);
+	}
+}
+
+/** Convert the station file of an older firmware, which holds a full StationData
+ * record per station: the records go to the station file, and the special data of
+ * special stations to their own files. The old file is removed last, so an
+ * interrupted conversion is done again at the next boot.
+ */
+void OpenSprinkler::stations_convert() {
+	if(!file_exists(STATIONS_V1_FILENAME)) return;
+	StationData *pdata=(StationData*)tmp_buffer;
+	ulong n = file_size(STATIONS_V1_FILENAME)/sizeof(StationData);
+	if(n>MAX_NUM_STATIONS) n = MAX_NUM_STATIONS;
+	char fn[16];
+	for(ulong sid=0;sid<n;sid++) {
+		file_read_block(STATIONS_V1_FILENAME, pdata, sid*sizeof(StationData), sizeof(StationData));
+		if(pdata->type!=STN_TYPE_STANDARD) {
+			special_file_name(fn, sid);
+			file_write_block(fn, pdata->sped, 0, STATION_SPECIAL_DATA_SIZE);
+		}
+		file_write_block(STATIONS_FILENAME, pdata, sid*STATION_RECORD_SIZE, STATION_RECORD_SIZE);
+		delay(0);
+	}
+	remove_file(STATIONS_V1_FILENAME);
+}
+
+static_assert(sizeof(ConfigHeader)+NUM_IOPTS+sizeof(NVConData) <= CONFIG_SLOT_SIZE,
+	"the options and controller status must fit in a slot of the configuration store");
+
+/** Load the current copy of the configuration store into iopts and nvdata.
+ * If the store has no valid copy, convert the data files of an older firmware
+ * if they are complete. Returns false if neither exists.
+ */
+bool OpenSprinkler::config_load() {
+	byte buf[CONFIG_SLOT_SIZE];
+	ConfigHeader *h = (ConfigHeader*)buf;
+	bool found = false;
+	for(byte slot=0;slot<2;slot++) {
+		file_read_block(CONFIG_FILENAME, buf, (ulong)slot*CONFIG_SLOT_SIZE, CONFIG_SLOT_SIZE);
+		if(h->magic!=CONFIG_MAGIC || h->version!=CONFIG_VERSION ||
+			 h->crc!=crc16(h, offsetof(ConfigHeader, crc)) ||
+			 sizeof(ConfigHeader)+h->niopts+h->nvdata_len>CONFIG_SLOT_SIZE) continue;
+		byte *p = buf+sizeof(ConfigHeader);
+		if(h->iopts_crc!=crc16(p, h->niopts) ||
+			 h->nvdata_crc!=crc16(p+h->niopts, h->nvdata_len)) continue;
+		if(found && (int32_t)(h->seq-config_head.seq)<=0) continue;
+		// options and status added since the copy was written keep their defaults
+		memcpy(iopts, p, (h->niopts<NUM_IOPTS) ? h->niopts : NUM_IOPTS);
+		// the station delay used to apply to all sequential groups
+		if(h->niopts<=IOPT_STATION_DELAY_TIME_1)
+			memset(iopts+IOPT_STATION_DELAY_TIME_1, iopts[IOPT_STATION_DELAY_TIME], NUM_SEQ_GROUPS-1);
+		memcpy(&nvdata, p+h->niopts, (h->nvdata_len<sizeof(NVConData)) ? h->nvdata_len : sizeof(NVConData));
+		config_head = *h;
+		config_slot = slot;
+		found = true;
+	}
+	if(found) return true;
+
+	// no configuration store: convert the files of an older firmware
+	if(!file_exists(DONE_FILENAME) || !file_exists(IOPTS_FILENAME)) return false;
+	file_read_block(IOPTS_FILENAME, iopts, 0, NUM_IOPTS);
+	memset(iopts+IOPT_STATION_DELAY_TIME_1, iopts[IOPT_STATION_DELAY_TIME], NUM_SEQ_GROUPS-1);
 	file_read_block(NVCON_FILENAME, &nvdata, 0, sizeof(NVConData));
-	old_status = status;
+	config_commit();
+	remove_file(IOPTS_FILENAME);
+	remove_file(NVCON_FILENAME);
+	remove_file(DONE_FILENAME);
+	return true;
+}
+
+/** Write iopts and nvdata to the configuration store, into the copy that is not current */
+void OpenSprinkler::config_commit() {
+	byte buf[CONFIG_SLOT_SIZE];
+	ConfigHeader *h = (ConfigHeader*)buf;
+	byte *p = buf+sizeof(ConfigHeader);
+	memcpy(p, iopts, NUM_IOPTS);
+	memcpy(p+NUM_IOPTS, &nvdata, sizeof(NVConData));
+	h->magic = CONFIG_MAGIC;
+	h->version = CONFIG_VERSION;
+	h->niopts = NUM_IOPTS;
+	h->seq = config_head.seq+1;
+	h->iopts_crc = crc16(p, NUM_IOPTS);
+	h->nvdata_len = sizeof(NVConData);
+	h->nvdata_crc = crc16(p+NUM_IOPTS, sizeof(NVConData));
+	h->crc = crc16(h, offsetof(ConfigHeader, crc));
+	// nothing to do if the data has not changed
+	if(config_head.magic==CONFIG_MAGIC && config_head.niopts==NUM_IOPTS &&
+		 config_head.iopts_crc==h->iopts_crc && config_head.nvdata_crc==h->nvdata_crc) return;
+	config_slot ^= 1;
+	file_write_block(CONFIG_FILENAME, buf, (ulong)config_slot*CONFIG_SLOT_SIZE, sizeof(ConfigHeader)+NUM_IOPTS+sizeof(NVConData));
+	config_head = *h;
 }
 
 /** Save non-volatile controller status data */
 void OpenSprinkler::nvdata_save() {
-	file_write_block(NVCON_FILENAME, &nvdata, 0, sizeof(NVConData));
+	mark_dirty(DIRTY_NVDATA);
 }
 
-/** Load integer options from file */
-void OpenSprinkler::iopts_load() {
-	file_read_block(IOPTS_FILENAME, iopts, 0, NUM_IOPTS);
+/** Load integer options and controller status from the configuration store.
+ * Returns false if there is no valid configuration.
+ */
+bool OpenSprinkler::iopts_load() {
+	flush_dirty(true);
+	if(!config_load()) return false;
 	nboards = iopts[IOPT_EXT_BOARDS]+1;
 	nstations = nboards * 8;
 	status.enabled = iopts[IOPT_DEVICE_ENABLE];
-	iopts[IOPT_FW_VERSION] = OS_FW_VERSION;
-	iopts[IOPT_FW_MINOR] = OS_FW_MINOR;
+	old_status = status;
+	return true;
 }
 
 /** Save integer options to file */
 void OpenSprinkler::iopts_save() {
-	file_write_block(IOPTS_FILENAME, iopts, 0, NUM_IOPTS);
+	mark_dirty(DIRTY_IOPTS);
 	nboards = iopts[IOPT_EXT_BOARDS]+1;
 	nstations = nboards * 8;
 	status.enabled = iopts[IOPT_DEVICE_ENABLE];
@@ -1406,6 +1700,11 @@ void OpenSprinkler::iopts_save() {
 
 /** Load a string option from file */
 void OpenSprinkler::sopt_load(byte oid, char *buf) {
+	const char *v = sopts_cache.get(oid);
+	if(v) {
+		strcpy(buf, v);
+		return;
+	}
 	file_read_block(SOPTS_FILENAME, buf, MAX_SOPTS_SIZE*oid, MAX_SOPTS_SIZE);
 	buf[MAX_SOPTS_SIZE]=0;	// ensure the string ends properly
 }
@@ -1417,10 +1716,24 @@ String OpenSprinkler::sopt_load(byte oid) {
 	return str;
 }
 
+/** Load all string options into the RAM cache
+ * sopt_load, password_verify and the $O directive then read from RAM;
+ * options that do not fit in the cache are read from flash.
+ */
+void OpenSprinkler::sopts_load() {
+	char buf[MAX_SOPTS_SIZE+1];
+	sopts_cache.clear();
+	for(byte oid=0;oid<NUM_SOPTS;oid++) {
+		sopt_load(oid, buf);
+		sopts_cache.set(oid, buf);
+	}
+}
+
 /** Save a string option to file */
 bool OpenSprinkler::sopt_save(byte oid, const char *buf) {
 	// smart save: if value hasn't changed, don't write
-	if(file_cmp_block(SOPTS_FILENAME, buf, (ulong)MAX_SOPTS_SIZE*oid)==0) return false;
+	const char *v = sopts_cache.get(oid);
+	if(v ? strncmp(buf, v, MAX_SOPTS_SIZE)==0 : file_cmp_block(SOPTS_FILENAME, buf, (ulong)MAX_SOPTS_SIZE*oid)==0) return false;
 	int len = strlen(buf);
 	if(len>=MAX_SOPTS_SIZE) {
 		file_write_block(SOPTS_FILENAME, buf, (ulong)MAX_SOPTS_SIZE*oid, MAX_SOPTS_SIZE);
@@ -1428,6 +1741,11 @@ bool OpenSprinkler::sopt_save(byte oid, const char *buf) {
 		// copy ending 0 too
 		file_write_block(SOPTS_FILENAME, buf, (ulong)MAX_SOPTS_SIZE*oid, len+1);
 	}
+	// update the cache with the saved value
+	char tmp[MAX_SOPTS_SIZE+1];
+	strncpy(tmp, buf, MAX_SOPTS_SIZE);
+	tmp[MAX_SOPTS_SIZE]=0;
+	sopts_cache.set(oid, tmp);
 	return true;
 }
 	
@@ -1677,6 +1995,9 @@ void OpenSprinkler::lcd_print_option(int i) {
 	case IOPT_MASTER_OFF_ADJ:
 	case IOPT_MASTER_OFF_ADJ_2:
 	case IOPT_STATION_DELAY_TIME:
+	case IOPT_STATION_DELAY_TIME_1:
+	case IOPT_STATION_DELAY_TIME_2:
+	case IOPT_STATION_DELAY_TIME_3:
 		{
 		int16_t t=water_time_decode_signed(iopts[i]);
 		if(t>=0)	lcd_print_pgm(PSTR("+"));
@@ -1917,7 +2238,7 @@ void OpenSprinkler::save_wifi_ip() {
 
 void OpenSprinkler::detect_expanders() {		//TODO to be checked
 
-	for(byte i=0; i<MAX_EXT_BOARDS;i++) {
+	for(byte i=0; i<MAX_NUM_EXPANDERS;i++) {
 		Wire.beginTransmission(EXP_I2CADDR_BASE+i+1);
 		if(Wire.endTransmission()==0){
 			expanders[i] = new MCP23017(i+1);
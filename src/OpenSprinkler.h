@@ -27,6 +27,7 @@
 
 #include "defines.h"
 #include "utils.h"
+#include "storage.h"
 //#include "gpio.h"
 #include "images.h"
 
@@ -52,6 +53,26 @@ struct NVConData {
 	uint8_t  reboot_cause;	// reboot cause
 };
 
+/** Configuration store
+ * config.dat holds two copies (A/B) of the integer options and the controller
+ * status, CONFIG_SLOT_SIZE bytes each: the header, NUM_IOPTS option bytes, then
+ * NVConData. A commit writes the copy that is not current with the next sequence
+ * number, so a torn write leaves the last good copy in place. On boot the valid
+ * copy with the highest sequence number is used.
+ * Station records and programs are not covered: they are written in place with
+ * no checksum, so a torn write can leave one record partly updated.
+ */
+struct ConfigHeader {
+	uint16_t magic;	// CONFIG_MAGIC
+	byte version;	// CONFIG_VERSION
+	byte niopts;	// number of integer options stored
+	uint32_t seq;	// commit sequence number
+	uint16_t iopts_crc;
+	uint16_t nvdata_len;	// size of the controller status stored
+	uint16_t nvdata_crc;
+	uint16_t crc;	// crc of the header fields above
+};
+
 struct StationAttrib {	// station attributes
 	byte mas:1;
 	byte igs:1;	// ignore sensor 1
@@ -62,9 +83,9 @@ struct StationAttrib {	// station attributes
 	byte igrd:1;// ignore rain delay
 	byte unused:1;
 	
-	byte gid:4; // group id: reserved for the future
+	byte gid:4; // sequential group id
 	byte dummy:4;
-	byte reserved[2]; // reserved bytes for the future
+	byte flow[2]; // expected flow rate, learned from past runs: 0.1 flow units, low byte first (0 if unknown)
 }; // total is 4 bytes so far
 
 /** Station data structure */
@@ -75,6 +96,10 @@ struct StationData {
 	byte sped[STATION_SPECIAL_DATA_SIZE]; // special station data
 };
 
+/** Record of a station in the station file: the StationData fields before the
+ * special data. The special data of a special station is kept in a file of its own. */
+#define STATION_RECORD_SIZE offsetof(StationData, sped)
+
 /** RF station data structures - Must fit in STATION_SPECIAL_DATA_SIZE */
 struct RFStationData {
 	byte on[6];
@@ -122,6 +147,14 @@ struct ConStatus {
 extern const char iopt_json_names[];
 extern const uint8_t iopt_max[];
 
+/** Read word i of a station bitset, i.e. the bits of stations 32*i to 32*i+31
+ * (bit n of the word is station 32*i+n, since all supported platforms are little endian) */
+inline uint32_t station_word(const byte *bits, byte i) {
+	uint32_t w;
+	memcpy(&w, bits+(i<<2), 4);
+	return w;
+}
+
 class OpenSprinkler {
 public:
 
@@ -146,6 +179,8 @@ public:
 	static byte station_bits[];			// station activation bits. each byte corresponds to a board (8 stations)
 																	// first byte-> master controller, second byte-> ext. board 1, and so on
 	// todo future: the following attribute bytes are for backward compatibility
+	// station bits and attribute bytes are station bitsets: STATION_BYTES long, word aligned, so
+	// they can be evaluated 32 stations at a time with station_word()
 	static byte attrib_mas[];
 	static byte attrib_igs[];
 	static byte attrib_mas2[];
@@ -154,6 +189,9 @@ public:
 	static byte attrib_dis[];
 	static byte attrib_seq[];
 	static byte attrib_spe[];
+	static byte attrib_grp[];	// sequential group of each station (StationAttrib::gid), one byte per station
+	static uint16_t station_flow[];	// expected flow rate of each station (StationAttrib::flow)
+	static byte station_types[];	// type of each station (StationData::type)
 		
 	// variables for time keeping
 	static ulong sensor1_on_timer;	// time when sensor1 is detected on last time
@@ -189,9 +227,11 @@ public:
 	static void get_station_name(byte sid, char buf[]); // get station name
 	static void set_station_name(byte sid, char buf[]); // set station name
 	static byte get_station_type(byte sid); // get station type
+	static void set_station_special(byte sid, const byte *buf); // set station type followed by special data
 	//static StationAttrib get_station_attrib(byte sid); // get station attribute
 	static void attribs_save(); // repackage attrib bits and save (backward compatibility)
 	static void attribs_load(); // load and repackage attrib bits (backward compatibility)
+	static void set_station_flow(byte sid, uint16_t flow); // save the expected flow rate of a station
 	//static uint16_t parse_rfstation_code(RFStationData *data, ulong *on, ulong *off); // parse rf code into on/off/time sections
 	//static void switch_rfstation(RFStationData *data, bool turnon);  // switch rf station
 	static void switch_remotestation(RemoteStationData *data, bool turnon); // switch remote station
@@ -199,11 +239,13 @@ public:
 	static void switch_httpstation(HTTPStationData *data, bool turnon); // switch http station
 
 	// -- options and data storeage
-	static void nvdata_load();
 	static void nvdata_save();
+	static void flush_dirty(bool force, byte flags=0xFF);	// write dirty options and attributes to flash
 
 	static void options_setup();
-	static void iopts_load();
+	static void stations_setup(uint16_t from);	// write default station data
+	static void stations_convert();	// convert the station file of an older firmware
+	static bool iopts_load();	// load integer options and controller status
 	static void iopts_save();
 	static bool sopt_save(byte oid, const char *buf);
 	static void sopt_load(byte oid, char *buf);
@@ -281,6 +323,21 @@ private:
 
 #endif // LCD functions
 	static byte engage_booster;
+
+private:
+	// -- options and data storage
+	static byte dirty;	// DIRTY_ flags of data not yet written to flash
+	static ulong dirty_millis;	// time of the last save
+	static void mark_dirty(byte flags);
+	static byte attrib_dirty[];	// stations whose attributes are not yet written to flash
+	static void mark_station_dirty(byte sid);
+	static StringPool<STATION_NAMES_POOL_SIZE, MAX_NUM_STATIONS> station_names;
+	static StringPool<SOPTS_POOL_SIZE, NUM_SOPTS> sopts_cache;
+	static void sopts_load();
+	static ConfigHeader config_head;	// header of the current copy in the configuration store
+	static byte config_slot;
+	static bool config_load();
+	static void config_commit();
 };
 
 
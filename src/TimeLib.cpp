@@ -148,57 +148,54 @@ int year(time_t t) { // the year for the given time
 
 static	const uint8_t monthDays[]={31,28,31,30,31,30,31,31,30,31,30,31}; // API starts months from 1, this array starts from 0
  
+// date cache: one entry for even and one for odd days, so that
+// a day and the day before it (as checked by the scheduler) are both kept
+#define DATE_CACHE_SIZE 2
+static tmDate_t dateCache[DATE_CACHE_SIZE];
+
+const tmDate_t &breakDate(time_t timeInput){
+// break the given time_t into date components
+// this uses a constant-time days to civil date conversion (Howard Hinnant's
+// civil_from_days) with years starting on March 1st, so that the leap day
+// is the last day of the year
+	uint32_t days = (uint32_t)timeInput / SECS_PER_DAY;
+	tmDate_t &d = dateCache[days % DATE_CACHE_SIZE];
+	if (d.Days == days && d.Month) return d;
+
+	uint32_t z = days + 719468;	// days since 1 Mar 0000
+	uint32_t era = z / 146097;	// 400-year eras
+	uint32_t doe = z - era * 146097;	// day of era [0, 146096]
+	uint32_t yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;	// year of era [0, 399]
+	uint32_t doy = doe - (365*yoe + yoe/4 - yoe/100);	// day of year from March 1st [0, 365]
+	uint32_t mp = (5*doy + 2) / 153;	// month from March [0, 11]
+	uint32_t year = yoe + era * 400 + (mp >= 10 ? 1 : 0);
+
+	d.Days = days;
+	d.Wday = ((days + 4) % 7) + 1;  // Sunday is day 1
+	d.Day = doy - (153*mp + 2)/5 + 1;
+	d.Month = mp < 10 ? mp + 3 : mp - 9;	// jan is month 1
+	d.Year = year - 1970;	// year is offset from 1970
+	d.Leap = LEAP_YEAR(d.Year) ? 1 : 0;
+	return d;
+}
+
 void breakTime(time_t timeInput, tmElements_t &tm){
 // break the given time_t into time components
 // this is a more compact version of the C library localtime function
 // note that year is offset from 1970 !!!
 
-	uint8_t year;
-	uint8_t month, monthLength;
-	uint32_t time;
-	unsigned long days;
-
-	time = (uint32_t)timeInput;
+	uint32_t time = (uint32_t)timeInput;
 	tm.Second = time % 60;
 	time /= 60; // now it is minutes
 	tm.Minute = time % 60;
 	time /= 60; // now it is hours
 	tm.Hour = time % 24;
-	time /= 24; // now it is days
-	tm.Wday = ((time + 4) % 7) + 1;  // Sunday is day 1 
-	
-	year = 0;  
-	days = 0;
-	while((unsigned)(days += (LEAP_YEAR(year) ? 366 : 365)) <= time) {
-		year++;
-	}
-	tm.Year = year; // year is offset from 1970 
-	
-	days -= LEAP_YEAR(year) ? 366 : 365;
-	time	-= days; // now it is days in this year, starting at 0
-	
-	days=0;
-	month=0;
-	monthLength=0;
-	for (month=0; month<12; month++) {
-		if (month==1) { // february
-			if (LEAP_YEAR(year)) {
-				monthLength=29;
-			} else {
-				monthLength=28;
-			}
-		} else {
-			monthLength = monthDays[month];
-		}
-		
-		if (time >= monthLength) {
-			time -= monthLength;
-		} else {
-				break;
-		}
-	}
-	tm.Month = month + 1;  // jan is month 1	
-	tm.Day = time + 1;		 // day of month
+
+	const tmDate_t &d = breakDate(timeInput);
+	tm.Wday = d.Wday;
+	tm.Day = d.Day;
+	tm.Month = d.Month;
+	tm.Year = d.Year;
 }
 
 time_t makeTime(tmElements_t &tm){	 
@@ -52,6 +52,15 @@ typedef struct	{
 	uint8_t Year;		// offset from 1970; 
 }		tmElements_t, TimeElements, *tmElementsPtr_t;
 
+typedef struct	{
+	uint32_t Days;	// days since 1 Jan 1970
+	uint8_t Wday;		// day of week, sunday is day 1
+	uint8_t Day;
+	uint8_t Month;
+	uint8_t Year;		// offset from 1970
+	uint8_t Leap;		// 1 if Year is a leap year
+}		tmDate_t;
+
 //convenience macros to convert to and from tm years 
 #define  tmYearToCalendar(Y) ((Y) + 1970)  // full four digit year 
 #define  CalendarYrToTm(Y)	 ((Y) - 1970)
@@ -136,6 +145,7 @@ void		setSyncInterval(time_t interval); // set the number of seconds between re-
 
 /* low level functions to convert to and from system time											*/
 void breakTime(time_t time, tmElements_t &tm);	// break time_t into elements
+const tmDate_t &breakDate(time_t time);	// date of time_t, from a small cache of recent days
 time_t makeTime(tmElements_t &tm);	// convert time elements into time_t
 
 } // extern "C++"
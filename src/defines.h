@@ -53,10 +53,26 @@ typedef unsigned long ulong;
 /** Data file names */
 #define IOPTS_FILENAME        "iopts.dat"   // integer options data file
 #define SOPTS_FILENAME        "sopts.dat"   // string options data file
-#define STATIONS_FILENAME     "stns.dat"    // stations data file
+#define STATIONS_FILENAME     "stnrec.dat"  // station records: name, attributes and type, see OpenSprinkler.h --> STATION_RECORD_SIZE
+#define STATIONS_V1_FILENAME  "stns.dat"    // station data file of older firmwares, converted at boot
+#define SPECIAL_FILE_PREFIX   "sped"        // special data of special station n: sped<n>.dat
 #define NVCON_FILENAME        "nvcon.dat"   // non-volatile controller data file, see OpenSprinkler.h --> struct NVConData
 #define PROG_FILENAME         "prog.dat"    // program data file
-#define DONE_FILENAME         "done.dat"    // used to indicate the completion of all files
+#define DONE_FILENAME         "done.dat"    // used to indicate the completion of all files (before the configuration store)
+#define CONFIG_FILENAME       "config.dat"  // configuration store: integer options and controller status, see OpenSprinkler.h --> struct ConfigHeader
+
+/** Configuration store */
+#define CONFIG_MAGIC          0x05C5
+#define CONFIG_VERSION        1
+#define CONFIG_SLOT_SIZE      256   // size of each of the two copies
+
+/** Write-back of options and station attributes */
+#define WRITEBACK_DELAY_MS    3000  // write dirty data to flash after this quiet period (milliseconds)
+#define ATTRIB_FLUSH_MAX      8     // station records written back per call of a delayed flush
+#define DIRTY_IOPTS           0x01
+#define DIRTY_NVDATA          0x02
+#define DIRTY_CONFIG          (DIRTY_IOPTS|DIRTY_NVDATA)
+#define DIRTY_ATTRIBS         0x04
 
 /** Station macro defines */
 #define STN_TYPE_STANDARD    0x00
@@ -92,6 +108,7 @@ typedef unsigned long ulong;
 #define SENSOR_TYPE_OTHER   0xFF
 
 #define FLOWCOUNT_RT_WINDOW   30    // flow count window (for computing real-time flow rate), 30 seconds
+#define FLOW_LEARN_MIN_TIME   60    // the expected flow of a station is learned from runs of at least this long (seconds)
 
 /** Reboot cause */
 #define REBOOT_CAUSE_NONE   0
@@ -121,11 +138,17 @@ typedef unsigned long ulong;
 #define LED_SLOW_BLINK 500
 
 /** Storage / zone expander defines */
-#define MAX_EXT_BOARDS    4  // maximum number of 8-zone expanders (each 16-zone expander counts as 2)
+#define MAX_NUM_EXPANDERS 7   // maximum number of I2C expanders (MCP23017 addresses above the main IO expander)
+#define MAX_EXT_BOARDS    MAX_NUM_EXPANDERS  // maximum number of 8-zone expanders (each expander drives one board on PORTA)
 
 #define MAX_NUM_STATIONS  (8+(MAX_EXT_BOARDS*8))  // maximum number of stations (onboard stations + external stations)
+#define STATION_WORDS     ((MAX_NUM_STATIONS+31)>>5)  // number of 32-bit words in a station bitset
+#define STATION_BYTES     (STATION_WORDS*4)  // station bitsets are padded to whole words
 #define STATION_NAME_SIZE 32    // maximum number of characters in each station name
+#define STATION_NAMES_POOL_SIZE (MAX_NUM_STATIONS*12)	// RAM for station names, names beyond it are read from flash
+#define NUM_SEQ_GROUPS    4     // number of sequential groups: sequential stations in different groups run in parallel
 #define MAX_SOPTS_SIZE    160   // maximum string option size
+#define SOPTS_POOL_SIZE   640   // RAM for string options, options beyond it are read from flash
 
 #define STATION_SPECIAL_DATA_SIZE  (TMP_BUFFER_SIZE - STATION_NAME_SIZE - 12)
 
@@ -205,6 +228,12 @@ enum {
 	IOPT_SUBNET_MASK4,
 	IOPT_WIFI_MODE, //ro
 	IOPT_RESET,     //ro
+	IOPT_FLOW_LIMIT,
+	IOPT_LOG_MAX_DAYS,
+	IOPT_LOG_MAX_SHARE,
+	IOPT_STATION_DELAY_TIME_1, // station delay of sequential groups 1 to 3 (group 0 uses IOPT_STATION_DELAY_TIME)
+	IOPT_STATION_DELAY_TIME_2,
+	IOPT_STATION_DELAY_TIME_3,
 	NUM_IOPTS // total number of integer options
 };
 
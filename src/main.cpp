@@ -27,6 +27,7 @@
 #include "program.h"
 #include "weather.h"
 #include "OSserver.h"
+#include "oslog.h"
 
 #if defined(ARDUINO)
 	EthernetServer *m_server = NULL;
@@ -259,13 +260,11 @@ void ui_state_machine() {
 				ui_state_runprog = (ui_state_runprog+1) % (pd.nprograms+1);
 				os.lcd_print_line_clear_pgm(PSTR("Hold B3 to start"), 0);
 				if(ui_state_runprog > 0) {
-					ProgramStruct prog;
-					pd.read(ui_state_runprog-1, &prog);
 					os.lcd_print_line_clear_pgm(PSTR(" "), 1);
 					os.lcd.setCursor(0, 1);
 					os.lcd.print((int)ui_state_runprog);
 					os.lcd_print_pgm(PSTR(". "));
-					os.lcd.print(prog.name);
+					os.lcd.print(pd.programs[ui_state_runprog-1].name);
 				} else {
 					os.lcd_print_line_clear_pgm(PSTR("0. Test (1 min)"), 1);
 				}
@@ -278,6 +277,8 @@ void ui_state_machine() {
 // ======================
 // Setup Function
 // ======================
+ulong boot_options_ms = 0;	// time options_setup took on boot, for /db
+
 void do_setup() {
 	/* Clear WDT reset flag. */
 
@@ -288,7 +289,9 @@ void do_setup() {
 	DEBUG_BEGIN(115200);
 
 	os.begin();					 // OpenSprinkler init
+	ulong t0 = millis();
 	os.options_setup();  // Setup options
+	boot_options_ms = millis() - t0;
 
 	pd.init();						// ProgramData init
 
@@ -322,7 +325,11 @@ void(* sysReset) (void) = 0;
 
 void write_log(byte type, ulong curr_time);
 void schedule_all_stations(ulong curr_time);
+ulong program_water_time(ProgramEntry *prog, ProgramStation *ps);
+byte schedule_station(RuntimeQueueStruct *q, ulong &con_start_time, ulong *seq_start_times, const int16_t *station_delays, byte re);
+void forecast_invalidate();
 void turn_off_station(byte sid, ulong curr_time);
+bool stations_running();
 void process_dynamic_events(ulong curr_time);
 void check_network();
 void check_weather();
@@ -353,8 +360,8 @@ void do_loop()
 	static ulong last_time = 0;
 	static ulong last_minute = 0;
 
-	byte bid, sid, s, pid, qid, bitvalue;
-	ProgramStruct prog;
+	byte sid, pid, qid;
+	ProgramEntry *prog;
 
 	os.status.mas = os.iopts[IOPT_MASTER_STATION];
 	os.status.mas2= os.iopts[IOPT_MASTER_STATION_2];
@@ -452,6 +459,15 @@ void do_loop()
 		if(reboot_timer && millis() > reboot_timer) {
 			os.reboot_dev(REBOOT_CAUSE_TIMER);
 		}
+
+		// write back options and attributes once they have not changed for a while
+		os.flush_dirty(false);
+		// write queued log records in batches, right away when no program is running
+		log_flush_due(curr_time, !os.status.program_busy);
+		rollup_flush_due(curr_time, !os.status.program_busy);
+		// remove old logs, one file at a time, while the controller is idle
+		if (!os.status.program_busy)
+			log_prune(curr_time, os.iopts[IOPT_LOG_MAX_DAYS], os.iopts[IOPT_LOG_MAX_SHARE]);
 			
 		if (!ui_state)
 			os.lcd_print_time(os.now_tz());				// print time
@@ -530,50 +546,31 @@ void do_loop()
 		// we only need to check once every minute
 		if (curr_minute != last_minute) {
 			last_minute = curr_minute;
+			// recompile program schedules if the day or sunrise/sunset time has changed
+			pd.update_schedule(curr_time);
 			// check through all programs
 			for(pid=0; pid<pd.nprograms; pid++) {
-				delay(0);
-				pd.read(pid, &prog);	// todo future: reduce load time
-				if(prog.check_match(curr_time)) {
+				prog = pd.programs + pid;
+				if(pd.check_match(pid, curr_time)) {
 					// program match found
 					// process all selected stations
-					for(sid=0;sid<os.nstations;sid++) {
-						bid=sid>>3;
-						s=sid&0x07;
-						// skip if the station is a master station (because master cannot be scheduled independently
-						if ((os.status.mas==sid+1) || (os.status.mas2==sid+1))
-							continue;
-
-						// if station has non-zero water time and the station is not disabled
-						if (prog.durations[sid] && !(os.attrib_dis[bid]&(1<<s))) {
-							// water time is scaled by watering percentage
-							ulong water_time = water_time_resolve(prog.durations[sid]);
-							// if the program is set to use weather scaling
-							if (prog.use_weather) {
-								byte wl = os.iopts[IOPT_WATER_PERCENTAGE];
-								water_time = water_time * wl / 100;
-								if (wl < 20 && water_time < 10) // if water_percentage is less than 20% and water_time is less than 10 seconds
-																								// do not water
-									water_time = 0;
+					ProgramStation *ps = pd.pstations + prog->sidx;
+					for(byte i=0;i<prog->nsta && ps->sid<os.nstations;i++,ps++) {
+						ulong water_time = program_water_time(prog, ps);
+						if (water_time) {
+							q = pd.enqueue(pid+1);
+							if (q) {
+								q->st = 0;
+								q->dur = water_time;
+								q->sid = ps->sid;
+								match_found = true;
+							} else {
+								// queue is full: the run is counted in pd.prog_drops
+								rollup_skip(ps->sid, curr_time);
 							}
-
-							if (water_time) {
-								// check if water time is still valid
-								// because it may end up being zero after scaling
-								q = pd.enqueue();
-								if (q) {
-									q->st = 0;
-									q->dur = water_time;
-									q->sid = sid;
-									q->pid = pid+1;
-									match_found = true;
-								} else {
-									// queue is full
-								}
-							}// if water_time
-						}// if prog.durations[sid]
-					}// for sid
-					if(match_found) push_message(IFTTT_PROGRAM_SCHED, pid, prog.use_weather?os.iopts[IOPT_WATER_PERCENTAGE]:100);
+						}// if water_time
+					}// for ps
+					if(match_found) push_message(IFTTT_PROGRAM_SCHED, pid, prog->use_weather?os.iopts[IOPT_WATER_PERCENTAGE]:100);
 				}// if check_match
 			}// for pid
 
@@ -587,58 +584,31 @@ void do_loop()
 		// Check if a program is running currently
 		// If so, do station run-time keeping
 		if (os.status.program_busy){
-			// first, go through run time queue to assign queue elements to stations
-			q = pd.queue;
-			qid=0;
-			for(;q<pd.queue+pd.nqueue;q++,qid++) {
-				sid=q->sid;
-				byte sqi=pd.station_qid[sid];
-				// skip if station is already assigned a queue element
-				// and that queue element has an earlier start time
-				if(sqi<255 && pd.queue[sqi].st<q->st) continue;
-				// otherwise assign the queue element to station
-				pd.station_qid[sid]=qid;
-			}
-			// next, go through the stations and perform time keeping
-			for(bid=0;bid<os.nboards; bid++) {
-				bitvalue = os.station_bits[bid];
-				for(s=0;s<8;s++) {
-					byte sid = bid*8+s;
-
-					// skip master station
-					if (os.status.mas == sid+1) continue;
-					if (os.status.mas2== sid+1) continue;
-					if (pd.station_qid[sid]==255) continue;
-
-					q = pd.queue + pd.station_qid[sid];
-					// check if this station is scheduled, either running or waiting to run
-					if (q->st > 0) {
-						// if so, check if we should turn it off
-						if (curr_time >= q->st+q->dur) {
-							turn_off_station(sid, curr_time);
-						}
+			// process the start and stop events that are due
+			// queue elements are re-checked, because an element may have been
+			// rescheduled, stopped early or marked for removal since its event was added
+			while ((qid=pd.next_event(curr_time)) != 0xFF) {
+				if (pd.qpos[qid] == 0xFF) continue;	// element no longer queued
+				q = pd.queue + qid;
+				if (!q->st && q->dur) continue;	// element not scheduled yet
+				sid = q->sid;
+				bool is_master = (os.status.mas == sid+1) || (os.status.mas2 == sid+1);
+				if (!q->dur || curr_time >= q->st+q->dur) {
+					// element has finished or has been marked for removal
+					if (pd.station_qid[sid]==qid && q->st>0 && !is_master) {
+						turn_off_station(sid, curr_time);
+					} else {
+						pd.dequeue(qid);
+					}
+				} else if (curr_time >= q->st) {
+					// element is due to start: turn on the station if it is assigned to this element
+					if (pd.station_qid[sid]==qid && !is_master && !((os.station_bits[sid>>3]>>(sid&0x07))&1)) {
+						//turn_on_station(sid);
+						os.set_station_bit(sid, 1);
+
+						// RAH implementation of flow sensor
+						flow_start=0;
 					}
-					// if current station is not running, check if we should turn it on
-					if(!((bitvalue>>s)&1)) {
-						if (curr_time >= q->st && curr_time < q->st+q->dur) {
-
-							//turn_on_station(sid);
-							os.set_station_bit(sid, 1);
-
-							// RAH implementation of flow sensor
-							flow_start=0;
-
-						} //if curr_time > scheduled_start_time
-					} // if current station is not running
-				}//end_s
-			}//end_bid
-
-			// finally, go through the queue again and clear up elements marked for removal
-			int qi;
-			for(qi=pd.nqueue-1;qi>=0;qi--) {
-				q=pd.queue+qi;
-				if(!q->dur || curr_time>=q->st+q->dur)	{
-					pd.dequeue(qi);
 				}
 			}
 
@@ -648,26 +618,6 @@ void do_loop()
 			// activate / deactivate valves
 			os.apply_all_station_bits();
 
-			// check through runtime queue, calculate the last stop time of sequential stations
-			pd.last_seq_stop_time = 0;
-			ulong sst;
-			byte re=os.iopts[IOPT_REMOTE_EXT_MODE];
-			q = pd.queue;
-			for(;q<pd.queue+pd.nqueue;q++) {
-				sid = q->sid;
-				bid = sid>>3;
-				s = sid&0x07;
-				// check if any sequential station has a valid stop time
-				// and the stop time must be larger than curr_time
-				sst = q->st + q->dur;
-				if (sst>curr_time) {
-					// only need to update last_seq_stop_time for sequential stations
-					if (os.attrib_seq[bid]&(1<<s) && !re) {
-						pd.last_seq_stop_time = (sst>pd.last_seq_stop_time ) ? sst : pd.last_seq_stop_time;
-					}
-				}
-			}
-
 			// if the runtime queue is empty
 			// reset all stations
 			if (!pd.nqueue) {
@@ -681,6 +631,7 @@ void do_loop()
 				// log flow sensor reading if flow sensor is used
 				if(os.iopts[IOPT_SENSOR1_TYPE]==SENSOR_TYPE_FLOW) {
 					write_log(LOGDATA_FLOWSENSE, curr_time);
+					rollup_pulses((flow_count>os.flowcount_log_start)?(flow_count-os.flowcount_log_start):0, curr_time);
 					push_message(IFTTT_FLOWSENSOR, (flow_count>os.flowcount_log_start)?(flow_count-os.flowcount_log_start):0);
 				}
 
@@ -690,53 +641,15 @@ void do_loop()
 			}
 		}//if_some_program_is_running
 
-		// handle master
+		// handle master and master2
+		// their on intervals are recomputed only when the runtime queue or the master settings change
+		pd.update_master_intervals();
 		if (os.status.mas>0) {
-			int16_t mas_on_adj = water_time_decode_signed(os.iopts[IOPT_MASTER_ON_ADJ]);
-			int16_t mas_off_adj= water_time_decode_signed(os.iopts[IOPT_MASTER_OFF_ADJ]);
-			byte masbit = 0;
-			
-			for(sid=0;sid<os.nstations;sid++) {
-				// skip if this is the master station
-				if (os.status.mas == sid+1) continue;
-				bid = sid>>3;
-				s = sid&0x07;
-				// if this station is running and is set to activate master
-				if ((os.station_bits[bid]&(1<<s)) && (os.attrib_mas[bid]&(1<<s))) {
-					q=pd.queue+pd.station_qid[sid];
-					// check if timing is within the acceptable range
-					if (curr_time >= q->st + mas_on_adj &&
-							curr_time <= q->st + q->dur + mas_off_adj) {
-						masbit = 1;
-						break;
-					}
-				}
-			}
-			os.set_station_bit(os.status.mas-1, masbit);
+			os.set_station_bit(os.status.mas-1, pd.check_master(0, curr_time));
 		}
-		// handle master2
 		if (os.status.mas2>0) {
-			int16_t mas_on_adj_2 = water_time_decode_signed(os.iopts[IOPT_MASTER_ON_ADJ_2]);
-			int16_t mas_off_adj_2= water_time_decode_signed(os.iopts[IOPT_MASTER_OFF_ADJ_2]);
-			byte masbit2 = 0;
-			for(sid=0;sid<os.nstations;sid++) {
-				// skip if this is the master station
-				if (os.status.mas2 == sid+1) continue;
-				bid = sid>>3;
-				s = sid&0x07;
-				// if this station is running and is set to activate master
-				if ((os.station_bits[bid]&(1<<s)) && (os.attrib_mas2[bid]&(1<<s))) {
-					q=pd.queue+pd.station_qid[sid];
-					// check if timing is within the acceptable range
-					if (curr_time >= q->st + mas_on_adj_2 &&
-							curr_time <= q->st + q->dur + mas_off_adj_2) {
-						masbit2 = 1;
-						break;
-					}
-				}
-			}
-			os.set_station_bit(os.status.mas2-1, masbit2);
-		}		 
+			os.set_station_bit(os.status.mas2-1, pd.check_master(1, curr_time));
+		}
 
 		// process dynamic events
 		process_dynamic_events(curr_time);
@@ -766,8 +679,7 @@ void do_loop()
 				// and if no program is scheduled to run in the next minute
 				bool willrun = false;
 				for(pid=0; pid<pd.nprograms; pid++) {
-					pd.read(pid, &prog);
-					if(prog.check_match(curr_time+60)) {
+					if(pd.check_match(pid, curr_time+60)) {
 						willrun = true;
 						break;
 					}
@@ -860,7 +772,7 @@ void turn_off_station(byte sid, ulong curr_time) {
 
 	byte qid = pd.station_qid[sid];
 	// ignore if we are turning off a station that's not running or scheduled to run
-	if (qid>=pd.nqueue)  return;
+	if (qid==0xFF)  return;
 
 	// RAH implementation of flow sensor
 	if (flow_gallons>1) {
@@ -871,6 +783,9 @@ void turn_off_station(byte sid, ulong curr_time) {
 
 	RuntimeQueueStruct *q = pd.queue+qid;
 
+	// stopping a station early changes the sequential schedule
+	if (curr_time < q->st+q->dur) forecast_invalidate();
+
 	// check if the current time is past the scheduled start time,
 	// because we may be turning off a station that hasn't started yet
 	if (curr_time > q->st) {
@@ -883,13 +798,29 @@ void turn_off_station(byte sid, ulong curr_time) {
 
 			// log station run
 			write_log(LOGDATA_STATION, curr_time);
+			rollup_run(sid, pd.lastrun.duration, curr_time);
 			push_message(IFTTT_STATION_RUN, sid, pd.lastrun.duration);
+
+			// learn the station's expected flow rate from runs that end with no other station running,
+			// and that are long enough for the flow to settle
+			if (os.iopts[IOPT_SENSOR1_TYPE]==SENSOR_TYPE_FLOW && flow_last_gpm>0 && !stations_running() &&
+					pd.lastrun.duration>=FLOW_LEARN_MIN_TIME) {
+				uint16_t prev = os.station_flow[sid];
+				uint16_t f = (uint16_t)(flow_last_gpm*10+0.5);
+				if (prev) f = ((uint32_t)prev*3+f+2)/4;	// smooth out single measurements
+				if (f != prev) {
+					os.set_station_flow(sid, f);
+					forecast_invalidate();
+				}
+			}
 		}
+	} else if(os.status.mas!=(sid+1) && os.status.mas2!=(sid+1)) {
+		// the run is stopped before it started
+		rollup_skip(sid, curr_time);
 	}
 
-	// dequeue the element
+	// dequeue the element, this also assigns the station its next queue element, if any
 	pd.dequeue(qid);
-	pd.station_qid[sid] = 0xFF;
 }
 
 /** Process dynamic events
@@ -911,36 +842,116 @@ void process_dynamic_events(ulong curr_time) {
 		 && os.status.sensor2_active)
 		sn2 = true;
 
-	// todo: handle sensor 2
-	byte sid, s, bid, qid, igs, igs2, igrd;
-	for(bid=0;bid<os.nboards;bid++) {
-		igs = os.attrib_igs[bid];
-		igs2= os.attrib_igs2[bid];
-		igrd= os.attrib_igrd[bid];
-		
-		for(s=0;s<8;s++) {
-			sid=bid*8+s;
-
-			// ignore master stations because they are handled separately			 
+	// nothing to do if no condition is stopping stations
+	if (en && !rd && !sn1 && !sn2) return;
+
+	// calculate the set of stations that must stop, 32 stations at a time:
+	// if the controller is disabled, all stations stop, otherwise the stations
+	// that do not ignore rain delay / sensor1 / sensor2 while they are active.
+	// Only stations assigned to a normal program (not a run-once or test program) are affected.
+	for(byte i=0;i<STATION_WORDS;i++) {
+		uint32_t stop = en ? 0 : 0xFFFFFFFFUL;
+		if (rd)  stop |= ~station_word(os.attrib_igrd, i);
+		if (sn1) stop |= ~station_word(os.attrib_igs, i);
+		if (sn2) stop |= ~station_word(os.attrib_igs2, i);
+		stop &= station_word(pd.station_prog, i);
+		// dispatch once per affected station
+		while (stop) {
+			byte sid = (i<<5) + __builtin_ctzl(stop);
+			stop &= stop-1;
+			// ignore master stations because they are handled separately
 			if (os.status.mas == sid+1) continue;
-			if (os.status.mas2== sid+1) continue;			 
-			// If this is a normal program (not a run-once or test program)
-			// and either the controller is disabled, or
-			// if raining and ignore rain bit is cleared
-			// FIX ME
-			qid = pd.station_qid[sid];
-			if(qid==255) continue;
-			RuntimeQueueStruct *q = pd.queue + qid;
-
-			if(q->pid>=99) continue;	// if this is a manually started program, proceed
-			if(!en)	turn_off_station(sid, curr_time);	// if system is disabled, turn off zone
-			if(rd && !(igrd&(1<<s))) turn_off_station(sid, curr_time);	// if rain delay is on and zone does not ignore rain delay, turn it off
-			if(sn1&& !(igs &(1<<s))) turn_off_station(sid, curr_time);	// if sensor1 is on and zone does not ignore sensor1, turn it off
-			if(sn2&& !(igs2&(1<<s))) turn_off_station(sid, curr_time);	// if sensor2 is on and zone does not ignore sensor2, turn it off
+			if (os.status.mas2== sid+1) continue;
+			turn_off_station(sid, curr_time);
 		}
 	}
 }
 
+/** Calculate the water time of a program station in a scheduled run of the program
+ * The water time is scaled by the watering percentage if the program uses weather.
+ * Returns 0 if the station should not run.
+ */
+ulong program_water_time(ProgramEntry *prog, ProgramStation *ps) {
+	byte sid=ps->sid;
+	byte bid=sid>>3;
+	byte s=sid&0x07;
+	// skip if the station is a master station (because master cannot be scheduled independently
+	if ((os.status.mas==sid+1) || (os.status.mas2==sid+1))
+		return 0;
+	// skip if the station is disabled
+	if (os.attrib_dis[bid]&(1<<s))
+		return 0;
+	// water time is scaled by watering percentage
+	ulong water_time = water_time_resolve(ps->dur);
+	// if the program is set to use weather scaling
+	if (prog->use_weather) {
+		byte wl = os.iopts[IOPT_WATER_PERCENTAGE];
+		water_time = water_time * wl / 100;
+		if (wl < 20 && water_time < 10) // if water_percentage is less than 20% and water_time is less than 10 seconds
+																		// do not water
+			water_time = 0;
+	}
+	// water time may end up being zero after scaling
+	return water_time;
+}
+
+/** Check if any station other than the master stations is on */
+bool stations_running() {
+	for(byte i=0;i<STATION_WORDS;i++) {
+		uint32_t w = station_word(os.station_bits, i);
+		if (os.status.mas && ((os.status.mas-1)>>5)==i)	w &= ~(1UL<<((os.status.mas-1)&31));
+		if (os.status.mas2 && ((os.status.mas2-1)>>5)==i) w &= ~(1UL<<((os.status.mas2-1)&31));
+		if (w) return true;
+	}
+	return false;
+}
+
+static_assert(IOPT_STATION_DELAY_TIME_1+NUM_SEQ_GROUPS-1 == IOPT_STATION_DELAY_TIME_3+1,
+	"one station delay option per sequential group");
+
+/** Station delay of each sequential group in seconds */
+static void get_station_delays(int16_t *station_delays) {
+	station_delays[0] = water_time_decode_signed(os.iopts[IOPT_STATION_DELAY_TIME]);
+	for(byte g=1;g<NUM_SEQ_GROUPS;g++)
+		station_delays[g] = water_time_decode_signed(os.iopts[IOPT_STATION_DELAY_TIME_1+g-1]);
+}
+
+/** Calculate the start time of an unscheduled queue element
+ * Sequential stations start after the previous sequential station of the same
+ * sequential group plus the station delay of that group, so the groups run in parallel.
+ * Concurrent stations are staggered by 1 second, and placed within the flow budget
+ * if a flow limit is set (call flow_prepare first).
+ * Returns 1 if the element is scheduled sequentially.
+ */
+byte schedule_station(RuntimeQueueStruct *q, ulong &con_start_time, ulong *seq_start_times, const int16_t *station_delays, byte re) {
+	byte sid=q->sid;
+	byte bid=sid>>3;
+	byte s=sid&0x07;
+
+	uint16_t limit = pd.flow_limit();
+	byte seq = 0;
+	// if this is a sequential station and the controller is not in remote extension mode
+	// use sequential scheduling. station delay time apples
+	if (os.attrib_seq[bid]&(1<<s) && !re) {
+		// sequential scheduling
+		byte g = os.attrib_grp[sid];
+		ulong &seq_start_time = seq_start_times[g];
+		q->st = seq_start_time;
+		seq_start_time += q->dur;
+		seq_start_time += station_delays[g]; // add station delay time of the group
+		seq = 1;
+	} else {
+		// otherwise, concurrent scheduling
+		q->st = con_start_time;
+		uint16_t f = limit ? pd.flow_expected(sid, limit) : 0;
+		if (f) q->st = pd.flow_place(con_start_time, q->dur, f, limit);
+		// stagger concurrent stations by 1 second
+		con_start_time++;
+	}
+	if (limit) pd.flow_add(q, limit);
+	return seq;
+}
+
 /** Scheduler
  * This function loops through the queue
  * and schedules the start time of each station
@@ -948,37 +959,35 @@ void process_dynamic_events(ulong curr_time) {
 void schedule_all_stations(ulong curr_time) {
 
 	ulong con_start_time = curr_time + 1;		// concurrent start time
-	ulong seq_start_time = con_start_time;	// sequential start time
-
-	int16_t station_delay = water_time_decode_signed(os.iopts[IOPT_STATION_DELAY_TIME]);
-	// if the sequential queue has stations running
-	if (pd.last_seq_stop_time > curr_time) {
-		seq_start_time = pd.last_seq_stop_time + station_delay;
+	ulong seq_start_times[NUM_SEQ_GROUPS];	// sequential start time of each sequential group
+
+	int16_t station_delays[NUM_SEQ_GROUPS];
+	get_station_delays(station_delays);
+	for(byte g=0;g<NUM_SEQ_GROUPS;g++) {
+		seq_start_times[g] = con_start_time;
+		// if the sequential group has stations running
+		if (pd.last_seq_stop_times[g] > curr_time) {
+			seq_start_times[g] = pd.last_seq_stop_times[g] + station_delays[g];
+		}
 	}
 
-	RuntimeQueueStruct *q = pd.queue;
 	byte re = os.iopts[IOPT_REMOTE_EXT_MODE];
+	pd.flow_prepare(curr_time);
 	// go through runtime queue and calculate start time of each station
-	for(;q<pd.queue+pd.nqueue;q++) {
+	for(byte i=0;i<pd.nqueue;i++) {
+		byte qid = pd.qorder[i];
+		RuntimeQueueStruct *q = pd.queue + qid;
 		if(q->st) continue; // if this queue element has already been scheduled, skip
 		if(!q->dur) continue; // if the element has been marked to reset, skip
-		byte sid=q->sid;
-		byte bid=sid>>3;
-		byte s=sid&0x07;
-
-		// if this is a sequential station and the controller is not in remote extension mode
-		// use sequential scheduling. station delay time apples
-		if (os.attrib_seq[bid]&(1<<s) && !re) {
-			// sequential scheduling
-			q->st = seq_start_time;
-			seq_start_time += q->dur;
-			seq_start_time += station_delay; // add station delay time
-		} else {
-			// otherwise, concurrent scheduling
-			q->st = con_start_time;
-			// stagger concurrent stations by 1 second
-			con_start_time++;
+		if (schedule_station(q, con_start_time, seq_start_times, station_delays, re)) {
+			// keep track of the last stop time of sequential stations
+			ulong &last = pd.last_seq_stop_times[os.attrib_grp[q->sid]];
+			if (q->st+q->dur > last) last = q->st+q->dur;
 		}
+		pd.add_events(qid);
+		delay(0);	// placing a run is linear in the queue size
+		// runs that are not started by a program schedule make the forecast out of date
+		if (q->pid > MAX_NUM_PROGRAMS) forecast_invalidate();
 
 		if (!os.status.program_busy) {
 			os.status.program_busy = 1;  // set program busy bit
@@ -998,6 +1007,7 @@ void reset_all_stations_immediate() {
 	os.clear_all_station_bits();
 	os.apply_all_station_bits();
 	pd.reset_runtime();
+	forecast_invalidate();
 }
 
 /** Reset all stations
@@ -1007,11 +1017,166 @@ void reset_all_stations_immediate() {
  * Stations will be logged
  */
 void reset_all_stations() {
-	RuntimeQueueStruct *q = pd.queue;
 	// go through runtime queue and assign water time to 0
-	for(;q<pd.queue+pd.nqueue;q++) {
-		q->dur = 0;
+	for(byte i=0;i<pd.nqueue;i++) {
+		byte qid = pd.qorder[i];
+		pd.queue[qid].dur = 0;
+		pd.push_event(0, qid);	// process the element in the next cycle
+	}
+	forecast_invalidate();
+}
+
+/** Schedule forecast
+ * Projects the runs that program schedules will add to the runtime queue,
+ * using the same matching (ProgramSchedule::check_minute_match, program_water_time)
+ * and start time placement (schedule_station) as the controller, against simulated time.
+ * The projected runs are cached and the simulation is only extended as the
+ * requested horizon grows. The cache is dropped when any of its inputs change.
+ */
+/** Settings the forecast depends on, other than the program data */
+struct ForecastInputs {
+	uint16_t revision;
+	uint16_t sunrise_time;
+	uint16_t sunset_time;
+	byte nstations;
+	byte wl;
+	byte sdt[NUM_SEQ_GROUPS];
+	byte mas;
+	byte mas2;
+	byte re;
+	byte flim;
+	byte attrib_seq[1+MAX_EXT_BOARDS];
+	byte attrib_dis[1+MAX_EXT_BOARDS];
+	byte attrib_grp[MAX_NUM_STATIONS];
+};
+
+ForecastRun forecast_runs[FORECAST_MAX_RUNS];
+uint16_t forecast_nruns = 0;
+ulong forecast_end = 0;				// the forecast covers all minutes before this time
+ulong forecast_seq_stop[NUM_SEQ_GROUPS];	// simulated last stop time of sequential stations in each group
+bool forecast_valid = false;
+static ForecastInputs forecast_inputs;
+
+void forecast_invalidate() {
+	forecast_valid = false;
+}
+
+/** Collect the data the forecast depends on */
+static void forecast_get_inputs(ForecastInputs *in) {
+	memset(in, 0, sizeof(ForecastInputs));
+	in->revision = pd.revision;
+	in->sunrise_time = os.nvdata.sunrise_time;
+	in->sunset_time = os.nvdata.sunset_time;
+	in->nstations = os.nstations;
+	in->wl = os.iopts[IOPT_WATER_PERCENTAGE];
+	in->sdt[0] = os.iopts[IOPT_STATION_DELAY_TIME];
+	for(byte g=1;g<NUM_SEQ_GROUPS;g++)
+		in->sdt[g] = os.iopts[IOPT_STATION_DELAY_TIME_1+g-1];
+	in->mas = os.iopts[IOPT_MASTER_STATION];
+	in->mas2 = os.iopts[IOPT_MASTER_STATION_2];
+	in->re = os.iopts[IOPT_REMOTE_EXT_MODE];
+	in->flim = os.iopts[IOPT_FLOW_LIMIT];
+	memcpy(in->attrib_seq, os.attrib_seq, sizeof(in->attrib_seq));
+	memcpy(in->attrib_dis, os.attrib_dis, sizeof(in->attrib_dis));
+	memcpy(in->attrib_grp, os.attrib_grp, sizeof(in->attrib_grp));
+}
+
+/** Make sure the forecast covers all minutes from the next minute until end_time
+ * Returns the time up to which the forecast is complete, which is less than
+ * end_time if the forecast buffer is full.
+ */
+ulong forecast_schedule(ulong curr_time, ulong end_time) {
+	// the current minute has already been scheduled by do_loop
+	ulong start_time = (curr_time/60+1)*60;
+
+	ForecastInputs in;
+	forecast_get_inputs(&in);
+	if (!forecast_valid || memcmp(&in, &forecast_inputs, sizeof(ForecastInputs)) ||
+			forecast_end < start_time) {
+		// start over from the current runtime queue
+		forecast_inputs = in;
+		forecast_nruns = 0;
+		forecast_end = start_time;
+		memcpy(forecast_seq_stop, pd.last_seq_stop_times, sizeof(forecast_seq_stop));
+		forecast_valid = true;
+	}
+
+	// runs projected for minutes that have passed are in the runtime queue now
+	uint16_t i = 0;
+	while (i<forecast_nruns && forecast_runs[i].qt<start_time) i++;
+	if (i) {
+		memmove(forecast_runs, forecast_runs+i, (forecast_nruns-i)*sizeof(ForecastRun));
+		forecast_nruns -= i;
+	}
+
+	int16_t station_delays[NUM_SEQ_GROUPS];
+	get_station_delays(station_delays);
+	byte re = os.iopts[IOPT_REMOTE_EXT_MODE];
+	byte flags[MAX_NUM_PROGRAMS];
+	byte pid;
+	ulong t = forecast_end;
+	ulong day = 0;
+	for(;t<end_time;t+=60) {
+		if (!day || t/86400L != day) {
+			// evaluate day match once per simulated day
+			day = t/86400L;
+			for(pid=0;pid<pd.nprograms;pid++)
+				flags[pid] = pd.programs[pid].day_match_flags(t);
+			delay(0);
+		}
+		int16_t current_minute = (t%86400L)/60;
+		uint16_t n = forecast_nruns;
+		// queue matching programs the same way do_loop does
+		for(pid=0;pid<pd.nprograms;pid++) {
+			if (!flags[pid] || !pd.programs[pid].check_minute_match(current_minute, flags[pid])) continue;
+			ProgramStation *ps = pd.pstations + pd.programs[pid].sidx;
+			for(byte i=0;i<pd.programs[pid].nsta && ps->sid<os.nstations;i++,ps++) {
+				ulong water_time = program_water_time(pd.programs+pid, ps);
+				if (!water_time) continue;
+				if (n >= FORECAST_MAX_RUNS) {
+					// out of space: the forecast ends before this minute
+					forecast_end = t;
+					return t;
+				}
+				ForecastRun *r = forecast_runs+n;
+				r->q.st = 0;
+				r->q.dur = water_time;
+				r->q.sid = ps->sid;
+				r->q.pid = pid+1;
+				r->qt = t;
+				n++;
+			}
+		}
+		if (n == forecast_nruns) continue;
+
+		// place them the same way schedule_all_stations does
+		ulong con_start_time = t + 1;
+		ulong seq_start_times[NUM_SEQ_GROUPS];
+		for(byte g=0;g<NUM_SEQ_GROUPS;g++) {
+			seq_start_times[g] = con_start_time;
+			if (forecast_seq_stop[g] > t) {
+				seq_start_times[g] = forecast_seq_stop[g] + station_delays[g];
+			}
+		}
+		if (pd.flow_limit()) {
+			// the flow budget covers the runtime queue and the projected runs still running
+			pd.flow_prepare(t);
+			uint16_t limit = pd.flow_limit();
+			for(uint16_t k=0;k<forecast_nruns;k++) {
+				RuntimeQueueStruct *q = &forecast_runs[k].q;
+				if (q->st+q->dur > t) pd.flow_add(q, limit);
+			}
+		}
+		for(;forecast_nruns<n;forecast_nruns++) {
+			RuntimeQueueStruct *q = &forecast_runs[forecast_nruns].q;
+			if (schedule_station(q, con_start_time, seq_start_times, station_delays, re)) {
+				ulong &last = forecast_seq_stop[os.attrib_grp[q->sid]];
+				if (q->st+q->dur > last) last = q->st+q->dur;
+			}
+		}
 	}
+	if (t > forecast_end) forecast_end = t;
+	return forecast_end;
 }
 
 
@@ -1023,14 +1188,19 @@ void reset_all_stations() {
 void manual_start_program(byte pid, byte uwt) {
 	boolean match_found = false;
 	reset_all_stations_immediate();
-	ProgramStruct prog;
+	ProgramStation *ps = NULL;
 	ulong dur;
 	byte sid, bid, s;
+	byte n = os.nstations;
 	if ((pid>0)&&(pid<255)) {
-		pd.read(pid-1, &prog);
+		ps = pd.pstations + pd.programs[pid-1].sidx;
+		n = pd.programs[pid-1].nsta;
 		push_message(IFTTT_PROGRAM_SCHED, pid-1, uwt?os.iopts[IOPT_WATER_PERCENTAGE]:100);
 	}
-	for(sid=0;sid<os.nstations;sid++) {
+	// a program only visits its own stations, a test program visits all stations
+	for(byte i=0;i<n;i++) {
+		sid = ps ? ps[i].sid : i;
+		if (sid >= os.nstations) break;
 		bid=sid>>3;
 		s=sid&0x07;
 		// skip if the station is a master station (because master cannot be scheduled independently
@@ -1038,18 +1208,16 @@ void manual_start_program(byte pid, byte uwt) {
 			continue;		 
 		dur = 60;
 		if(pid==255)	dur=2;
-		else if(pid>0)
-			dur = water_time_resolve(prog.durations[sid]);
+		else if(ps) dur = water_time_resolve(ps[i].dur);
 		if(uwt) {
 			dur = dur * os.iopts[IOPT_WATER_PERCENTAGE] / 100;
 		}
 		if(dur>0 && !(os.attrib_dis[bid]&(1<<s))) {
-			RuntimeQueueStruct *q = pd.enqueue();
+			RuntimeQueueStruct *q = pd.enqueue(254);
 			if (q) {
 				q->st = 0;
 				q->dur = dur;
 				q->sid = sid;
-				q->pid = 254;
 				match_found = true;
 			}
 		}
@@ -1104,12 +1272,8 @@ void push_message(byte type, uint32_t lval, float fval) {
 		case IFTTT_PROGRAM_SCHED:
 
 			strcat_P(postval, PSTR("Scheduled Program "));
-			{
-				ProgramStruct prog;
-				pd.read(lval, &prog);
-				if(lval<pd.nprograms) strcat(postval, prog.name);
-				else strcat_P(postval, PSTR("Manual"));
-			}
+			if(lval<pd.nprograms) strcat(postval, pd.programs[lval].name);
+			else strcat_P(postval, PSTR("Manual"));
 			strcat_P(postval, PSTR(" with "));
 			itoa((int)fval, postval+strlen(postval), 10);
 			strcat_P(postval, PSTR("% water level."));
@@ -1206,113 +1370,34 @@ void push_message(byte type, uint32_t lval, float fval) {
 // ================================
 // ====== LOGGING FUNCTIONS =======
 // ================================
-#if defined(ARDUINO)
-char LOG_PREFIX[] = "/logs/";
-#else
-char LOG_PREFIX[] = "./logs/";
-#endif
-
-/** Generate log file name
- * Log files will be named /logs/xxxxx.txt
- */
-void make_logfile_name(char *name) {
-#if defined(ARDUINO)
-	#if !defined(ESP8266)
-	sd.chdir("/");
-	#endif
-#endif
-	strcpy(tmp_buffer+TMP_BUFFER_SIZE-10, name);
-	strcpy(tmp_buffer, LOG_PREFIX);
-	strcat(tmp_buffer, tmp_buffer+TMP_BUFFER_SIZE-10);
-	strcat_P(tmp_buffer, PSTR(".txt"));
-}
-
-/* To save RAM space, we store log type names
- * in program memory, and each name
- * must be strictly two characters with an ending 0
- * so each name is 3 characters total
- */
-static const char log_type_names[] PROGMEM =
-	"  \0"
-	"s1\0"
-	"rd\0"
-	"wl\0"
-	"fl\0"
-	"s2\0"
-	"cu\0";
-
-/** write run record to log on SD card */
+/** write run record to log */
 void write_log(byte type, ulong curr_time) {
 
 	if (!os.iopts[IOPT_ENABLE_LOGGING]) return;
 
-	// file name will be logs/xxxxx.tx where xxxxx is the day in epoch time
-	ultoa(curr_time / 86400, tmp_buffer, 10);
-	make_logfile_name(tmp_buffer);
-
-	// Step 1: open file if exists, or create new otherwise, 
-	// and move file pointer to the end  
-#if defined(ARDUINO) // prepare log folder for Arduino
-
-	#if defined(ESP8266)
-	File file = SPIFFS.open(tmp_buffer, "r+");
-	if(!file) {
-		file = SPIFFS.open(tmp_buffer, "w");
-		if(!file) return;
-	}
-	file.seek(0, SeekEnd);
-	#else
-	sd.chdir("/");
-	if (sd.chdir(LOG_PREFIX) == false) {
-		// create dir if it doesn't exist yet
-		if (sd.mkdir(LOG_PREFIX) == false) {
-			return;
-		}
-	}
-	SdFile file;
-	int ret = file.open(tmp_buffer, O_CREAT | O_WRITE );
-	file.seekEnd();
-	if(!ret) {
-		return;
-	}
-	#endif
-	
-#else // prepare log folder for RPI/BBB
-	struct stat st;
-	if(stat(get_filename_fullpath(LOG_PREFIX), &st)) {
-		if(mkdir(get_filename_fullpath(LOG_PREFIX), S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IWGRP | S_IXGRP | S_IROTH | S_IWOTH | S_IXOTH)) {
-			return;
-		}
-	}
-	FILE *file;
-	file = fopen(get_filename_fullpath(tmp_buffer), "rb+");
-	if(!file) {
-		file = fopen(get_filename_fullpath(tmp_buffer), "wb");
-		if (!file)	return;
-	}
-	fseek(file, 0, SEEK_END);
-#endif	// prepare log folder
-	
-	// Step 2: prepare data buffer
-	strcpy_P(tmp_buffer, PSTR("["));
-
+	LogRecord r;
+	r.type = type;
+	r.time = curr_time;
+	r.has_flow = false;
+	r.flow = 0;
 	if(type == LOGDATA_STATION) {
-		itoa(pd.lastrun.program, tmp_buffer+strlen(tmp_buffer), 10);
-		strcat_P(tmp_buffer, PSTR(","));
-		itoa(pd.lastrun.station, tmp_buffer+strlen(tmp_buffer), 10);
-		strcat_P(tmp_buffer, PSTR(","));
+		r.pid = pd.lastrun.program;
+		r.sid = pd.lastrun.station;
+		r.count = 0;
 		// duration is unsigned integer
-		ultoa((ulong)pd.lastrun.duration, tmp_buffer+strlen(tmp_buffer), 10);
+		r.value = (ulong)pd.lastrun.duration;
+		if(os.iopts[IOPT_SENSOR1_TYPE]==SENSOR_TYPE_FLOW) {
+			// RAH implementation of flow sensor, kept in hundredths
+			r.has_flow = true;
+			r.flow = (flow_last_gpm>0) ? (ulong)(flow_last_gpm*100+0.5) : 0;
+		}
 	} else {
-		ulong lvalue=0;
+		r.pid = r.sid = 0;
+		r.count = 0;
 		if(type==LOGDATA_FLOWSENSE) {
-			lvalue = (flow_count>os.flowcount_log_start)?(flow_count-os.flowcount_log_start):0;
+			r.count = (flow_count>os.flowcount_log_start)?(flow_count-os.flowcount_log_start):0;
 		}
-		ultoa(lvalue, tmp_buffer+strlen(tmp_buffer), 10);
-		strcat_P(tmp_buffer, PSTR(",\""));
-		strcat_P(tmp_buffer, log_type_names+type*3);
-		strcat_P(tmp_buffer, PSTR("\","));
-
+		ulong lvalue=0;
 		switch(type) {
 			case LOGDATA_FLOWSENSE:
 				lvalue = (curr_time>os.sensor1_active_lasttime)?(curr_time-os.sensor1_active_lasttime):0;
@@ -1330,32 +1415,10 @@ void write_log(byte type, ulong curr_time) {
 				lvalue = os.iopts[IOPT_WATER_PERCENTAGE];
 				break;
 		}
-		ultoa(lvalue, tmp_buffer+strlen(tmp_buffer), 10);
-	}
-	strcat_P(tmp_buffer, PSTR(","));
-	ultoa(curr_time, tmp_buffer+strlen(tmp_buffer), 10);
-	if((os.iopts[IOPT_SENSOR1_TYPE]==SENSOR_TYPE_FLOW) && (type==LOGDATA_STATION)) {
-		// RAH implementation of flow sensor
-		strcat_P(tmp_buffer, PSTR(","));
-		#if defined(ARDUINO)
-		dtostrf(flow_last_gpm,5,2,tmp_buffer+strlen(tmp_buffer));
-		#else
-		sprintf(tmp_buffer+strlen(tmp_buffer), "%5.2f", flow_last_gpm);
-		#endif
+		r.value = lvalue;
 	}
-	strcat_P(tmp_buffer, PSTR("]\r\n"));
-
-#if defined(ARDUINO)
-	#if defined(ESP8266)
-	file.write((byte*)tmp_buffer, strlen(tmp_buffer));
-	#else
-	file.write(tmp_buffer);
-	#endif
-	file.close();
-#else
-	fwrite(tmp_buffer, 1, strlen(tmp_buffer), file);
-	fclose(file);
-#endif
+	// queued in RAM, so that switching valves does not wait for the flash
+	log_append(r);
 }
 
 
@@ -1364,48 +1427,11 @@ void write_log(byte type, ulong curr_time) {
  */
 void delete_log(char *name) {
 	if (!os.iopts[IOPT_ENABLE_LOGGING]) return;
-#if defined(ARDUINO)
-
-	#if defined(ESP8266)
-	if (strncmp(name, "all", 3) == 0) {
-		// delete all log files
-		Dir dir = SPIFFS.openDir(LOG_PREFIX);
-		while (dir.next()) {
-			SPIFFS.remove(dir.fileName());
-		}
-	} else {
-		// delete a single log file
-		make_logfile_name(name);
-		if(!SPIFFS.exists(tmp_buffer)) return;
-		SPIFFS.remove(tmp_buffer);
-	}
-	#else
-	if (strncmp(name, "all", 3) == 0) {
-		// delete the log folder
-		SdFile file;
-
-		if (sd.chdir(LOG_PREFIX)) {
-			// delete the whole log folder
-			sd.vwd()->rmRfStar();
-		}
-	} else {
-		// delete a single log file
-		make_logfile_name(name);
-		if (!sd.exists(tmp_buffer))  return;
-		sd.remove(tmp_buffer);
-	}
-	#endif
-	
-#else // delete_log implementation for RPI/BBB
 	if (strncmp(name, "all", 3) == 0) {
-		// delete the log folder
-		rmdir(get_filename_fullpath(LOG_PREFIX));
-		return;
+		log_delete_all();
 	} else {
-		make_logfile_name(name);
-		remove(get_filename_fullpath(tmp_buffer));
+		log_delete(atol(name));
 	}
-#endif
 }
 
 /** Perform network check
@@ -0,0 +1,891 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Log file functions
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "oslog.h"
+
+/* To save RAM space, we store log type names
+ * in program memory, and each name
+ * must be strictly two characters with an ending 0
+ * so each name is 3 characters total
+ */
+static const char log_type_names[] PROGMEM =
+	"  \0"
+	"s1\0"
+	"rd\0"
+	"wl\0"
+	"fl\0"
+	"s2\0";
+
+/** Day and end time of the last record appended,
+ * so that appending does not have to read the file back */
+static ulong log_tail_day = 0;
+static ulong log_tail_time = 0;
+
+static void log_migrate(ulong day);
+static void rollup_delete_all();
+static bool rollup_prune(ulong today, byte max_days);
+
+/** Index of the days that have a log file
+ * A ring of bits over the LOG_INDEX_DAYS days ending at log_index_last, built
+ * from the file list on first use. Days before the ring fall back to asking
+ * the file system.
+ */
+static byte log_index[LOG_INDEX_DAYS/8];
+static ulong log_index_last = 0;
+static bool log_index_valid = false;
+
+/** Footprint of the logs, valid along with the index */
+static LogStats log_stats;
+
+/** Generate log file name
+ * Log files will be named /logs/xxxxx.bin (or .txt for old text logs)
+ */
+void log_file_name(char *buf, ulong day, bool text) {
+	strcpy(buf, LOG_PREFIX);
+	ultoa(day, buf+strlen(buf), 10);
+	strcat_P(buf, text ? PSTR(".txt") : PSTR(".bin"));
+}
+
+byte log_type_index(const char *name) {
+	for(byte i=1;i<LOG_NUM_TYPES;i++) {
+		if(!strncmp_P(name, log_type_names+i*3, 2)) return i;
+	}
+	return 0xFF;
+}
+
+// ====== Index of log files ======
+
+static void log_index_set(ulong day, bool on) {
+	if(on) log_index[(day%LOG_INDEX_DAYS)>>3] |= (1<<(day&7));
+	else log_index[(day%LOG_INDEX_DAYS)>>3] &= ~(1<<(day&7));
+}
+
+static void log_index_add(ulong day) {
+	if(day>log_index_last) {
+		// move the ring forward, clearing the days that drop out of it
+		ulong n = day-log_index_last;
+		if(n>=LOG_INDEX_DAYS) memset(log_index, 0, sizeof(log_index));
+		else for(ulong d=log_index_last+1;d<=day;d++) log_index_set(d, false);
+		log_index_last = day;
+	}
+	if(day+LOG_INDEX_DAYS>log_index_last) log_index_set(day, true);
+}
+
+static void log_index_file(const char *name, ulong size) {
+	// name is /logs/<day>.bin or /logs/<day>.txt
+	const char *p = strrchr(name, '/');
+	p = p ? p+1 : name;
+	if(*p<'0' || *p>'9') return;
+	ulong day = strtoul(p, NULL, 10);
+	log_index_add(day);
+	log_stats.files++;
+	log_stats.bytes += size;
+	if(!log_stats.oldest || day<log_stats.oldest) log_stats.oldest = day;
+}
+
+static void log_index_build() {
+	memset(log_index, 0, sizeof(log_index));
+	log_index_last = 0;
+	log_stats.files = 0;
+	log_stats.bytes = 0;
+	log_stats.oldest = 0;
+	storage_list(LOG_PREFIX, log_index_file);
+	log_index_valid = true;
+}
+
+bool log_exists(ulong day) {
+	if(!log_index_valid) log_index_build();
+	if(day>log_index_last) return false;
+	if(day+LOG_INDEX_DAYS<=log_index_last) {
+		// older than the index covers
+		char name[24];
+		log_file_name(name, day);
+		if(storage_exists(name)) return true;
+		log_file_name(name, day, true);
+		return storage_exists(name);
+	}
+	return (log_index[(day%LOG_INDEX_DAYS)>>3]>>(day&7))&1;
+}
+
+// ====== Encoding ======
+
+static byte put_varint(byte *p, ulong v) {
+	byte n = 0;
+	while(v>=0x80) {
+		p[n++] = (byte)(v|0x80);
+		v >>= 7;
+	}
+	p[n++] = (byte)v;
+	return n;
+}
+
+/** Encode a record after the one that ended at prev, returns the number of bytes */
+static byte log_encode(const LogRecord &r, ulong prev, byte *p) {
+	byte n = 0;
+	p[n++] = (r.type&LOG_TYPE_MASK) | (r.has_flow?LOG_FLAG_FLOW:0);
+	if(r.type==LOGDATA_STATION) {
+		n += put_varint(p+n, r.pid);
+		n += put_varint(p+n, r.sid);
+	} else {
+		n += put_varint(p+n, r.count);
+	}
+	n += put_varint(p+n, r.value);
+	// zigzag encode the time difference, as a record may end before the previous one
+	long delta = (long)(r.time-prev);
+	n += put_varint(p+n, (delta<0) ? (((ulong)(-delta)<<1)-1) : ((ulong)delta<<1));
+	if(r.has_flow) n += put_varint(p+n, r.flow);
+	return n;
+}
+
+static void log_write_header(StorageFile &file, ulong day) {
+	LogFileHeader h;
+	h.magic = LOG_FILE_MAGIC;
+	h.version = LOG_FILE_VERSION;
+	h.reserved = 0;
+	h.day = day;
+	file.write(&h, sizeof(h));
+}
+
+// ====== Reading ======
+
+StorageFile log_open(ulong day) {
+	if(!log_exists(day)) return StorageFile();
+	char name[24];
+	log_file_name(name, day, true);
+	if(storage_exists(name)) log_migrate(day);
+	log_file_name(name, day);
+	return storage_open(name, "r");
+}
+
+ulong log_raw_size(ulong start, ulong end) {
+	log_flush();
+	ulong total = 0;
+	for(ulong day=start;day<=end;day++) {
+		StorageFile file = log_open(day);
+		if(!file) continue;
+		total += file.size();
+		file.close();
+	}
+	return total;
+}
+
+bool log_parse_range(const char *s, ulong total, ulong &from, ulong &to) {
+	if(strncmp_P(s, PSTR("bytes="), 6)) return false;
+	s += 6;
+	char *e;
+	if(*s=='-') {
+		// suffix range: the last n bytes
+		ulong n = strtoul(s+1, &e, 10);
+		if(e==s+1 || *e || !n || !total) return false;
+		from = (n<total) ? total-n : 0;
+		to = total-1;
+		return true;
+	}
+	from = strtoul(s, &e, 10);
+	if(e==s || *e!='-' || from>=total) return false;
+	s = e+1;
+	to = total-1;
+	if(*s) {
+		to = strtoul(s, &e, 10);
+		if(*e || to<from) return false;
+		if(to>=total) to = total-1;
+	}
+	return true;
+}
+
+bool log_raw_copy(ulong start, ulong end, ulong from, ulong to, byte *buf, ulong bufsize,
+									bool (*out)(const byte *data, ulong len)) {
+	ulong offset = 0;	// offset of the current file in the download
+	for(ulong day=start;day<=end && offset<=to;day++) {
+		StorageFile file = log_open(day);
+		if(!file) continue;
+		ulong size = file.size();
+		if (offset+size>from) {
+			ulong pos = (from>offset) ? from-offset : 0;
+			ulong stop = (to-offset+1<size) ? to-offset+1 : size;
+			file.seek(pos);
+			while (pos<stop) {
+				ulong n = stop-pos;
+				if (n>bufsize) n = bufsize;
+				int r = file.read(buf, n);
+				if (r<=0 || !out(buf, r)) {
+					file.close();
+					return false;
+				}
+				pos += r;
+			}
+		}
+		file.close();
+		offset += size;
+	}
+	return true;
+}
+
+LogFileReader::LogFileReader() : offset(0), len(0), pos(0) {}
+
+int LogFileReader::get() {
+	if(pos==len) {
+		// read ahead, reading the file byte by byte is slow
+		int n = file.read(buf, sizeof(buf));
+		if(n<=0) return -1;
+		len = n;
+		pos = 0;
+	}
+	offset++;
+	return buf[pos++];
+}
+
+bool LogFileReader::get_varint(ulong &v) {
+	v = 0;
+	for(byte shift=0;shift<35;shift+=7) {
+		int c = get();
+		if(c<0) return false;
+		v |= (ulong)(c&0x7F)<<shift;
+		if(!(c&0x80)) return true;
+	}
+	return false;
+}
+
+void LogFileReader::close() {
+	file.close();
+}
+
+LogReader::LogReader() : types(LOG_TYPE_ALL), start(0), end(0xFFFFFFFFUL), prev(0) {}
+
+void LogReader::filter(uint16_t types, ulong start, ulong end) {
+	this->types = types;
+	this->start = start;
+	this->end = end;
+}
+
+bool LogReader::open(ulong day) {
+	if(!types || (day+1)*86400UL<=start || day*86400UL>end) return false;
+	file = log_open(day);
+	if(!file) return false;
+	LogFileHeader h;
+	if(file.read(&h, sizeof(h))!=sizeof(h) || h.magic!=LOG_FILE_MAGIC || h.version!=LOG_FILE_VERSION) {
+		file.close();
+		return false;
+	}
+	prev = h.day*86400UL;
+	reset();
+	return true;
+}
+
+bool LogReader::next(LogRecord &r) {
+	if(!file) return false;
+	while(decode(r)) {
+		if(((types>>r.type)&1) && r.time>=start && r.time<=end) return true;
+	}
+	return false;
+}
+
+bool LogReader::decode(LogRecord &r) {
+	int c = get();
+	if(c<0 || (c&LOG_TYPE_MASK)>=LOG_NUM_TYPES) return false;
+	r.type = c&LOG_TYPE_MASK;
+	r.has_flow = (c&LOG_FLAG_FLOW)!=0;
+	ulong v, delta;
+	if(r.type==LOGDATA_STATION) {
+		if(!get_varint(v)) return false;
+		r.pid = v;
+		if(!get_varint(v)) return false;
+		r.sid = v;
+		r.count = 0;
+	} else {
+		if(!get_varint(r.count)) return false;
+		r.pid = r.sid = 0;
+	}
+	if(!get_varint(r.value)) return false;
+	if(!get_varint(delta)) return false;
+	r.time = prev + ((delta&1) ? -(long)((delta+1)>>1) : (long)(delta>>1));
+	prev = r.time;
+	r.flow = 0;
+	if(r.has_flow && !get_varint(r.flow)) return false;
+	return true;
+}
+
+// ====== Writing ======
+
+/** Find the end time of the last record of a day */
+static ulong log_last_time(ulong day) {
+	LogReader reader;
+	LogRecord r;
+	ulong t = day*86400UL;
+	if(reader.open(day)) {
+		while(reader.next(r)) t = r.time;
+		reader.close();
+	}
+	return t;
+}
+
+/** Write records that all end on the same day */
+static void log_write(const LogRecord *rs, byte n) {
+	ulong day = rs[0].time/86400UL;
+	char name[24];
+	if(day!=log_tail_day) {
+		// first record of the day since boot: convert an old text log,
+		// and find where the existing records end
+		log_tail_time = log_last_time(day);
+		log_tail_day = day;
+	}
+	log_file_name(name, day);
+	StorageFile file = storage_open(name, "r+");
+	bool existed = file;
+	ulong size = existed ? file.size() : 0;
+	if(existed && size>=sizeof(LogFileHeader)) {
+		file.seek(0, STORAGE_SEEK_END);
+	} else {
+		if(file) file.close();
+		file = storage_open(name, "w");
+		if(!file) return;
+		log_write_header(file, day);
+		log_tail_time = day*86400UL;
+		if(log_index_valid) {
+			log_index_add(day);
+			if(!existed) log_stats.files++;
+			if(!log_stats.oldest || day<log_stats.oldest) log_stats.oldest = day;
+		}
+	}
+	byte data[LOG_RECORD_MAXSIZE*4];
+	byte len = 0;
+	for(byte i=0;i<n;i++) {
+		if(len+LOG_RECORD_MAXSIZE>sizeof(data)) {
+			file.write(data, len);
+			len = 0;
+		}
+		len += log_encode(rs[i], log_tail_time, data+len);
+		log_tail_time = rs[i].time;
+	}
+	file.write(data, len);
+	if(log_index_valid) log_stats.bytes += file.position()-size;
+	file.close();
+}
+
+/** Records waiting to be written */
+static LogRecord log_ring[LOG_RING_SIZE];
+static byte log_ring_count = 0;
+static ulong log_ring_since = 0;	// time the oldest record was first seen by log_flush_due
+
+void log_append(const LogRecord &r) {
+	if(r.type>=LOG_NUM_TYPES) return;
+	if(log_ring_count==LOG_RING_SIZE) log_flush();
+	log_ring[log_ring_count++] = r;
+}
+
+void log_flush() {
+	byte i = 0;
+	while(i<log_ring_count) {
+		// records of the same day go into one write
+		byte j = i+1;
+		while(j<log_ring_count && log_ring[j].time/86400UL==log_ring[i].time/86400UL) j++;
+		log_write(log_ring+i, j-i);
+		i = j;
+	}
+	log_ring_count = 0;
+	log_ring_since = 0;
+}
+
+void log_flush_due(ulong curr_time, bool idle) {
+	if(!log_ring_count) return;
+	if(!log_ring_since) log_ring_since = curr_time;
+	if(idle || log_ring_count>=LOG_FLUSH_RECORDS || curr_time-log_ring_since>=LOG_FLUSH_DELAY) log_flush();
+}
+
+// ====== Migration of text logs ======
+
+/** Parse a text log line: [pid,sid,dur,end(,gpm)] or [count,"tp",value,end] */
+static bool log_parse_text(char *s, LogRecord &r) {
+	if(*s++!='[') return false;
+	ulong first = strtoul(s, &s, 10);
+	if(*s++!=',') return false;
+	if(*s=='"') {
+		r.type = log_type_index(s+1);
+		if(r.type>=LOG_NUM_TYPES || s[3]!='"') return false;
+		s += 4;
+		r.count = first;
+		r.pid = r.sid = 0;
+	} else {
+		r.type = LOGDATA_STATION;
+		r.pid = first;
+		r.sid = strtoul(s, &s, 10);
+		r.count = 0;
+	}
+	if(*s++!=',') return false;
+	r.value = strtoul(s, &s, 10);
+	if(*s++!=',') return false;
+	r.time = strtoul(s, &s, 10);
+	r.has_flow = false;
+	r.flow = 0;
+	if(*s==',') {
+		// flow rate, written with two decimals
+		s++;
+		r.has_flow = true;
+		r.flow = strtoul(s, &s, 10)*100;
+		if(*s=='.') {
+			s++;
+			if(*s>='0' && *s<='9') r.flow += (*s++-'0')*10;
+			if(*s>='0' && *s<='9') r.flow += (*s++-'0');
+		}
+	}
+	return *s==']';
+}
+
+/** Convert the text log of a day to the binary format
+ * The text log stays until the conversion is complete, so a conversion cut
+ * short by a reboot starts over.
+ */
+static void log_migrate(ulong day) {
+	char name[24];
+	log_file_name(name, day, true);
+	StorageFile in = storage_open(name, "r");
+	if(!in) return;
+	log_file_name(name, day);
+	ulong size;
+	if(log_index_valid) {
+		// the text log is replaced, as is the output of an earlier conversion that was cut short
+		log_stats.bytes -= in.size();
+		if(storage_stat(name, &size)) {
+			log_stats.files--;
+			log_stats.bytes -= size;
+		}
+	}
+	StorageFile out = storage_open(name, "w");
+	if(!out) {
+		in.close();
+		return;
+	}
+	log_write_header(out, day);
+
+	char line[LOG_RENDER_MAXSIZE];
+	byte n = 0;
+	ulong prev = day*86400UL;
+	LogRecord r;
+	byte data[LOG_RECORD_MAXSIZE];
+	while(true) {
+		int c = in.read();
+		if(c<0 || c=='\n') {
+			line[n] = 0;
+			if(n && log_parse_text(line, r)) {
+				out.write(data, log_encode(r, prev, data));
+				prev = r.time;
+			}
+			n = 0;
+			if(c<0) break;
+		} else if(c!='\r' && n<sizeof(line)-1) {
+			line[n++] = c;
+		}
+	}
+	if(log_index_valid) log_stats.bytes += out.position();
+	out.close();
+	in.close();
+	log_file_name(name, day, true);
+	storage_remove(name);
+	if(day==log_tail_day) log_tail_day = 0;
+}
+
+// ====== Rendering ======
+
+void log_render(const LogRecord &r, char *buf) {
+	strcpy_P(buf, PSTR("["));
+	if(r.type==LOGDATA_STATION) {
+		itoa(r.pid, buf+strlen(buf), 10);
+		strcat_P(buf, PSTR(","));
+		itoa(r.sid, buf+strlen(buf), 10);
+	} else {
+		ultoa(r.count, buf+strlen(buf), 10);
+		strcat_P(buf, PSTR(",\""));
+		strcat_P(buf, log_type_names+r.type*3);
+		strcat_P(buf, PSTR("\""));
+	}
+	strcat_P(buf, PSTR(","));
+	ultoa(r.value, buf+strlen(buf), 10);
+	strcat_P(buf, PSTR(","));
+	ultoa(r.time, buf+strlen(buf), 10);
+	if(r.has_flow) {
+		// same as the %5.2f the text logs were written with
+		char num[16];
+		ultoa(r.flow/100, num, 10);
+		strcat_P(num, PSTR("."));
+		if(r.flow%100<10) strcat_P(num, PSTR("0"));
+		ultoa(r.flow%100, num+strlen(num), 10);
+		strcat_P(buf, PSTR(","));
+		for(byte i=strlen(num);i<5;i++) strcat_P(buf, PSTR(" "));
+		strcat(buf, num);
+	}
+	strcat_P(buf, PSTR("]"));
+}
+
+// ====== Deleting ======
+
+/** Remove a log file, keeping the footprint up to date
+ * Returns 1 if the file was removed, 0 if there was none, -1 if it could not be removed.
+ */
+static int log_remove(const char *name) {
+	ulong size;
+	bool sized = storage_stat(name, &size);
+	if(!storage_remove(name)) return (sized || storage_exists(name)) ? -1 : 0;
+	if(!log_index_valid) return 1;
+	if(sized) {
+		log_stats.files--;
+		log_stats.bytes -= size;
+	} else {
+		// size unknown: count the files again on next use
+		log_index_valid = false;
+	}
+	return 1;
+}
+
+/** Delete the log of a day
+ * Returns 1 if a file was removed, 0 if there was none, -1 if a file could not be removed.
+ */
+static int log_delete_day(ulong day) {
+	log_flush();
+	char name[24];
+	log_file_name(name, day);
+	int bin = log_remove(name);
+	log_file_name(name, day, true);
+	int txt = log_remove(name);
+	if(day==log_tail_day) log_tail_day = 0;
+	if(bin<0 || txt<0) return -1;
+	int removed = (bin>0 || txt>0) ? 1 : 0;
+	if(!log_index_valid) return removed;
+	if(day+LOG_INDEX_DAYS<=log_index_last) {
+		// before the index: the file list is needed to find the next oldest log
+		log_index_valid = false;
+		return removed;
+	}
+	if(day<=log_index_last) log_index_set(day, false);
+	if(day==log_stats.oldest) {
+		log_stats.oldest = 0;
+		for(ulong d=day+1;d<=log_index_last;d++) {
+			if(log_exists(d)) {
+				log_stats.oldest = d;
+				break;
+			}
+		}
+	}
+	return removed;
+}
+
+void log_delete(ulong day) {
+	log_delete_day(day);
+}
+
+static void log_delete_file(const char *name, ulong size) {
+	storage_remove(name);
+}
+
+void log_delete_all() {
+	log_ring_count = 0;
+	log_ring_since = 0;
+	storage_list(LOG_PREFIX, log_delete_file);
+	log_tail_day = 0;
+	memset(log_index, 0, sizeof(log_index));
+	log_stats.files = 0;
+	log_stats.bytes = 0;
+	log_stats.oldest = 0;
+	rollup_delete_all();
+}
+
+// ====== Retention ======
+
+void log_prune(ulong curr_time, byte max_days, byte max_share) {
+	if(!log_index_valid) log_index_build();
+	ulong today = curr_time/86400UL;
+	ulong day = log_stats.oldest;
+	if(max_days && rollup_prune(today, max_days)) return;
+	if(!log_stats.files || !day || day>=today) return;
+	bool prune = (max_days && day+max_days<=today);
+	if(!prune) {
+		ulong total, used;
+		storage_info(&total, &used);
+		if(total) {
+			prune = (max_share && log_stats.bytes*100>total*max_share) ||
+			        (used*100>total*LOG_FS_FILL_MAX);
+		}
+	}
+	if(!prune) return;
+	int removed = log_delete_day(day);
+	if(removed<=0) return;	// failed removals are tried again on the next call
+	log_stats.pruned++;
+	log_stats.prune_time = curr_time;
+}
+
+const LogStats& log_get_stats() {
+	if(!log_index_valid) log_index_build();
+	return log_stats;
+}
+
+// ====== Daily rollups ======
+
+static RollupEntry rollup_table[ROLLUP_SLOTS];
+static byte rollup_slot[MAX_NUM_STATIONS];	// table index of each station, 0xFF if none
+static byte rollup_count = 0;
+static ulong rollup_day = 0;	// day being counted, 0 until the first update
+static ulong rollup_pulse_count = 0;
+static ulong rollup_pos = 0;	// offset of the chunk of the day in its file
+static ulong rollup_end = 0;	// end of that chunk, 0 if the chunk has not been written yet
+static bool rollup_dirty = false;
+static ulong rollup_flush_time = 0;
+static ulong rollup_oldest = 0xFFFFFFFFUL;	// oldest block file, 0xFFFFFFFF if not known
+
+static void rollup_file_name(char *buf, ulong block) {
+	strcpy_P(buf, PSTR(ROLLUP_PREFIX));
+	ultoa(block, buf+strlen(buf), 10);
+	strcat_P(buf, PSTR(".dat"));
+}
+
+static void rollup_clear() {
+	memset(rollup_slot, 0xFF, sizeof(rollup_slot));
+	rollup_count = 0;
+	rollup_pulse_count = 0;
+}
+
+bool RollupReader::open_block() {
+	char name[24];
+	rollup_file_name(name, block);
+	file = storage_open(name, "r");
+	reset();
+	return file;
+}
+
+bool RollupReader::open(ulong start, ulong end) {
+	this->start = start;
+	this->end = end;
+	left = 0;
+	for(block=start/ROLLUP_BLOCK_DAYS;block<=end/ROLLUP_BLOCK_DAYS;block++) {
+		if(open_block()) return true;
+	}
+	return false;
+}
+
+bool RollupReader::next_entry(RollupEntry &e) {
+	if(!left) return false;
+	left--;
+	int c = get();
+	if(c<0) return false;
+	e.sid = c;
+	if(!get_varint(e.runs)) return false;
+	if(!get_varint(e.secs)) return false;
+	if(!get_varint(e.skips)) return false;
+	return true;
+}
+
+bool RollupReader::next_day(ulong &day, ulong &pulses) {
+	RollupEntry e;
+	while(file) {
+		while(left) {
+			// skip the rest of the previous chunk
+			if(!next_entry(e)) left = 0;
+		}
+		int n;
+		if(get_varint(day) && get_varint(pulses) && (n=get())>=0) {
+			left = n;
+			if(day>=start && day<=end) return true;
+			continue;
+		}
+		// end of this file, move on to the next block of the range
+		close();
+		while(++block<=end/ROLLUP_BLOCK_DAYS) {
+			if(open_block()) break;
+		}
+	}
+	return false;
+}
+
+/** Start counting a day
+ * The counters written before a reboot are picked up if the day's chunk is
+ * the last one of its file. Otherwise counting starts over in a new chunk,
+ * and the chunks of the day add up.
+ */
+static void rollup_begin(ulong day) {
+	rollup_clear();
+	rollup_day = day;
+	rollup_end = 0;
+	RollupReader reader;
+	RollupEntry e;
+	ulong d, pulses;
+	ulong block_start = day/ROLLUP_BLOCK_DAYS*ROLLUP_BLOCK_DAYS;
+	if(!reader.open(block_start, block_start+ROLLUP_BLOCK_DAYS-1)) return;
+	ulong pos = 0;	// offset of the last chunk of the file
+	bool last = false;	// whether the last chunk is the day's
+	while(true) {
+		ulong p = reader.tell();
+		if(!reader.next_day(d, pulses)) break;
+		pos = p;
+		last = (d==day);
+		if(last) {
+			rollup_clear();
+			rollup_pulse_count = pulses;
+		}
+		while(reader.next_entry(e)) {
+			if(!last || e.sid>=MAX_NUM_STATIONS || rollup_count==ROLLUP_SLOTS) continue;
+			rollup_slot[e.sid] = rollup_count;
+			rollup_table[rollup_count++] = e;
+		}
+	}
+	if(last) {
+		rollup_pos = pos;
+		rollup_end = reader.tell();
+	} else {
+		rollup_clear();
+	}
+	reader.close();
+}
+
+/** Write the counters of the day
+ * The chunk is rewritten in place while it is the last one of its file (the
+ * counters only grow, so it never gets shorter), or else appended.
+ */
+void rollup_flush() {
+	if(!rollup_dirty) return;
+	char name[24];
+	rollup_file_name(name, rollup_day/ROLLUP_BLOCK_DAYS);
+	StorageFile file = storage_open(name, "r+");
+	if(!file) {
+		file = storage_open(name, "w");
+		if(!file) return;
+		if(rollup_oldest==0xFFFFFFFEUL) rollup_oldest = rollup_day/ROLLUP_BLOCK_DAYS;
+	}
+	ulong size = file.size();
+	if(!rollup_end || rollup_end!=size) rollup_pos = size;
+	file.seek(rollup_pos);
+	byte data[64];
+	byte n = put_varint(data, rollup_day);
+	n += put_varint(data+n, rollup_pulse_count);
+	data[n++] = rollup_count;
+	for(byte i=0;i<rollup_count;i++) {
+		if(n+16>sizeof(data)) {
+			file.write(data, n);
+			n = 0;
+		}
+		const RollupEntry &e = rollup_table[i];
+		data[n++] = e.sid;
+		n += put_varint(data+n, e.runs);
+		n += put_varint(data+n, e.secs);
+		n += put_varint(data+n, e.skips);
+	}
+	file.write(data, n);
+	rollup_end = file.position();
+	file.close();
+	rollup_dirty = false;
+}
+
+void rollup_flush_due(ulong curr_time, bool idle) {
+	if(!rollup_dirty) return;
+	if(idle || curr_time-rollup_flush_time>=ROLLUP_FLUSH_DELAY) {
+		rollup_flush();
+		rollup_flush_time = curr_time;
+	}
+}
+
+/** Counters of a station for the day of curr_time, NULL if the station is out of range */
+static RollupEntry* rollup_entry(byte sid, ulong curr_time) {
+	if(sid>=MAX_NUM_STATIONS) return NULL;
+	ulong day = curr_time/86400UL;
+	if(day!=rollup_day) {
+		rollup_flush();
+		rollup_begin(day);
+	}
+	byte i = rollup_slot[sid];
+	if(i==0xFF) {
+		if(rollup_count==ROLLUP_SLOTS) {
+			// table is full: close the chunk and start another one for the day
+			rollup_flush();
+			rollup_clear();
+			rollup_end = 0;
+		}
+		i = rollup_count++;
+		rollup_slot[sid] = i;
+		RollupEntry &e = rollup_table[i];
+		e.sid = sid;
+		e.runs = e.skips = 0;
+		e.secs = 0;
+	}
+	rollup_dirty = true;
+	return rollup_table+i;
+}
+
+void rollup_run(byte sid, ulong secs, ulong curr_time) {
+	RollupEntry *e = rollup_entry(sid, curr_time);
+	if(!e) return;
+	e->runs++;
+	e->secs += secs;
+}
+
+void rollup_skip(byte sid, ulong curr_time) {
+	RollupEntry *e = rollup_entry(sid, curr_time);
+	if(e) e->skips++;
+}
+
+void rollup_pulses(ulong pulses, ulong curr_time) {
+	if(!pulses) return;
+	if(curr_time/86400UL!=rollup_day) {
+		rollup_flush();
+		rollup_begin(curr_time/86400UL);
+	}
+	rollup_pulse_count += pulses;
+	rollup_dirty = true;
+}
+
+static void rollup_delete_file(const char *name, ulong size) {
+	storage_remove(name);
+}
+
+static void rollup_delete_all() {
+	storage_list(ROLLUP_PREFIX, rollup_delete_file);
+	rollup_clear();
+	rollup_day = 0;
+	rollup_end = 0;
+	rollup_dirty = false;
+	rollup_oldest = 0xFFFFFFFFUL;
+}
+
+static ulong rollup_scan_oldest;
+static void rollup_scan_file(const char *name, ulong size) {
+	// name is /rollups/<block>.dat
+	const char *p = strrchr(name, '/');
+	p = p ? p+1 : name;
+	if(*p<'0' || *p>'9') return;
+	ulong block = strtoul(p, NULL, 10);
+	if(block<rollup_scan_oldest) rollup_scan_oldest = block;
+}
+
+/** Remove the oldest rollup file once all its days are older than max_days
+ * Returns true if a file was removed.
+ */
+static bool rollup_prune(ulong today, byte max_days) {
+	if(rollup_oldest==0xFFFFFFFFUL) {
+		rollup_scan_oldest = 0xFFFFFFFEUL;	// no files
+		storage_list(ROLLUP_PREFIX, rollup_scan_file);
+		rollup_oldest = rollup_scan_oldest;
+	}
+	if(rollup_oldest==0xFFFFFFFEUL) return false;
+	if((rollup_oldest+1)*ROLLUP_BLOCK_DAYS+max_days>today) return false;
+	if(rollup_oldest==rollup_day/ROLLUP_BLOCK_DAYS) return false;	// still being counted
+	char name[24];
+	rollup_file_name(name, rollup_oldest);
+	if(!storage_remove(name)) return false;
+	rollup_oldest = 0xFFFFFFFFUL;	// find the next oldest on the next call
+	return true;
+}
@@ -0,0 +1,209 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Log file header file
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _OSLOG_H
+#define _OSLOG_H
+
+#include <Arduino.h>
+
+#include "defines.h"
+#include "storage.h"
+
+/** Binary log files
+ * Each day is kept in /logs/<day>.bin, where day is the epoch time / 86400.
+ * The file starts with a LogFileHeader followed by the records back to back:
+ *  - one header byte: the record type in the low nibble, and LOG_FLAG_FLOW
+ *  - station records: pid, sid and duration as varints
+ *    special records: count (flow count of fl records) and value as varints
+ *  - the end time as a zigzag varint, relative to the previous record of the
+ *    file (to the start of the day for the first record)
+ *  - if LOG_FLAG_FLOW is set: the flow rate x100 as a varint
+ * Records are rendered to the JSON array form only when they are queried.
+ * Text logs (/logs/<day>.txt) of older firmwares are converted the first
+ * time their day is read or written.
+ */
+
+#define LOG_PREFIX       "/logs/"
+#define LOG_FILE_MAGIC   0x4C4F	// "OL"
+#define LOG_FILE_VERSION 1
+
+#define LOG_NUM_TYPES    6	// LOGDATA_STATION to LOGDATA_SENSOR2
+#define LOG_TYPE_MASK    0x0F
+#define LOG_FLAG_FLOW    0x10
+
+#define LOG_TYPE_ALL     ((1<<LOG_NUM_TYPES)-1)	// type mask of all record types
+#define LOG_INDEX_DAYS   512	// days covered by the index of log files, must be a multiple of 8
+
+#define LOG_RING_SIZE      16	// records kept in RAM before they must be written
+#define LOG_FLUSH_RECORDS  8	// write the pending records once there are this many
+#define LOG_FLUSH_DELAY    30	// or once the oldest has waited this long (seconds)
+
+#define LOG_FS_FILL_MAX    85	// prune the oldest logs while the flash is fuller than this (percent)
+
+#define LOG_RECORD_MAXSIZE 24	// header byte plus four 5-byte varints
+#define LOG_RENDER_MAXSIZE 64	// longest JSON array of a record
+
+struct LogFileHeader {
+	uint16_t magic;
+	byte version;
+	byte reserved;
+	uint32_t day;
+};
+
+/** A decoded log record */
+struct LogRecord {
+	byte type;	// LOGDATA_ type
+	byte pid;	// station records: program index
+	byte sid;	// station records: station index
+	bool has_flow;
+	ulong count;	// special records: the first field (flow count of fl records)
+	ulong value;	// station records: duration; special records: value
+	ulong time;	// end time
+	ulong flow;	// station records: flow rate x100
+};
+
+/** Log footprint and pruning, for /db */
+struct LogStats {
+	ulong files;	// number of log files
+	ulong bytes;	// their total size
+	ulong oldest;	// oldest day with a log
+	ulong pruned;	// log files removed by pruning since boot
+	ulong prune_time;	// time of the last pruning
+};
+
+/** Buffered reads of varint encoded files */
+class LogFileReader {
+public:
+	LogFileReader();
+	void close();
+	ulong tell() { return offset; }	// offset of the next byte
+protected:
+	int get();	// next byte, -1 at the end of the file
+	bool get_varint(ulong &v);
+	void reset() { len = pos = 0; offset = 0; }	// after the file is opened
+	StorageFile file;
+	ulong offset;
+	byte buf[128];	// read-ahead block
+	byte len, pos;
+};
+
+/** Reads the records of one day in order
+ * Records that do not pass the filter are skipped while decoding, so they
+ * are never rendered.
+ */
+class LogReader : public LogFileReader {
+public:
+	LogReader();
+	/** Only return records whose type is in the types mask (bit n is type n),
+	 * and which end between start and end (inclusive) */
+	void filter(uint16_t types, ulong start, ulong end);
+	bool open(ulong day);	// false if there is no log for the day
+	bool next(LogRecord &r);	// false at the end of the log
+private:
+	bool decode(LogRecord &r);
+	uint16_t types;
+	ulong start, end;
+	ulong prev;	// end time of the previous record
+};
+
+/** Daily rollups
+ * For each day, the run count, seconds run and skipped runs of every station
+ * that was scheduled, and the flow sensor pulses of the day. The counters of
+ * the current day are kept in RAM and updated in constant time, and are
+ * written back to /rollups/<day/32>.dat as one chunk:
+ *  day, pulses as varints, the number of entries as a byte, and for each
+ *  entry the station index as a byte, then runs, seconds and skips as varints.
+ * Counters only grow, so the chunk of the current day is rewritten in place at
+ * the end of the file. If more than ROLLUP_SLOTS stations are scheduled in one
+ * day, a new chunk is started and the chunks of that day add up.
+ */
+#define ROLLUP_PREFIX      "/rollups/"
+#define ROLLUP_BLOCK_DAYS  32	// days per rollup file
+#define ROLLUP_SLOTS       64	// stations counted in RAM per chunk
+#define ROLLUP_FLUSH_DELAY 600	// write back the counters at least this often while busy (seconds)
+
+struct RollupEntry {
+	byte sid;
+	ulong runs;
+	ulong skips;
+	ulong secs;
+};
+
+/** Reads the rollup chunks of a range of days */
+class RollupReader : public LogFileReader {
+public:
+	bool open(ulong start, ulong end);	// days
+	/** Next chunk in the range, its entries are read with next_entry */
+	bool next_day(ulong &day, ulong &pulses);
+	bool next_entry(RollupEntry &e);
+private:
+	bool open_block();
+	ulong start, end;
+	ulong block;
+	byte left;	// entries left in the current chunk
+};
+
+void rollup_run(byte sid, ulong secs, ulong curr_time);
+void rollup_skip(byte sid, ulong curr_time);
+void rollup_pulses(ulong pulses, ulong curr_time);
+void rollup_flush();
+/** Called once a second: write back the counters if they changed and the
+ * controller is idle, or if they were last written ROLLUP_FLUSH_DELAY ago */
+void rollup_flush_due(ulong curr_time, bool idle);
+
+void log_file_name(char *buf, ulong day, bool text=false);
+/** Whether there is a log for the day, from the RAM index of log files */
+bool log_exists(ulong day);
+/** Open the binary log file of a day for reading, converting a text log first */
+StorageFile log_open(ulong day);
+/** Raw download of the log files of a range of days, as one concatenated
+ * stream: total size of the files, with the queued records flushed first */
+ulong log_raw_size(ulong start, ulong end);
+/** Parse a single byte range "bytes=a-b", "bytes=a-" or "bytes=-n" of the download */
+bool log_parse_range(const char *s, ulong total, ulong &from, ulong &to);
+/** Copy bytes from..to of the download through buf to out, one block per
+ * read; returns false if a read or out fails */
+bool log_raw_copy(ulong start, ulong end, ulong from, ulong to, byte *buf, ulong bufsize,
+									bool (*out)(const byte *data, ulong len));
+/** Queue a record, it is written to flash by log_flush */
+void log_append(const LogRecord &r);
+/** Write the queued records, with one file open per day */
+void log_flush();
+/** Called once a second: flush if enough records are queued, the oldest
+ * has waited LOG_FLUSH_DELAY seconds, or the controller is idle */
+void log_flush_due(ulong curr_time, bool idle);
+/** Render a record as its JSON array, e.g. [pid,sid,dur,end] or [count,"tp",value,end] */
+void log_render(const LogRecord &r, char *buf);
+/** Record type of a two-letter type name, 0xFF if unknown */
+byte log_type_index(const char *name);
+void log_delete(ulong day);
+void log_delete_all();	// also removes the rollups
+/** Called once a second when the controller is idle: remove the oldest log
+ * if it is older than max_days, if the logs take more than max_share percent
+ * of the flash, or if the flash is fuller than LOG_FS_FILL_MAX percent.
+ * Rollup files whose days are all older than max_days are removed the same way.
+ * One file is removed per call, and today's log is never removed.
+ */
+void log_prune(ulong curr_time, byte max_days, byte max_share);
+const LogStats& log_get_stats();
+
+#endif // _OSLOG_H
@@ -32,116 +32,763 @@
 
 // Declare static data members
 byte ProgramData::nprograms = 0;
+uint16_t ProgramData::revision = 0;
 byte ProgramData::nqueue = 0;
+byte ProgramData::queue_peak = 0;
+uint16_t ProgramData::queue_rejects = 0;
+uint16_t ProgramData::prog_drops[MAX_NUM_PROGRAMS];
+ProgramEntry ProgramData::programs[MAX_NUM_PROGRAMS];
+ProgramStruct ProgramData::scratch;
+ProgramStation ProgramData::pstations[PROGRAM_POOL_SIZE];
+uint16_t ProgramData::npstations = 0;
+byte ProgramData::sched_bits[MAX_NUM_PROGRAMS][SCHEDULE_BITMAP_SIZE];
+byte ProgramData::sched_dirty[(MAX_NUM_PROGRAMS+7)/8];
+ulong ProgramData::sched_day = 0;
+uint16_t ProgramData::sched_sunrise = 0;
+uint16_t ProgramData::sched_sunset = 0;
 RuntimeQueueStruct ProgramData::queue[RUNTIME_QUEUE_SIZE];
+byte ProgramData::qorder[RUNTIME_QUEUE_SIZE];
+byte ProgramData::qpos[RUNTIME_QUEUE_SIZE];
+RuntimeEventStruct ProgramData::events[RUNTIME_EVENTS_SIZE];
+uint16_t ProgramData::nevents = 0;
 byte ProgramData::station_qid[MAX_NUM_STATIONS];
+byte ProgramData::station_prog[STATION_BYTES] __attribute__((aligned(4)));
+MasterIntervalStruct ProgramData::mas_intervals[2][RUNTIME_QUEUE_SIZE];
+byte ProgramData::nmas_intervals[2];
+byte ProgramData::mas_first[2];
+byte ProgramData::mas_dirty = 1;
+byte ProgramData::mas_settings[6+2*STATION_BYTES];
+FlowStep ProgramData::flow_steps[FLOW_STEPS_SIZE];
+uint16_t ProgramData::flow_nsteps = 0;
 LogStruct ProgramData::lastrun;
-ulong ProgramData::last_seq_stop_time;
+ulong ProgramData::last_seq_stop_times[NUM_SEQ_GROUPS];
 extern char tmp_buffer[];
 
 void ProgramData::init() {
 	reset_runtime();
-	load_count();
+	load_all();
+	memset(sched_dirty, 0xFF, sizeof(sched_dirty));
 }
 
 void ProgramData::reset_runtime() {
 	memset(station_qid, 0xFF, MAX_NUM_STATIONS);	// reset station qid to 0xFF
+	memset(station_prog, 0, STATION_BYTES);
+	memset(qpos, 0xFF, RUNTIME_QUEUE_SIZE);	// all queue slots are free
+	for(byte i=0;i<RUNTIME_QUEUE_SIZE;i++) qorder[i] = i;
 	nqueue = 0;
-	last_seq_stop_time = 0;
+	nevents = 0;
+	memset(last_seq_stop_times, 0, sizeof(last_seq_stop_times));
+	mas_dirty = 1;
 }
 
-/** Insert a new element to the queue
+/** Insert a new element to the queue for program pid
  * This function returns pointer to the next available element in the queue
- * and returns NULL if the queue is full
+ * and returns NULL if the queue is full. Rejected elements are counted,
+ * per program for program runs (pid 1 to MAX_NUM_PROGRAMS).
  */
-RuntimeQueueStruct* ProgramData::enqueue() {
-	if (nqueue < RUNTIME_QUEUE_SIZE) {
-		nqueue ++;
-		return queue + (nqueue-1);
-	} else {
+RuntimeQueueStruct* ProgramData::enqueue(byte pid) {
+	if (nqueue >= RUNTIME_QUEUE_SIZE) {
+		if (queue_rejects < 0xFFFF) queue_rejects++;
+		if (pid>0 && pid<=MAX_NUM_PROGRAMS && prog_drops[pid-1] < 0xFFFF) prog_drops[pid-1]++;
 		return NULL;
 	}
+	// qorder[nqueue] is the most recently freed slot
+	byte qid = qorder[nqueue];
+	qpos[qid] = nqueue++;
+	if (nqueue > queue_peak) queue_peak = nqueue;
+	queue[qid].pid = pid;
+	return queue + qid;
 }
 
 /** Remove an element from the queue
- * This function copies the last element of
- * the queue to overwrite the requested
- * element, therefore removing the requested element.
+ * The remaining elements keep their slots and their order.
+ * If the element is assigned to its station, the station is assigned
+ * the next element queued for it.
  */
-// this removes an element from the queue
 void ProgramData::dequeue(byte qid) {
-	if (qid>=nqueue)	return;
-	if (qid<nqueue-1) {
-		queue[qid] = queue[nqueue-1]; // copy the last element to the dequeud element to fill the space
-		if(station_qid[queue[qid].sid] == nqueue-1) // fix queue index if necessary
-			station_qid[queue[qid].sid] = qid;
-	}
+	if (qid>=RUNTIME_QUEUE_SIZE || qpos[qid]==0xFF)	return;
+	byte i = qpos[qid];
+	qpos[qid] = 0xFF;
 	nqueue--;
+	for(;i<nqueue;i++) {
+		qorder[i] = qorder[i+1];
+		qpos[qorder[i]] = i;
+	}
+	qorder[nqueue] = qid;	// the slot is reused first
+	RuntimeQueueStruct *q = queue + qid;
+	mas_dirty = 1;
+	if (station_qid[q->sid] == qid)	update_station_qid(q->sid);
+	if (!q->dur || q->st+q->dur >= last_seq_stop_times[os.attrib_grp[q->sid]])	update_seq_stop_time();
+}
+
+/** Assign a station the queue element with the earliest start time */
+void ProgramData::update_station_qid(byte sid) {
+	byte sqi = 0xFF;
+	for(byte i=0;i<nqueue;i++) {
+		byte qid = qorder[i];
+		if (queue[qid].sid != sid) continue;
+		if (sqi==0xFF || queue[qid].st < queue[sqi].st) sqi = qid;
+	}
+	assign_station(sid, sqi);
+	// the newly assigned element may already be due to start
+	if (sqi != 0xFF) push_event(queue[sqi].st, sqi);
+}
+
+/** Assign a station a queue element (0xFF for none) */
+void ProgramData::assign_station(byte sid, byte qid) {
+	station_qid[sid] = qid;
+	if (qid != 0xFF && queue[qid].pid < 99) station_prog[sid>>3] |= (1<<(sid&0x07));
+	else station_prog[sid>>3] &= ~(1<<(sid&0x07));
+}
+
+/** Recalculate the last stop time of sequential stations in each sequential group */
+void ProgramData::update_seq_stop_time() {
+	memset(last_seq_stop_times, 0, sizeof(last_seq_stop_times));
+	if (os.iopts[IOPT_REMOTE_EXT_MODE]) return;
+	for(byte i=0;i<nqueue;i++) {
+		RuntimeQueueStruct *q = queue + qorder[i];
+		byte bid = q->sid>>3;
+		byte s = q->sid&0x07;
+		ulong *last = last_seq_stop_times + os.attrib_grp[q->sid];
+		if (q->dur && (os.attrib_seq[bid]&(1<<s)) && q->st+q->dur > *last) {
+			*last = q->st+q->dur;
+		}
+	}
+}
+
+/** Add the start and stop events of a queue element
+ * This is called every time an element is given a new start time or duration.
+ * Events that no longer match their element are simply ignored when they are due,
+ * because the element's state is checked again when processing any event.
+ */
+void ProgramData::add_events(byte qid) {
+	RuntimeQueueStruct *q = queue + qid;
+	byte sqi = station_qid[q->sid];
+	if (sqi == qid) {
+		update_station_qid(q->sid);
+	} else if (sqi == 0xFF || q->st < queue[sqi].st) {
+		assign_station(q->sid, qid);
+	}
+	push_event(q->st, qid);
+	push_event(q->st+q->dur, qid);
+	mas_dirty = 1;
+}
+
+/** Recompute the master intervals if the runtime queue or the master settings have changed */
+void ProgramData::update_master_intervals() {
+	byte settings[sizeof(mas_settings)];
+	settings[0] = os.status.mas;
+	settings[1] = os.status.mas2;
+	settings[2] = os.iopts[IOPT_MASTER_ON_ADJ];
+	settings[3] = os.iopts[IOPT_MASTER_OFF_ADJ];
+	settings[4] = os.iopts[IOPT_MASTER_ON_ADJ_2];
+	settings[5] = os.iopts[IOPT_MASTER_OFF_ADJ_2];
+	memcpy(settings+6, os.attrib_mas, STATION_BYTES);
+	memcpy(settings+6+STATION_BYTES, os.attrib_mas2, STATION_BYTES);
+	if (!mas_dirty && !memcmp(settings, mas_settings, sizeof(mas_settings))) return;
+	memcpy(mas_settings, settings, sizeof(mas_settings));
+	mas_dirty = 0;
+	compute_master_intervals(0, os.status.mas, os.attrib_mas,
+		water_time_decode_signed(os.iopts[IOPT_MASTER_ON_ADJ]), water_time_decode_signed(os.iopts[IOPT_MASTER_OFF_ADJ]));
+	compute_master_intervals(1, os.status.mas2, os.attrib_mas2,
+		water_time_decode_signed(os.iopts[IOPT_MASTER_ON_ADJ_2]), water_time_decode_signed(os.iopts[IOPT_MASTER_OFF_ADJ_2]));
+}
+
+/** Compute the merged on intervals of a master
+ * A master is on while any station linked to it is running, within the station's
+ * run time adjusted by the master on/off adjustments:
+ * from max(st, st+on_adj) until min(st+dur, st+dur+off_adj+1)
+ */
+void ProgramData::compute_master_intervals(byte mi, byte mas, const byte *attrib, int16_t on_adj, int16_t off_adj) {
+	MasterIntervalStruct *w = mas_intervals[mi];
+	byte n = 0;
+	mas_first[mi] = 0;
+	nmas_intervals[mi] = 0;
+	if (!mas) return;
+	for(byte i=0;i<nqueue;i++) {
+		RuntimeQueueStruct *q = queue + qorder[i];
+		byte sid = q->sid;
+		// skip if this is the master station
+		if (mas == sid+1) continue;
+		if (!q->st || !q->dur) continue;
+		if (!(attrib[sid>>3]&(1<<(sid&0x07)))) continue;
+		ulong on = q->st + on_adj;
+		if (on_adj < 0) on = q->st;
+		ulong off = q->st + q->dur + off_adj + 1;
+		if (off_adj >= 0) off = q->st + q->dur;
+		if (on >= off) continue;
+		// insert, sorted by on time
+		byte j = n++;
+		for(;j>0 && w[j-1].on > on;j--) w[j] = w[j-1];
+		w[j].on = on;
+		w[j].off = off;
+	}
+	// merge overlapping intervals
+	byte m = 0;
+	for(byte i=0;i<n;i++) {
+		if (m && w[i].on <= w[m-1].off) {
+			if (w[i].off > w[m-1].off) w[m-1].off = w[i].off;
+		} else {
+			w[m++] = w[i];
+		}
+	}
+	nmas_intervals[mi] = m;
+}
+
+/** Check if master mi (0: master 1, 1: master 2) should be on at the given time */
+byte ProgramData::check_master(byte mi, ulong curr_time) {
+	MasterIntervalStruct *w = mas_intervals[mi];
+	byte i = mas_first[mi];
+	// go back to the start if the clock has been set back
+	if (i && curr_time < w[i-1].off) i = 0;
+	// skip intervals that have ended
+	while (i < nmas_intervals[mi] && w[i].off <= curr_time) i++;
+	mas_first[mi] = i;
+	return (i < nmas_intervals[mi] && w[i].on <= curr_time) ? 1 : 0;
+}
+
+/** Flow budget
+ * When a flow limit is set, a concurrent station with a known expected flow rate
+ * starts at the earliest time at which the total expected flow of the runs it
+ * overlaps stays within the limit. Stations whose expected flow exceeds the limit
+ * run alone. The expected flow of scheduled runs over time is kept as a list of
+ * flow changes sorted by time, built by flow_prepare and extended by schedule_station.
+ */
+uint16_t ProgramData::flow_limit() {
+	return os.iopts[IOPT_REMOTE_EXT_MODE] ? 0 : (uint16_t)os.iopts[IOPT_FLOW_LIMIT]*10;
+}
+
+uint16_t ProgramData::flow_expected(byte sid, uint16_t limit) {
+	uint16_t f = os.station_flow[sid];
+	return (f > limit) ? limit : f;
 }
 
-/** Load program count from program file */
-void ProgramData::load_count() {
-	nprograms = file_read_byte(PROG_FILENAME, 0);
+void ProgramData::flow_add(RuntimeQueueStruct *q, uint16_t limit) {
+	uint16_t f = flow_expected(q->sid, limit);
+	if (!f || !q->st || !q->dur || flow_nsteps+2 > FLOW_STEPS_SIZE) return;
+	ulong t[2] = {q->st, q->st+q->dur};
+	for(byte k=0;k<2;k++) {
+		uint16_t i = flow_nsteps++;
+		for(;i>0 && flow_steps[i-1].t > t[k];i--) flow_steps[i] = flow_steps[i-1];
+		flow_steps[i].t = t[k];
+		flow_steps[i].flow = k ? -(int16_t)f : (int16_t)f;
+	}
+}
+
+void ProgramData::flow_prepare(ulong curr_time) {
+	flow_nsteps = 0;
+	uint16_t limit = flow_limit();
+	if (!limit) return;
+	for(byte i=0;i<nqueue;i++) {
+		RuntimeQueueStruct *q = queue + qorder[i];
+		if (q->st+q->dur > curr_time) flow_add(q, limit);
+	}
+}
+
+/** Find the earliest start time, not before t, at which a run of the given
+ * duration and expected flow keeps the total expected flow within the limit
+ * The flow profile is walked once: each period in which the load leaves no room
+ * for the run either starts after the run would end, so the run fits, or pushes
+ * the start to the end of the period. This is linear in the number of flow changes.
+ */
+ulong ProgramData::flow_place(ulong t, ulong dur, uint16_t f, uint16_t limit) {
+	int32_t room = (int32_t)limit - f;	// highest load the run still fits with
+	int32_t load = 0;
+	ulong full = 0;	// start of the current period with a load over room, 0 if none
+	for(uint16_t i=0;i<flow_nsteps;i++) {
+		load += flow_steps[i].flow;
+		// flow changes at the same time take effect together
+		if (i+1<flow_nsteps && flow_steps[i+1].t==flow_steps[i].t) continue;
+		if (load > room) {
+			if (!full) full = flow_steps[i].t;
+		} else if (full) {
+			// no room from full until this flow change
+			if (full >= t+dur) return t;
+			if (flow_steps[i].t > t) t = flow_steps[i].t;
+			full = 0;
+		}
+	}
+	return t;
 }
 
+/** Push an event to the event heap */
+void ProgramData::push_event(ulong t, byte qid) {
+	if (nevents >= RUNTIME_EVENTS_SIZE) {
+		// the heap is full of outdated events: rebuild it from the queue,
+		// which also covers the event being pushed
+		rebuild_events();
+		return;
+	}
+	uint16_t i = nevents++;
+	while (i>0) {
+		uint16_t parent = (i-1)/2;
+		if (events[parent].t <= t) break;
+		events[i] = events[parent];
+		i = parent;
+	}
+	events[i].t = t;
+	events[i].qid = qid;
+}
+
+/** Pop the earliest event if it is due
+ * Returns the qid of the event, or 0xFF if no event is due
+ */
+byte ProgramData::next_event(ulong curr_time) {
+	if (!nevents || events[0].t > curr_time)	return 0xFF;
+	byte qid = events[0].qid;
+	RuntimeEventStruct last = events[--nevents];
+	uint16_t i = 0;
+	while (true) {
+		uint16_t child = 2*i+1;
+		if (child >= nevents) break;
+		if (child+1 < nevents && events[child+1].t < events[child].t) child++;
+		if (last.t <= events[child].t) break;
+		events[i] = events[child];
+		i = child;
+	}
+	if (nevents) events[i] = last;
+	return qid;
+}
+
+/** Rebuild the event heap with the start and stop events of all queue elements
+ * Elements marked for reset (dur==0) get one event at time 0 instead, so they are
+ * processed in the next cycle as reset_all_stations intends.
+ */
+void ProgramData::rebuild_events() {
+	nevents = 0;
+	for(byte i=0;i<nqueue;i++) {
+		byte qid = qorder[i];
+		if (!queue[qid].dur) {
+			events[nevents].t = 0;
+			events[nevents++].qid = qid;
+			continue;
+		}
+		events[nevents].t = queue[qid].st;
+		events[nevents++].qid = qid;
+		events[nevents].t = queue[qid].st+queue[qid].dur;
+		events[nevents++].qid = qid;
+	}
+	// simple heapify by insertion, the heap is small
+	uint16_t n = nevents;
+	nevents = 0;
+	for(uint16_t i=0;i<n;i++) {
+		RuntimeEventStruct e = events[i];
+		uint16_t j = nevents++;
+		while (j>0) {
+			uint16_t parent = (j-1)/2;
+			if (events[parent].t <= e.t) break;
+			events[j] = events[parent];
+			j = parent;
+		}
+		events[j] = e;
+	}
+}
+
+/** Mark the compiled schedules of programs pid to pid+n-1 as out of date
+ * This is called on every program change */
+void ProgramData::invalidate_schedule(byte pid, byte n) {
+	revision++;
+	for(;n && pid<MAX_NUM_PROGRAMS;n--,pid++) {
+		sched_dirty[pid>>3] |= (1<<(pid&0x07));
+	}
+}
+
+/** Compile program schedules for the day of the given time
+ * Schedules are recompiled when the day or the sunrise/sunset time changes,
+ * and individually when a program is added or modified.
+ */
+void ProgramData::update_schedule(time_t t) {
+	ulong day = t / 86400L;
+	if (day != sched_day || os.nvdata.sunrise_time != sched_sunrise || os.nvdata.sunset_time != sched_sunset) {
+		sched_day = day;
+		sched_sunrise = os.nvdata.sunrise_time;
+		sched_sunset = os.nvdata.sunset_time;
+		memset(sched_dirty, 0xFF, sizeof(sched_dirty));
+	}
+	for(byte pid=0;pid<nprograms;pid++) {
+		if (sched_dirty[pid>>3] & (1<<(pid&0x07))) {
+			programs[pid].compile_schedule(t, sched_bits[pid]);
+			sched_dirty[pid>>3] &= ~(1<<(pid&0x07));
+			delay(0);
+		}
+	}
+}
+
+/** Check if program pid starts at the given time
+ * This is a single bit test if the schedule is compiled for the day of t,
+ * otherwise it falls back to ProgramSchedule::check_match
+ */
+byte ProgramData::check_match(byte pid, time_t t) {
+	if (pid >= nprograms) return 0;
+	if ((ulong)(t/86400L) != sched_day || (sched_dirty[pid>>3] & (1<<(pid&0x07))) ||
+			os.nvdata.sunrise_time != sched_sunrise || os.nvdata.sunset_time != sched_sunset) {
+		return programs[pid].check_match(t);
+	}
+	int16_t current_minute = (t%86400L)/60;
+	byte match = (sched_bits[pid][current_minute>>3]>>(current_minute&0x07))&1;
+#if defined(ENABLE_DEBUG)
+	// debug builds check the compiled schedule against the full match
+	if (match != programs[pid].check_match(t)) {
+		DEBUG_PRINT(F("schedule bitmap mismatch, program "));
+		DEBUG_PRINTLN(pid);
+	}
+#endif
+	return match;
+}
+
+// the program file stores the first PROG_RECORD_SIZE bytes of ProgramEntry and the
+// ProgramStation pool as they are: changing their layout changes the file format
+static_assert(sizeof(ProgramSchedule) == 12, "ProgramSchedule is part of the program file format");
+static_assert(sizeof(ProgramStation) == 3, "ProgramStation is part of the program file format");
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+static_assert(offsetof(ProgramEntry, name) == sizeof(ProgramSchedule) &&
+              offsetof(ProgramEntry, nsta) == sizeof(ProgramSchedule)+PROGRAM_NAME_SIZE,
+              "PROG_RECORD_SIZE must cover the schedule, the name and nsta of ProgramEntry");
+#pragma GCC diagnostic pop
+
 /** Save program count to program file */
 void ProgramData::save_count() {
-	file_write_byte(PROG_FILENAME, 0, nprograms);
+	file_write_byte(PROG_FILENAME, offsetof(ProgramFileHeader, nprograms), nprograms);
+}
+
+/** Load all programs from program file into RAM
+ * All subsequent reads are served from the RAM mirror,
+ * and all writes go to both the mirror and the program file.
+ * Older program files are converted to the current format: files without
+ * a header hold a program count followed by ProgramStruct records of 40
+ * stations, version 1 files hold ProgramStruct records of h.nstations stations.
+ */
+void ProgramData::load_all() {
+	ProgramFileHeader h;
+	h.magic = 0;
+	file_read_block(PROG_FILENAME, &h, 0, PROG_HEADER_SIZE);
+	ulong pos = PROG_HEADER_SIZE;
+	if (h.magic != PROG_FILE_MAGIC) {
+		// no header: 1 byte of program count followed by 40-station records
+		h.nprograms = h.magic;
+		h.version = 0;
+		h.nstations = 40;
+		pos = 1;
+	}
+	nprograms = h.nprograms;
+	npstations = 0;
+	if (nprograms > MAX_NUM_PROGRAMS) nprograms = 0;
+	if (h.version > PROG_FILE_VERSION || (h.version == 1 && !h.nstations) || (pos == PROG_HEADER_SIZE && !h.version)) {
+		// a version this firmware does not know: start over with no programs
+		// rather than parse the records in a layout they may not have
+		nprograms = 0;
+		save_all();
+		return;
+	}
+
+	if (h.version == PROG_FILE_VERSION) {
+		byte pid;
+		for(pid=0;pid<nprograms;pid++) {
+			ProgramEntry *p = programs+pid;
+			file_read_block(PROG_FILENAME, p, pos, PROG_RECORD_SIZE);
+			p->sidx = npstations;
+			if (npstations+p->nsta > PROGRAM_POOL_SIZE) break;	// corrupt record
+			file_read_block(PROG_FILENAME, pstations+npstations, pos+PROG_RECORD_SIZE, (ulong)p->nsta*sizeof(ProgramStation));
+			// station indices must be valid and in increasing order
+			ProgramStation *ps = pstations+npstations;
+			byte i;
+			for(i=0;i<p->nsta;i++) {
+				if (ps[i].sid >= MAX_NUM_STATIONS || (i && ps[i].sid <= ps[i-1].sid)) break;
+			}
+			if (i < p->nsta) break;
+			npstations += p->nsta;
+			pos += PROG_RECORD_SIZE + (ulong)p->nsta*sizeof(ProgramStation);
+		}
+		if (pid == nprograms) return;
+		// the file is corrupt: start over with no programs
+		nprograms = 0;
+		npstations = 0;
+		save_all();
+		return;
+	}
+
+	// convert ProgramStruct records
+	ProgramStruct &prog = scratch;
+	byte width = (h.nstations < MAX_NUM_STATIONS) ? h.nstations : MAX_NUM_STATIONS;
+	ulong reclen = sizeof(ProgramSchedule) + (ulong)h.nstations*sizeof(uint16_t) + PROGRAM_NAME_SIZE;
+	for(byte pid=0;pid<nprograms;pid++,pos+=reclen) {
+		memset(&prog, 0, PROGRAMSTRUCT_SIZE);
+		file_read_block(PROG_FILENAME, &prog, pos, sizeof(ProgramSchedule)+width*sizeof(uint16_t));
+		file_read_block(PROG_FILENAME, prog.name, pos+reclen-PROGRAM_NAME_SIZE, PROGRAM_NAME_SIZE);
+		memcpy(programs+pid, &prog, sizeof(ProgramSchedule));
+		memcpy(programs[pid].name, prog.name, PROGRAM_NAME_SIZE);
+		programs[pid].sidx = npstations;
+		programs[pid].nsta = 0;
+		store_stations(pid, prog.durations);
+		delay(0);
+	}
+	save_all();
+}
+
+/** Write all programs from RAM to a new program file */
+void ProgramData::save_all() {
+	ProgramFileHeader h;
+	h.magic = PROG_FILE_MAGIC;
+	h.version = PROG_FILE_VERSION;
+	h.nprograms = nprograms;
+	h.nstations = MAX_NUM_STATIONS;
+	write_to_file(PROG_FILENAME, (const char*)&h, PROG_HEADER_SIZE);
+	save_records(0);
+}
+
+/** File position of the record of program pid (pid==nprograms gives the end of the records) */
+ulong ProgramData::record_pos(byte pid) {
+	uint16_t sidx = (pid < nprograms) ? programs[pid].sidx : npstations;
+	return PROG_HEADER_SIZE + (ulong)pid*PROG_RECORD_SIZE + (ulong)sidx*sizeof(ProgramStation);
+}
+
+/** Write the record of program pid to the program file */
+void ProgramData::save_record(byte pid) {
+	ProgramEntry *p = programs+pid;
+	ulong pos = record_pos(pid);
+	file_write_block(PROG_FILENAME, p, pos, PROG_RECORD_SIZE);
+	if (p->nsta) {
+		file_write_block(PROG_FILENAME, pstations+p->sidx, pos+PROG_RECORD_SIZE, (ulong)p->nsta*sizeof(ProgramStation));
+	}
+}
+
+/** Sequential writer of the program file: collects the data and writes it in blocks */
+struct ProgramFileWriter {
+	StorageFile *f;
+	byte buf[128];
+	uint16_t n;
+
+	ProgramFileWriter(ulong pos) : n(0) { f = file_write_begin(PROG_FILENAME, pos); }
+
+	void write(const void *src, ulong len) {
+		const byte *p = (const byte*)src;
+		while (len) {
+			uint16_t k = (len < (ulong)(sizeof(buf)-n)) ? len : sizeof(buf)-n;
+			memcpy(buf+n, p, k);
+			n += k;
+			p += k;
+			len -= k;
+			if (n == sizeof(buf)) drain();
+		}
+	}
+
+	void drain() {
+		if (f && n) f->write(buf, n);
+		n = 0;
+		delay(0);
+	}
+
+	void close() {
+		drain();
+		file_write_end(f);
+		f = NULL;
+	}
+};
+
+/** Write the records of programs pid to end-1 to the program file in one sequential pass
+ * Records are variable length, so a record that changes length moves all the records after it
+ */
+void ProgramData::save_records(byte pid, byte end) {
+	if (end > nprograms) end = nprograms;
+	if (pid >= end) return;
+	ProgramFileWriter w(record_pos(pid));
+	for(;pid<end;pid++) {
+		ProgramEntry *p = programs+pid;
+		w.write(p, PROG_RECORD_SIZE);
+		w.write(pstations+p->sidx, (ulong)p->nsta*sizeof(ProgramStation));
+	}
+	w.close();
+}
+
+/** Store the non-zero water times of program pid in the station pool
+ * The stations of all programs are kept in program order, so the stations of
+ * the following programs move to make room.
+ * Returns 0 if the pool is out of space.
+ */
+byte ProgramData::store_stations(byte pid, const uint16_t *durations) {
+	ProgramEntry *p = programs+pid;
+	uint16_t n = 0;
+	byte sid;
+	for(sid=0;sid<MAX_NUM_STATIONS;sid++) {
+		if (durations[sid]) n++;
+	}
+	if (npstations - p->nsta + n > PROGRAM_POOL_SIZE) return 0;
+	ProgramStation *ps = pstations + p->sidx;
+	memmove(ps+n, ps+p->nsta, (npstations-p->sidx-p->nsta)*sizeof(ProgramStation));
+	npstations = npstations - p->nsta + n;
+	for(byte i=pid+1;i<nprograms;i++) {
+		programs[i].sidx = programs[i].sidx - p->nsta + n;
+	}
+	p->nsta = n;
+	for(sid=0;sid<MAX_NUM_STATIONS;sid++) {
+		if (!durations[sid]) continue;
+		ps->sid = sid;
+		ps->dur = durations[sid];
+		ps++;
+	}
+	return 1;
+}
+
+/** Reverse a range of the station pool */
+static void reverse_stations(ProgramStation *first, ProgramStation *last) {
+	while (first < --last) {
+		ProgramStation tmp = *first;
+		*first++ = *last;
+		*last = tmp;
+	}
 }
 
 /** Erase all program data */
 void ProgramData::eraseall() {
 	nprograms = 0;
-	save_count();
+	npstations = 0;
+	save_all();
 }
 
-/** Read a program from program file*/
+/** Read a program (from the RAM mirror) */
 void ProgramData::read(byte pid, ProgramStruct *buf) {
 	if (pid >= nprograms) return;
-	// first byte is program counter, so 1+
-	file_read_block(PROG_FILENAME, buf, 1+(ulong)pid*PROGRAMSTRUCT_SIZE, PROGRAMSTRUCT_SIZE);
+	ProgramEntry *p = programs+pid;
+	memcpy(buf, p, sizeof(ProgramSchedule));
+	memset(buf->durations, 0, sizeof(buf->durations));
+	ProgramStation *ps = pstations + p->sidx;
+	for(byte i=0;i<p->nsta;i++,ps++) {
+		if (ps->sid < MAX_NUM_STATIONS) buf->durations[ps->sid] = ps->dur;
+	}
+	memcpy(buf->name, p->name, PROGRAM_NAME_SIZE);
 }
 
 /** Add a program */
 byte ProgramData::add(ProgramStruct *buf) {
 	if (nprograms >= MAX_NUM_PROGRAMS)	return 0;
-	file_write_block(PROG_FILENAME, buf, 1+(ulong)nprograms*PROGRAMSTRUCT_SIZE, PROGRAMSTRUCT_SIZE);
+	ProgramEntry *p = programs+nprograms;
+	p->sidx = npstations;
+	p->nsta = 0;
+	if (!store_stations(nprograms, buf->durations))	return 0;
+	memcpy(p, buf, sizeof(ProgramSchedule));
+	memcpy(p->name, buf->name, PROGRAM_NAME_SIZE);
+	invalidate_schedule(nprograms);
 	nprograms ++;
+	save_record(nprograms-1);
 	save_count();
 	return 1;
 }
 
+/** Move program from to position to (to < from), the programs in between move down by one */
+void ProgramData::move(byte from, byte to) {
+	if (to >= from || from >= nprograms) return;
+	// the stations of programs to..from are contiguous in the pool: rotate those of from to the front
+	ProgramEntry *p = programs+from;
+	ProgramStation *first = pstations + programs[to].sidx;
+	ProgramStation *mid = pstations + p->sidx;
+	ProgramStation *last = mid + p->nsta;
+	reverse_stations(first, mid);
+	reverse_stations(mid, last);
+	reverse_stations(first, last);
+	ProgramEntry tmp = *p;
+	tmp.sidx = programs[to].sidx;
+	memmove(programs+to+1, programs+to, (ulong)(from-to)*sizeof(ProgramEntry));
+	programs[to] = tmp;
+	for(byte i=to+1;i<=from;i++) {
+		programs[i].sidx = programs[i-1].sidx + programs[i-1].nsta;
+	}
+	uint16_t drops = prog_drops[from];
+	memmove(prog_drops+to+1, prog_drops+to, (from-to)*sizeof(uint16_t));
+	prog_drops[to] = drops;
+	invalidate_schedule(to, from-to+1);
+}
+
 /** Move a program up (i.e. swap a program with the one above it) */
 void ProgramData::moveup(byte pid) {
 	if(pid >= nprograms || pid == 0) return;
-	// swap program pid-1 and pid
-	ulong pos = 1+(ulong)(pid-1)*PROGRAMSTRUCT_SIZE;
-	ulong next = pos+PROGRAMSTRUCT_SIZE;
-	char buf2[PROGRAMSTRUCT_SIZE];
-	file_read_block(PROG_FILENAME, tmp_buffer, pos, PROGRAMSTRUCT_SIZE);
-	file_read_block(PROG_FILENAME, buf2, next, PROGRAMSTRUCT_SIZE);
-	file_write_block(PROG_FILENAME, tmp_buffer, next, PROGRAMSTRUCT_SIZE);
-	file_write_block(PROG_FILENAME, buf2, pos, PROGRAMSTRUCT_SIZE);
+	move(pid, pid-1);
+	// the two records take up the same space as before
+	save_records(pid-1, pid+1);
+}
+
+/** Reorder all programs
+ * order lists the current program indices in their new order. The records
+ * that moved are rewritten in one pass. Returns 0 if order is not a
+ * permutation of the programs.
+ */
+byte ProgramData::reorder(const byte *order) {
+	byte cur[MAX_NUM_PROGRAMS];	// current program index at each position
+	memset(cur, 0, sizeof(cur));
+	for(byte i=0;i<nprograms;i++) {
+		if (order[i] >= nprograms || cur[order[i]]) return 0;
+		cur[order[i]] = 1;
+	}
+	for(byte i=0;i<nprograms;i++) cur[i] = i;
+	byte first = nprograms, last = 0;
+	for(byte i=0;i<nprograms;i++) {
+		byte j = i;
+		while (cur[j] != order[i]) j++;
+		if (j == i) continue;
+		move(j, i);
+		byte t = cur[j];
+		memmove(cur+i+1, cur+i, j-i);
+		cur[i] = t;
+		if (first == nprograms) first = i;
+		if (j > last) last = j;
+	}
+	// the moved programs take up the same space as before
+	save_records(first, last+1);
+	return 1;
 }
 
 /** Modify a program */
 byte ProgramData::modify(byte pid, ProgramStruct *buf) {
 	if (pid >= nprograms)  return 0;
-	ulong pos = 1+(ulong)pid*PROGRAMSTRUCT_SIZE;
-	file_write_block(PROG_FILENAME, buf, pos, PROGRAMSTRUCT_SIZE);
+	byte n = programs[pid].nsta;
+	if (!store_stations(pid, buf->durations))	return 0;
+	memcpy(programs+pid, buf, sizeof(ProgramSchedule));
+	memcpy(programs[pid].name, buf->name, PROGRAM_NAME_SIZE);
+	invalidate_schedule(pid);
+	if (programs[pid].nsta == n) save_record(pid);
+	else save_records(pid);
 	return 1;
 }
 
-/** Delete program(s) */
+/** Delete a program */
 byte ProgramData::del(byte pid) {
-	if (pid >= nprograms)  return 0;
-	if (nprograms == 0) return 0;
-	ulong pos = 1+(ulong)(pid+1)*PROGRAMSTRUCT_SIZE;
-	// erase by copying backward
-	for (; pos < 1+(ulong)nprograms*PROGRAMSTRUCT_SIZE; pos+=PROGRAMSTRUCT_SIZE) {
-		file_copy_block(PROG_FILENAME, pos, pos-PROGRAMSTRUCT_SIZE, PROGRAMSTRUCT_SIZE, tmp_buffer);
+	return del_list(&pid, 1);
+}
+
+/** Delete a list of programs
+ * The remaining programs are compacted in one pass and the records from the
+ * first deleted program on are rewritten in one pass.
+ */
+byte ProgramData::del_list(const byte *pids, byte n) {
+	byte deleted[MAX_NUM_PROGRAMS];
+	memset(deleted, 0, sizeof(deleted));
+	byte first = nprograms;
+	for(byte i=0;i<n;i++) {
+		if (pids[i] >= nprograms) return 0;
+		deleted[pids[i]] = 1;
+		if (pids[i] < first) first = pids[i];
+	}
+	if (first >= nprograms) return 0;
+	// erase by shifting the remaining programs backward
+	byte np = first;
+	uint16_t sidx = programs[first].sidx;
+	for(byte pid=first;pid<nprograms;pid++) {
+		if (deleted[pid]) continue;
+		ProgramEntry *p = programs+pid;
+		memmove(pstations+sidx, pstations+p->sidx, p->nsta*sizeof(ProgramStation));
+		if (np != pid) {
+			programs[np] = *p;
+			prog_drops[np] = prog_drops[pid];
+		}
+		programs[np].sidx = sidx;
+		sidx += programs[np].nsta;
+		np++;
 	}
-	nprograms --;
+	for(byte pid=np;pid<nprograms;pid++) prog_drops[pid] = 0;
+	invalidate_schedule(first, nprograms-first);
+	nprograms = np;
+	npstations = sidx;
+	save_records(first);
 	save_count();
 	return 1;
 }
@@ -149,15 +796,16 @@ byte ProgramData::del(byte pid) {
 // set the enable bit
 byte ProgramData::set_flagbit(byte pid, byte bid, byte value) {
 	if (pid >= nprograms)  return 0;
-	byte flag = file_read_byte(PROG_FILENAME, 1+(ulong)pid*PROGRAMSTRUCT_SIZE);
-	if(value) flag|=(1<<bid);
-	else flag&=(~(1<<bid));
-	file_write_byte(PROG_FILENAME, 1+(ulong)pid*PROGRAMSTRUCT_SIZE, flag);
+	byte *flag = (byte*)(programs+pid);	// flag bits are in the first byte
+	if(value) *flag|=(1<<bid);
+	else *flag&=(~(1<<bid));
+	invalidate_schedule(pid);
+	file_write_byte(PROG_FILENAME, record_pos(pid), *flag);
 	return 1;
 }
 
 /** Decode a sunrise/sunset start time to actual start time */
-int16_t ProgramStruct::starttime_decode(int16_t t) {
+int16_t ProgramSchedule::starttime_decode(int16_t t) {
 	if((t>>15)&1) return -1;
 	int16_t offset = t&0x7ff;
 	if((t>>STARTTIME_SIGN_BIT)&1) offset = -offset;
@@ -172,12 +820,13 @@ int16_t ProgramStruct::starttime_decode(int16_t t) {
 }
 
 /** Check if a given time matches the program's start day */
-byte ProgramStruct::check_day_match(time_t t) {
+byte ProgramSchedule::check_day_match(time_t t) {
 
 #if defined(ARDUINO) // get current time from Arduino
-	byte weekday_t = weekday(t);				// weekday ranges from [0,6] within Sunday being 1
-	byte day_t = day(t);
-	byte month_t = month(t);
+	const tmDate_t &date = breakDate(t);	// cached, so t and t-86400 are decomposed once per day
+	byte weekday_t = date.Wday;				// weekday ranges from [0,6] within Sunday being 1
+	byte day_t = date.Day;
+	byte month_t = date.Month;
 #else // get current time from RPI/BBB
 	time_t ct = t;
 	struct tm *ti = gmtime(&ct);
@@ -227,10 +876,46 @@ byte ProgramStruct::check_day_match(time_t t) {
 	return 1;
 }
 
+/** Check if a minute of the day matches the program's start times, assuming the program starts today */
+byte ProgramSchedule::check_start_match(int16_t current_minute, int16_t start, int16_t repeat, int16_t interval) {
+	if (starttime_type) {
+		// given start time type
+		for(byte i=0;i<MAX_NUM_STARTTIMES;i++) {
+			if (current_minute == starttime_decode(starttimes[i]))	return 1; // if curren_minute matches any of the given start time, return 1
+		}
+		return 0; // otherwise return 0
+	} else {
+		// repeating type
+		// if current_minute matches start time, return 1
+		if (current_minute == start) return 1;
+
+		// otherwise, current_minute must be larger than start time, and interval must be non-zero
+		if (current_minute > start && interval) {
+			// check if we are on any interval match
+			int16_t c = (current_minute - start) / interval;
+			if ((c * interval == (current_minute - start)) && c <= repeat) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/** Check if a minute of the day matches a repeating run that started the previous day and ran over night */
+byte ProgramSchedule::check_overnight_match(int16_t current_minute, int16_t start, int16_t repeat, int16_t interval) {
+	// program has to be repeating type, and interval and repeat must be non-zero
+	if (starttime_type || !interval)	return 0;
+	int16_t c = (current_minute - start + 1440) / interval;
+	if ((c * interval == (current_minute - start + 1440)) && c <= repeat) {
+		return 1;
+	}
+	return 0;
+}
+
 // Check if a given time matches program's start time
 // this also checks for programs that started the previous
 // day and ran over night
-byte ProgramStruct::check_match(time_t t) {
+byte ProgramSchedule::check_match(time_t t) {
 
 	// check program enable status
 	if (!enabled) return 0;
@@ -241,44 +926,59 @@ byte ProgramStruct::check_match(time_t t) {
 	int16_t current_minute = (t%86400L)/60;
 
 	// first assume program starts today
-	if (check_day_match(t)) {
-		// t matches the program's start day
-
-		if (starttime_type) {
-			// given start time type
-			for(byte i=0;i<MAX_NUM_STARTTIMES;i++) {
-				if (current_minute == starttime_decode(starttimes[i]))	return 1; // if curren_minute matches any of the given start time, return 1
-			}
-			return 0; // otherwise return 0
-		} else {
-			// repeating type
-			// if current_minute matches start time, return 1
-			if (current_minute == start) return 1;
-
-			// otherwise, current_minute must be larger than start time, and interval must be non-zero
-			if (current_minute > start && interval) {
-				// check if we are on any interval match
-				int16_t c = (current_minute - start) / interval;
-				if ((c * interval == (current_minute - start)) && c <= repeat) {
-					return 1;
-				}
-			}
-		}
+	if (check_day_match(t) && check_start_match(current_minute, start, repeat, interval)) {
+		return 1;
 	}
 	// to proceed, program has to be repeating type, and interval and repeat must be non-zero
 	if (starttime_type || !interval)	return 0;
 
 	// next, assume program started the previous day and ran over night
-	if (check_day_match(t-86400L)) {
-		// t-86400L matches the program's start day
-		int16_t c = (current_minute - start + 1440) / interval;
-		if ((c * interval == (current_minute - start + 1440)) && c <= repeat) {
-			return 1;
-		}
+	if (check_day_match(t-86400L) && check_overnight_match(current_minute, start, repeat, interval)) {
+		return 1;
 	}
 	return 0;
 }
 
+/** Check if the day of t matches the program's start day
+ * Returns MATCH_TODAY if the program starts on that day, and MATCH_OVERNIGHT if
+ * a repeating run started the previous day may spill over into that day
+ */
+byte ProgramSchedule::day_match_flags(time_t t) {
+	if (!enabled) return 0;
+	byte flags = check_day_match(t) ? MATCH_TODAY : 0;
+	if (!starttime_type && starttimes[2] && check_day_match(t-86400L)) flags |= MATCH_OVERNIGHT;
+	return flags;
+}
+
+/** Check if a minute of the day matches the program's start time, given the day match flags
+ * For every minute of a day, this returns the same result as check_match
+ */
+byte ProgramSchedule::check_minute_match(int16_t current_minute, byte flags) {
+	int16_t start = starttime_decode(starttimes[0]);
+	int16_t repeat = starttimes[1];
+	int16_t interval = starttimes[2];
+	if ((flags & MATCH_TODAY) && check_start_match(current_minute, start, repeat, interval)) return 1;
+	if ((flags & MATCH_OVERNIGHT) && check_overnight_match(current_minute, start, repeat, interval)) return 1;
+	return 0;
+}
+
+/** Compile the program's start minutes for the day of t into a minute-of-day bitmap
+ * Bit m is set iff check_match returns 1 for minute m of that day. The day match
+ * is evaluated once for the day and the previous day, and the minute match is
+ * evaluated with the same functions check_match uses, so the results are identical.
+ */
+void ProgramSchedule::compile_schedule(time_t t, byte *bits) {
+	memset(bits, 0, SCHEDULE_BITMAP_SIZE);
+	byte flags = day_match_flags(t - t%86400L);
+	if (!flags) return;
+
+	for(int16_t m=0;m<1440;m++) {
+		if (check_minute_match(m, flags)) {
+			bits[m>>3] |= (1<<(m&0x07));
+		}
+	}
+}
+
 // convert absolute remainder (reference time 1970 01-01) to relative remainder (reference time today)
 // absolute remainder is stored in flash, relative remainder is presented to web
 void ProgramData::drem_to_relative(byte days[2]) {
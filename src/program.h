@@ -28,10 +28,24 @@
 #define MAX_NUM_PROGRAMS		40		// maximum number of programs
 #define MAX_NUM_STARTTIMES	4
 #define PROGRAM_NAME_SIZE		32
-#define RUNTIME_QUEUE_SIZE	MAX_NUM_STATIONS
+#if !defined(RUNTIME_QUEUE_SIZE)
+#define RUNTIME_QUEUE_SIZE	MAX_NUM_STATIONS	// can be set at build time, see the queue counters in /db
+#endif
+#define RUNTIME_EVENTS_SIZE	(2*RUNTIME_QUEUE_SIZE+2)	// each scheduled queue element has a start and a stop event
 #define PROGRAMSTRUCT_SIZE	sizeof(ProgramStruct)
+#define PROGRAM_POOL_SIZE		(MAX_NUM_PROGRAMS*40)	// capacity of the shared pool of program station water times
+#define PROG_FILE_MAGIC			0xA5	// first byte of a program file with a header (older files start with the program count)
+#define PROG_FILE_VERSION		2
+#define PROG_RECORD_SIZE		(sizeof(ProgramSchedule)+PROGRAM_NAME_SIZE+1)	// program record: schedule, name, nsta, then nsta ProgramStation entries
+#define PROG_HEADER_SIZE		sizeof(ProgramFileHeader)
+#define SCHEDULE_BITMAP_SIZE	(1440/8)	// one bit per minute of the day
 #include "OpenSprinkler.h"
 
+// queue slots are indexed by a byte, and 0xFF marks a free slot
+#if RUNTIME_QUEUE_SIZE >= 255
+#error "RUNTIME_QUEUE_SIZE must be less than 255"
+#endif
+
 /** Log data structure */
 struct LogStruct {
 	byte station;
@@ -49,11 +63,22 @@ struct LogStruct {
 #define STARTTIME_SUNSET_BIT	13
 #define STARTTIME_SIGN_BIT		12
 
+#define MATCH_TODAY		0x01	// day match flags, see ProgramSchedule::day_match_flags
+#define MATCH_OVERNIGHT	0x02
+
 #define PROGRAMSTRUCT_EN_BIT	 0
 #define PROGRAMSTRUCT_UWT_BIT  1
 
-/** Program data structure */
-class ProgramStruct {
+/** Program file header */
+struct ProgramFileHeader {
+	byte magic;			// PROG_FILE_MAGIC
+	byte version;		// PROG_FILE_VERSION
+	byte nprograms;	// number of programs
+	byte nstations;	// maximum number of stations (version 1: number of water times in each record)
+};
+
+/** Program schedule: the program data except the station water times and the name */
+class ProgramSchedule {
 public:
 	byte enabled	:1;  // HIGH means the program is enabled
 	
@@ -98,17 +123,43 @@ public:
 	//	 else: standard start time (value between 0 to 1440, by bits 0 to 10)
 	int16_t starttimes[MAX_NUM_STARTTIMES];
 
-	uint16_t durations[MAX_NUM_STATIONS];  // duration / water time of each station
-	
-	char name[PROGRAM_NAME_SIZE];
-
 	byte check_match(time_t t);
 	int16_t starttime_decode(int16_t t);
+	void compile_schedule(time_t t, byte *bits);
+	byte day_match_flags(time_t t);
+	byte check_minute_match(int16_t current_minute, byte flags);
 	
 protected:
 
 	byte check_day_match(time_t t);
+	byte check_start_match(int16_t current_minute, int16_t start, int16_t repeat, int16_t interval);
+	byte check_overnight_match(int16_t current_minute, int16_t start, int16_t repeat, int16_t interval);
+
+};
 
+/** Program data structure, as stored in the program file */
+class ProgramStruct : public ProgramSchedule {
+public:
+	uint16_t durations[MAX_NUM_STATIONS];  // duration / water time of each station
+	
+	char name[PROGRAM_NAME_SIZE];
+};
+
+/** Water time of a station in a program */
+struct ProgramStation {
+	byte sid;
+	uint16_t dur;
+} __attribute__((packed));
+
+/** RAM form of a program: only the stations with a non-zero water time are kept,
+ * in ProgramData::pstations, sorted by station index.
+ * The first PROG_RECORD_SIZE bytes are stored as is in the program file.
+ */
+class ProgramEntry : public ProgramSchedule {
+public:
+	char name[PROGRAM_NAME_SIZE];
+	byte nsta;			// number of stations with a non-zero water time
+	uint16_t sidx;	// index of the program's first station in ProgramData::pstations
 };
 
 extern OpenSprinkler os;
@@ -121,18 +172,76 @@ public:
 	byte	pid;
 };
 
+/** Runtime queue event: queue element qid is due to start or stop at time t */
+struct RuntimeEventStruct {
+	ulong t;
+	byte	qid;
+};
+
+/** Master valve interval: the master is on from time on until (not including) time off */
+struct MasterIntervalStruct {
+	ulong on;
+	ulong off;
+};
+
+/** Flow budget: a change of the total expected flow of the scheduled runs */
+struct FlowStep {
+	ulong t;
+	int16_t flow;
+} __attribute__((packed));
+
+#define FLOW_STEPS_SIZE	(2*RUNTIME_QUEUE_SIZE)
+
+#define FORECAST_MAX_RUNS	200
+#define FORECAST_MAX_DAYS	14
+
+/** Projected run of the schedule forecast */
+struct ForecastRun {
+	RuntimeQueueStruct q;
+	ulong qt;	// the time the run is added to the runtime queue
+};
+
 class ProgramData {
 public:  
-	static RuntimeQueueStruct queue[];
+	static ProgramEntry programs[];	// RAM mirror of the program file
+	static ProgramStruct scratch;	// one program with a water time per station, for the web API and file conversion (too large for the stack)
+	static ProgramStation pstations[];	// station water times of all programs, in program order
+	static uint16_t npstations;	// number of used entries in pstations
+	static RuntimeQueueStruct queue[];	// queue elements (slots do not move while an element is queued)
+	static byte qorder[];				// indices of the queue elements, in the order they are queued, followed by the free slots
+	static byte qpos[];					// position of each queue slot in qorder, 0xFF if the slot is free
 	static byte nqueue;					// number of queue elements
 	static byte station_qid[];	// this array stores the queue element index for each scheduled station
+	static byte station_prog[];	// station bitset: stations whose assigned queue element is a program run (pid<99)
 	static byte nprograms;			// number of programs
+	static uint16_t revision;		// incremented on every program change
 	static LogStruct lastrun;
-	static ulong last_seq_stop_time;	// the last stop time of a sequential station
+	static ulong last_seq_stop_times[];	// the last stop time of a sequential station, for each sequential group
 	
 	static void reset_runtime();
-	static RuntimeQueueStruct* enqueue(); // this returns a pointer to the next available slot in the queue
+	static RuntimeQueueStruct* enqueue(byte pid); // this returns a pointer to the next available slot in the queue
+	static byte queue_peak;			// highest number of queue elements since boot
+	static uint16_t queue_rejects;	// number of elements rejected because the queue was full
+	static uint16_t prog_drops[];	// number of station runs of each program rejected because the queue was full
 	static void dequeue(byte qid);	// this removes an element from the queue
+	static void add_events(byte qid);	// add start and stop events of a (re)scheduled element
+	static byte next_event(ulong curr_time);	// returns the qid of the next due event, or 0xFF
+	static void push_event(ulong t, byte qid);
+
+	static MasterIntervalStruct mas_intervals[2][RUNTIME_QUEUE_SIZE];	// merged on intervals of master 1 and 2, sorted by time
+	static byte nmas_intervals[2];
+	static byte mas_first[2];		// index of the first interval that has not ended yet
+	static void update_master_intervals();
+	static byte check_master(byte mi, ulong curr_time);	// returns 1 if master mi (0 or 1) should be on
+
+	static uint16_t flow_limit();	// flow limit in 0.1 flow units, 0 if flow budgeting is off
+	static uint16_t flow_expected(byte sid, uint16_t limit);	// expected flow of a station, capped at the limit
+	static void flow_prepare(ulong curr_time);	// start a flow profile with the queued runs that end after curr_time
+	static void flow_add(RuntimeQueueStruct *q, uint16_t limit);	// add a scheduled run to the flow profile
+	static ulong flow_place(ulong t, ulong dur, uint16_t f, uint16_t limit);	// earliest start within the flow limit
+
+	static void update_schedule(time_t t);	// (re)compile program schedules for the day of t
+	static byte check_match(byte pid, time_t t);	// same as ProgramSchedule::check_match, using compiled schedules
 
 	static void init();
 	static void eraseall();
@@ -141,12 +250,43 @@ public:
 	static byte modify(byte pid, ProgramStruct *buf);
 	static byte set_flagbit(byte pid, byte bid, byte value);
 	static void moveup(byte pid);  
+	static byte reorder(const byte *order);	// order: the program indices in their new order
 	static byte del(byte pid);
+	static byte del_list(const byte *pids, byte n);
 	static void drem_to_relative(byte days[2]); // absolute to relative reminder conversion
 	static void drem_to_absolute(byte days[2]);
 private:	
-	static void load_count();
 	static void save_count();
+	static void load_all();
+	static void save_all();
+	static ulong record_pos(byte pid);
+	static void save_record(byte pid);
+	static void save_records(byte pid, byte end=MAX_NUM_PROGRAMS);
+	static byte store_stations(byte pid, const uint16_t *durations);
+	static void move(byte from, byte to);
+	static void invalidate_schedule(byte pid, byte n=1);
+	static void rebuild_events();
+	static void update_station_qid(byte sid);
+	static void assign_station(byte sid, byte qid);
+	static void update_seq_stop_time();
+	static void compute_master_intervals(byte mi, byte mas, const byte *attrib, int16_t on_adj, int16_t off_adj);
+
+	static byte mas_dirty;	// the runtime queue has changed since the master intervals were computed
+	static byte mas_settings[];	// master settings the intervals were computed with
+
+	static RuntimeEventStruct events[];	// min-heap of start and stop events, ordered by time
+	static uint16_t nevents;
+
+	static FlowStep flow_steps[];	// flow profile of the scheduled runs, sorted by time
+	static uint16_t flow_nsteps;
+
+	// compiled schedules: for each program, the minutes of the compiled day at which it starts,
+	// including runs that started the previous day and spill over into the compiled day
+	static byte sched_bits[MAX_NUM_PROGRAMS][SCHEDULE_BITMAP_SIZE];
+	static byte sched_dirty[];	// per-program flag bits: the compiled schedule is out of date
+	static ulong sched_day;	// the day (days since epoch) the schedules are compiled for
+	static uint16_t sched_sunrise;	// sunrise/sunset times the schedules are compiled with
+	static uint16_t sched_sunset;
 };
 
 #endif	// _PROGRAM_H
@@ -0,0 +1,342 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Storage backend
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "storage.h"
+
+#if defined(ESP8266)
+	#include <Arduino.h>
+#else
+	#include <string.h>
+	#include <time.h>
+	#include <dirent.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+StorageStat storage_stats[NUM_STORAGE_OPS];
+
+static ulong storage_micros() {
+#if defined(ESP8266)
+	return micros();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ulong)ts.tv_sec*1000000UL + ts.tv_nsec/1000;
+#endif
+}
+
+/** Count a call of op that started at start and moved the given bytes */
+static void storage_count(byte op, ulong bytes, ulong start) {
+	StorageStat &s = storage_stats[op];
+	s.calls++;
+	s.bytes += bytes;
+	s.micros += storage_micros()-start;
+}
+
+#if defined(ESP8266)
+
+// ====== SPIFFS ======
+
+StorageFile::StorageFile() {}
+
+StorageFile::operator bool() const {
+	return (bool)f;
+}
+
+int StorageFile::read(void *buf, ulong len) {
+	ulong start = storage_micros();
+	int n = f.read((uint8_t*)buf, len);
+	storage_count(STORAGE_OP_READ, n, start);
+	return n;
+}
+
+int StorageFile::read() {
+	ulong start = storage_micros();
+	int c = f.read();
+	storage_count(STORAGE_OP_READ, (c<0)?0:1, start);
+	return c;
+}
+
+ulong StorageFile::write(const void *buf, ulong len) {
+	ulong start = storage_micros();
+	ulong n = f.write((const uint8_t*)buf, len);
+	storage_count(STORAGE_OP_WRITE, n, start);
+	return n;
+}
+
+bool StorageFile::seek(ulong pos, byte mode) {
+	ulong start = storage_micros();
+	bool ok = f.seek(pos, (mode==STORAGE_SEEK_END)?SeekEnd:((mode==STORAGE_SEEK_CUR)?SeekCur:SeekSet));
+	storage_count(STORAGE_OP_SEEK, 0, start);
+	return ok;
+}
+
+ulong StorageFile::position() {
+	return f.position();
+}
+
+ulong StorageFile::size() {
+	return f.size();
+}
+
+void StorageFile::flush() {
+	ulong start = storage_micros();
+	f.flush();
+	storage_count(STORAGE_OP_WRITE, 0, start);
+}
+
+void StorageFile::close() {
+	f.close();
+}
+
+bool storage_begin() {
+	return SPIFFS.begin();
+}
+
+void storage_format() {
+	SPIFFS.format();
+}
+
+void storage_info(ulong *total, ulong *used) {
+	FSInfo fs_info;
+	SPIFFS.info(fs_info);
+	*total = fs_info.totalBytes;
+	*used = fs_info.usedBytes;
+}
+
+StorageFile storage_open(const char *name, const char *mode) {
+	ulong start = storage_micros();
+	StorageFile file;
+	file.f = SPIFFS.open(name, mode);
+	storage_count(STORAGE_OP_OPEN, 0, start);
+	return file;
+}
+
+bool storage_exists(const char *name) {
+	ulong start = storage_micros();
+	bool ok = SPIFFS.exists(name);
+	storage_count(STORAGE_OP_STAT, 0, start);
+	return ok;
+}
+
+bool storage_remove(const char *name) {
+	ulong start = storage_micros();
+	bool ok = SPIFFS.remove(name);
+	storage_count(STORAGE_OP_REMOVE, 0, start);
+	return ok;
+}
+
+bool storage_stat(const char *name, ulong *size) {
+	ulong start = storage_micros();
+	File f = SPIFFS.open(name, "r");
+	bool ok = f;	// close() clears the handle, so check it first
+	if(ok) {
+		*size = f.size();
+		f.close();
+	}
+	storage_count(STORAGE_OP_STAT, 0, start);
+	return ok;
+}
+
+void storage_list(const char *prefix, void (*cb)(const char *name, ulong size)) {
+	ulong start = storage_micros();
+	Dir dir = SPIFFS.openDir(prefix);
+	while(dir.next()) {
+		String name = dir.fileName();
+		ulong t = storage_micros();
+		cb(name.c_str(), dir.fileSize());
+		start += storage_micros()-t;	// do not count the time spent in cb
+	}
+	storage_count(STORAGE_OP_LIST, 0, start);
+}
+
+#else
+
+// ====== Linux files ======
+
+/** Host path of a file name */
+static const char* storage_path(const char *name) {
+	static char path[128];
+	snprintf(path, sizeof(path), "%s/%s", STORAGE_ROOT, (*name=='/')?name+1:name);
+	return path;
+}
+
+StorageFile::StorageFile() : f(NULL) {}
+
+StorageFile::operator bool() const {
+	return f!=NULL;
+}
+
+int StorageFile::read(void *buf, ulong len) {
+	ulong start = storage_micros();
+	int n = fread(buf, 1, len, f);
+	storage_count(STORAGE_OP_READ, n, start);
+	return n;
+}
+
+int StorageFile::read() {
+	ulong start = storage_micros();
+	int c = fgetc(f);
+	storage_count(STORAGE_OP_READ, (c<0)?0:1, start);
+	return (c==EOF)?-1:c;
+}
+
+ulong StorageFile::write(const void *buf, ulong len) {
+	ulong start = storage_micros();
+	ulong n = fwrite(buf, 1, len, f);
+	storage_count(STORAGE_OP_WRITE, n, start);
+	return n;
+}
+
+bool StorageFile::seek(ulong pos, byte mode) {
+	ulong start = storage_micros();
+	bool ok = fseek(f, pos, (mode==STORAGE_SEEK_END)?SEEK_END:((mode==STORAGE_SEEK_CUR)?SEEK_CUR:SEEK_SET))==0;
+	storage_count(STORAGE_OP_SEEK, 0, start);
+	return ok;
+}
+
+ulong StorageFile::position() {
+	return ftell(f);
+}
+
+ulong StorageFile::size() {
+	struct stat st;
+	fflush(f);
+	return (fstat(fileno(f), &st)==0) ? st.st_size : 0;
+}
+
+void StorageFile::flush() {
+	ulong start = storage_micros();
+	fflush(f);
+	storage_count(STORAGE_OP_WRITE, 0, start);
+}
+
+void StorageFile::close() {
+	if(f) fclose(f);
+	f = NULL;
+}
+
+bool storage_begin() {
+	mkdir(STORAGE_ROOT, 0755);
+	struct stat st;
+	return stat(STORAGE_ROOT, &st)==0;
+}
+
+void storage_format() {
+	char dir[128];
+	strcpy(dir, storage_path(""));
+	// remove the files and the sub directories (such as logs) one level deep
+	DIR *d = opendir(dir);
+	if(!d) return;
+	struct dirent *e;
+	while((e=readdir(d))!=NULL) {
+		if(e->d_name[0]=='.') continue;
+		char path[256];
+		snprintf(path, sizeof(path), "%s%s", dir, e->d_name);
+		if(remove(path)!=0) {
+			DIR *sd = opendir(path);
+			struct dirent *se;
+			while(sd && (se=readdir(sd))!=NULL) {
+				if(se->d_name[0]=='.') continue;
+				char spath[384];
+				snprintf(spath, sizeof(spath), "%s/%s", path, se->d_name);
+				remove(spath);
+			}
+			if(sd) closedir(sd);
+			rmdir(path);
+		}
+	}
+	closedir(d);
+}
+
+void storage_info(ulong *total, ulong *used) {
+	*total = 0;
+	*used = 0;
+}
+
+StorageFile storage_open(const char *name, const char *mode) {
+	ulong start = storage_micros();
+	StorageFile file;
+	const char *path = storage_path(name);
+	if(mode[0]=='w') {
+		// create the folder of the file if needed
+		char dir[128];
+		strcpy(dir, path);
+		char *slash = strrchr(dir, '/');
+		if(slash) {
+			*slash = 0;
+			mkdir(dir, 0755);
+		}
+		file.f = fopen(path, "wb+");
+	} else {
+		file.f = fopen(path, (mode[1]=='+')?"rb+":"rb");
+	}
+	storage_count(STORAGE_OP_OPEN, 0, start);
+	return file;
+}
+
+bool storage_exists(const char *name) {
+	ulong size;
+	return storage_stat(name, &size);
+}
+
+bool storage_remove(const char *name) {
+	ulong start = storage_micros();
+	bool ok = remove(storage_path(name))==0;
+	storage_count(STORAGE_OP_REMOVE, 0, start);
+	return ok;
+}
+
+bool storage_stat(const char *name, ulong *size) {
+	ulong start = storage_micros();
+	struct stat st;
+	bool ok = stat(storage_path(name), &st)==0;
+	if(ok) *size = st.st_size;
+	storage_count(STORAGE_OP_STAT, 0, start);
+	return ok;
+}
+
+void storage_list(const char *prefix, void (*cb)(const char *name, ulong size)) {
+	ulong start = storage_micros();
+	// split the prefix into its folder and the start of the file names
+	char dir[128];
+	strcpy(dir, prefix);
+	char *slash = strrchr(dir, '/');
+	const char *base = slash ? prefix+(slash-dir)+1 : prefix;
+	if(slash) slash[1] = 0; else dir[0] = 0;
+	DIR *d = opendir(storage_path(dir));
+	struct dirent *e;
+	while(d && (e=readdir(d))!=NULL) {
+		if(e->d_name[0]=='.' || strncmp(e->d_name, base, strlen(base))) continue;
+		char name[256];
+		snprintf(name, sizeof(name), "%s%s", dir, e->d_name);
+		struct stat st;
+		if(stat(storage_path(name), &st)!=0 || !S_ISREG(st.st_mode)) continue;
+		ulong t = storage_micros();
+		cb(name, st.st_size);
+		start += storage_micros()-t;	// do not count the time spent in cb
+	}
+	if(d) closedir(d);
+	storage_count(STORAGE_OP_LIST, 0, start);
+}
+
+#endif
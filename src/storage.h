@@ -0,0 +1,103 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Storage backend header file
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _STORAGE_H
+#define _STORAGE_H
+
+#include "defines.h"
+
+#if defined(ESP8266)
+	#include <FS.h>
+#else
+	#include <stdio.h>
+	#if !defined(STORAGE_ROOT)
+	#define STORAGE_ROOT "./data"	// directory holding the files on Linux, may be a tmpfs mount for a RAM store
+	#endif
+#endif
+
+/** Storage backend
+ * All file access goes through this small interface: SPIFFS on ESP8266, and
+ * files under STORAGE_ROOT on Linux builds, so the data and log paths can run
+ * and be timed off-target. Every call is counted in storage_stats with the
+ * bytes it moved and the time it took.
+ */
+
+enum {
+	STORAGE_SEEK_SET = 0,
+	STORAGE_SEEK_CUR,
+	STORAGE_SEEK_END
+};
+
+/** Storage operations, for the counters */
+enum {
+	STORAGE_OP_OPEN = 0,
+	STORAGE_OP_READ,
+	STORAGE_OP_WRITE,
+	STORAGE_OP_SEEK,
+	STORAGE_OP_LIST,
+	STORAGE_OP_REMOVE,
+	STORAGE_OP_STAT,
+	NUM_STORAGE_OPS
+};
+
+struct StorageStat {
+	ulong calls;
+	ulong bytes;	// bytes read or written
+	ulong micros;	// total time spent
+};
+extern StorageStat storage_stats[NUM_STORAGE_OPS];
+
+/** An open file */
+class StorageFile {
+public:
+	StorageFile();
+	operator bool() const;
+	int read(void *buf, ulong len);	// returns the number of bytes read
+	int read();	// read one byte, -1 at the end of the file
+	ulong write(const void *buf, ulong len);
+	bool seek(ulong pos, byte mode=STORAGE_SEEK_SET);
+	ulong position();
+	ulong size();
+	void flush();
+	void close();
+private:
+	friend StorageFile storage_open(const char *name, const char *mode);
+#if defined(ESP8266)
+	File f;
+#else
+	FILE *f;
+#endif
+};
+
+bool storage_begin();
+void storage_format();
+void storage_info(ulong *total, ulong *used);
+
+/** Open a file, mode is "r", "r+" or "w" as in fopen */
+StorageFile storage_open(const char *name, const char *mode);
+bool storage_exists(const char *name);
+bool storage_remove(const char *name);
+bool storage_stat(const char *name, ulong *size);	// false if the file does not exist
+/** Call cb with the name and size of every file whose name starts with prefix */
+void storage_list(const char *prefix, void (*cb)(const char *name, ulong size));
+
+#endif // _STORAGE_H
@@ -25,99 +25,224 @@
 #include "OpenSprinkler.h"
 extern OpenSprinkler os;
 
-#include <FS.h>
+#include "storage.h"
 
 
+/** Open file cache
+ * The fixed data files are read and written in small blocks all the time, so
+ * their handles are kept open in a small LRU cache instead of opening, seeking
+ * and closing the file for every block. Writes are flushed right away, so the
+ * flash content is always up to date. Call file_flush_all before formatting
+ * or rebooting.
+ */
+#define FILE_CACHE_SIZE 3	// SPIFFS allows 5 open files, leave 2 for logs and web requests
+
+struct FileCacheEntry {
+	const char *fn;	// NULL if unused
+	StorageFile f;
+	ulong used;	// last use, for LRU eviction
+};
+
+static FileCacheEntry file_cache[FILE_CACHE_SIZE];
+static StorageFile file_tmp;	// handle of a file not in the cache
+static ulong file_cache_clock = 0;
+
+static const char* const cached_files[] = {
+	CONFIG_FILENAME, SOPTS_FILENAME, STATIONS_FILENAME, PROG_FILENAME
+};
+
+/** Return the cached name of fn if fn is one of the fixed data files */
+static const char* file_cacheable(const char *fn) {
+	for(byte i=0;i<sizeof(cached_files)/sizeof(cached_files[0]);i++) {
+		if(strcmp(fn, cached_files[i])==0) return cached_files[i];
+	}
+	return NULL;
+}
+
+/** Close the cached handle of fn, if any */
+static void file_close(const char *fn) {
+	for(byte i=0;i<FILE_CACHE_SIZE;i++) {
+		FileCacheEntry &e = file_cache[i];
+		if(e.fn && strcmp(e.fn, fn)==0) {
+			e.f.close();
+			e.fn = NULL;
+		}
+	}
+}
+
+/** Flush and close all cached handles */
+void file_flush_all() {
+	for(byte i=0;i<FILE_CACHE_SIZE;i++) {
+		FileCacheEntry &e = file_cache[i];
+		if(e.fn) {
+			e.f.close();
+			e.fn = NULL;
+		}
+	}
+}
+
+/** Get a read/write handle of fn, from the cache if possible.
+ * If create is set, a missing file is created.
+ * Hand the handle back with file_release when done.
+ */
+static StorageFile* file_get(const char *fn, bool create) {
+	const char *cfn = file_cacheable(fn);
+	if(!cfn) {
+		file_tmp = storage_open(fn, "r+");
+		if(!file_tmp && create) file_tmp = storage_open(fn, "w");
+		return file_tmp ? &file_tmp : NULL;
+	}
+	file_cache_clock++;
+	FileCacheEntry *lru = file_cache;
+	for(byte i=0;i<FILE_CACHE_SIZE;i++) {
+		FileCacheEntry &e = file_cache[i];
+		if(e.fn==cfn) {
+			e.used = file_cache_clock;
+			return &e.f;
+		}
+		if(!e.fn) {
+			if(lru->fn) lru = &e;
+		} else if(lru->fn && e.used<lru->used) lru = &e;
+	}
+	StorageFile f = storage_open(fn, "r+");
+	if(!f) {
+		if(!create) return NULL;
+		// create the file, then reopen it for reading and writing
+		f = storage_open(fn, "w");
+		if(!f) return NULL;
+		f.close();
+		f = storage_open(fn, "r+");
+		if(!f) return NULL;
+	}
+	if(lru->fn) lru->f.close();
+	lru->fn = cfn;
+	lru->f = f;
+	lru->used = file_cache_clock;
+	return &lru->f;
+}
+
+/** Close the handle unless it is cached */
+static void file_release(StorageFile *f) {
+	if(f==&file_tmp) file_tmp.close();
+}
+
+/** Move to pos unless the handle is already there */
+static void file_seek(StorageFile *f, ulong pos) {
+	if(f->position()==pos) return;
+	f->seek(pos);
+}
+
 void write_to_file(const char *fn, const char *data, ulong size, ulong pos, bool trunc) {
-	File f;
+	StorageFile f;
+	file_close(fn);
 	if(trunc) {
-		f = SPIFFS.open(fn, "w");
+		f = storage_open(fn, "w");
 	} else {
-		f = SPIFFS.open(fn, "r+");
-		if(!f) f = SPIFFS.open(fn, "w");
+		f = storage_open(fn, "r+");
+		if(!f) f = storage_open(fn, "w");
 	}		 
 	if(!f) return;
-	if(pos) f.seek(pos, SeekSet);
+	if(pos) f.seek(pos);
 	if(size==0) {
-		f.write((byte*)" ", 1);  // hack to circumvent SPIFFS bug involving writing empty file
+		f.write(" ", 1);  // hack to circumvent SPIFFS bug involving writing empty file
 	} else {
-		f.write((byte*)data, size);
+		f.write(data, size);
 	}
 	f.close();
 }
 
 void read_from_file(const char *fn, char *data, ulong maxsize, ulong pos) {
-	File f = SPIFFS.open(fn, "r");
+	StorageFile *f = file_get(fn, false);
 	if(!f) {
 		data[0]=0;
 		return;  // return with empty string
 	}
-	if(pos)  f.seek(pos, SeekSet);
-	int len = f.read((byte*)data, maxsize);
+	file_seek(f, pos);
+	int len = f->read(data, maxsize);
 	if(len>0) data[len]=0;
 	if(len==1 && data[0]==' ') data[0] = 0;  // hack to circumvent SPIFFS bug involving writing empty file
 	data[maxsize-1]=0;
-	f.close();
+	file_release(f);
 	return;
 }
 
 void remove_file(const char *fn) {
-	if(!SPIFFS.exists(fn)) return;
-	SPIFFS.remove(fn);
+	file_close(fn);
+	if(!storage_exists(fn)) return;
+	storage_remove(fn);
 }
 
 bool file_exists(const char *fn) {
-	return SPIFFS.exists(fn);
+	return storage_exists(fn);
+}
+
+ulong file_size(const char *fn) {
+	StorageFile *f = file_get(fn, false);
+	if(!f) return 0;
+	ulong size = f->size();
+	file_release(f);
+	return size;
 }
 
 // file functions
 void file_read_block(const char *fn, void *dst, ulong pos, ulong len) {
 	// do not use File.readBytes or readBytesUntil because it's very slow  
-	File f = SPIFFS.open(fn, "r");
+	StorageFile *f = file_get(fn, false);
 	if(f) {
-		f.seek(pos, SeekSet);
-		f.read((byte*)dst, len);
-		f.close();
+		file_seek(f, pos);
+		f->read(dst, len);
+		file_release(f);
 	}
 }
 
 void file_write_block(const char *fn, const void *src, ulong pos, ulong len) {
-	File f = SPIFFS.open(fn, "r+");
-	if(!f) f = SPIFFS.open(fn, "w");
+	StorageFile *f = file_get(fn, true);
 	if(f) {
-		f.seek(pos, SeekSet);
-		f.write((byte*)src, len);
-		f.close();
+		file_seek(f, pos);
+		f->write(src, len);
+		f->flush();
+		file_release(f);
 	}
 }
 
+StorageFile* file_write_begin(const char *fn, ulong pos) {
+	StorageFile *f = file_get(fn, true);
+	if(f) file_seek(f, pos);
+	return f;
+}
+
+void file_write_end(StorageFile *f) {
+	if(!f) return;
+	f->flush();
+	file_release(f);
+}
+
 void file_copy_block(const char *fn, ulong from, ulong to, ulong len, void *tmp) {
 	// assume tmp buffer is provided and is larger than len
 	// todo future: if tmp buffer is not provided, do byte-to-byte copy
 	if(tmp==NULL) { return; }
 
-	File f = SPIFFS.open(fn, "r+");
+	StorageFile *f = file_get(fn, false);
 	if(!f) return;
-	f.seek(from, SeekSet);
-	f.read((byte*)tmp, len);
-	f.seek(to, SeekSet);
-	f.write((byte*)tmp, len);
-	f.close();
+	file_seek(f, from);
+	f->read(tmp, len);
+	file_seek(f, to);
+	f->write(tmp, len);
+	f->flush();
+	file_release(f);
 }
 
 // compare a block of content
 byte file_cmp_block(const char *fn, const char *buf, ulong pos) {
-	char c;
-
-	File f = SPIFFS.open(fn, "r");
+	StorageFile *f = file_get(fn, false);
 	if(f) {
-		f.seek(pos, SeekSet);
-		char c = f.read();
+		file_seek(f, pos);
+		char c = f->read();
 		while(*buf && (c==*buf)) {
 			buf++;
-			c=f.read();
+			c=f->read();
 		}
-		f.close();
+		file_release(f);
 		return (*buf==c)?0:1;
 	}
 	return 1;
@@ -133,6 +258,18 @@ void file_write_byte(const char *fn, ulong pos, byte v) {
 	file_write_block(fn, &v, pos, 1);
 }
 
+/** CRC-16/CCITT of a block of data */
+uint16_t crc16(const void *data, uint16_t len, uint16_t crc) {
+	const byte *p = (const byte*)data;
+	while(len--) {
+		crc ^= (uint16_t)(*p++)<<8;
+		for(byte i=0;i<8;i++) {
+			crc = (crc&0x8000) ? (crc<<1)^0x1021 : (crc<<1);
+		}
+	}
+	return crc;
+}
+
 // copy n-character string from program memory with ending 0
 void strncpy_P0(char* dest, const char* src, int n) {
 	byte i;
@@ -34,6 +34,7 @@ void write_to_file(const char *fname, const char *data, ulong size, ulong pos=0,
 void read_from_file(const char *fname, char *data, ulong maxsize=TMP_BUFFER_SIZE, int pos=0);
 void remove_file(const char *fname);
 bool file_exists(const char *fname);
+ulong file_size(const char *fname);
 
 void file_read_block (const char *fname, void *dst, ulong pos, ulong len);
 void file_write_block(const char *fname, const void *src, ulong pos, ulong len);
@@ -41,6 +42,54 @@ void file_copy_block (const char *fname, ulong from, ulong to, ulong len, void *
 byte file_read_byte (const char *fname, ulong pos);
 void file_write_byte(const char *fname, ulong pos, byte v);  
 byte file_cmp_block(const char *fname, const char *buf, ulong pos);
+void file_flush_all();
+class StorageFile;
+/** Sequential writes: get the handle of fname at pos, write through it, and
+ * hand it back with file_write_end, which flushes once */
+StorageFile* file_write_begin(const char *fname, ulong pos);
+void file_write_end(StorageFile *f);
+uint16_t crc16(const void *data, uint16_t len, uint16_t crc=0xFFFF);
+
+/** Strings packed back to back in a fixed RAM buffer, looked up by index.
+ * A string that does not fit is left out: get returns NULL for it.
+ */
+template <uint16_t SIZE, uint16_t N>
+class StringPool {
+public:
+	StringPool() { clear(); }
+	void clear() {
+		len = 0;
+		memset(pos, 0xFF, sizeof(pos));
+	}
+	const char* get(uint16_t i) const {
+		return (pos[i]==NONE) ? NULL : buf+pos[i];
+	}
+	bool set(uint16_t i, const char *s) {
+		// remove the old string
+		if(pos[i]!=NONE) {
+			uint16_t p = pos[i];
+			uint16_t l = strlen(buf+p)+1;
+			memmove(buf+p, buf+p+l, len-p-l);
+			len -= l;
+			for(uint16_t k=0;k<N;k++) {
+				if(pos[k]!=NONE && pos[k]>p) pos[k] -= l;
+			}
+			pos[i] = NONE;
+		}
+		// append the new one
+		uint16_t l = strlen(s)+1;
+		if(len+l > SIZE) return false;
+		memcpy(buf+len, s, l);
+		pos[i] = len;
+		len += l;
+		return true;
+	}
+private:
+	static const uint16_t NONE = 0xFFFF;
+	char buf[SIZE];
+	uint16_t pos[N];	// position of each string in buf, or NONE
+	uint16_t len;
+};
 
 // misc. string and time converstion functions
 void strncpy_P0(char* dest, const char* src, int n);
@@ -0,0 +1,148 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Arduino API shim for the host test build
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HOST_ARDUINO_H
+#define _HOST_ARDUINO_H
+
+/** Host shim
+ * Just enough of the Arduino core for the firmware modules under test to
+ * compile and link on Linux. Neither ARDUINO nor ESP8266 is defined, so the
+ * modules take their Linux paths (POSIX storage, gmtime). PROGMEM data is
+ * plain RAM, and millis/micros follow the monotonic clock (host.cpp).
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <string>
+
+typedef unsigned char byte;
+typedef bool boolean;
+
+#define PROGMEM
+#define PGM_P const char*
+#define PSTR(s) (s)
+#define F(s) (s)
+#define FPSTR(s) (s)
+#define pgm_read_byte(p) (*(const unsigned char*)(p))
+#define pgm_read_word(p) (*(const uint16_t*)(p))
+#define strcpy_P strcpy
+#define strncpy_P strncpy
+#define strcat_P strcat
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define strlen_P strlen
+#define memcpy_P memcpy
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define A0 17
+#define SDA 4
+#define SCL 5
+#define HEX 16
+
+inline char* itoa(int v, char *s, int) { sprintf(s, "%d", v); return s; }
+inline char* ltoa(long v, char *s, int) { sprintf(s, "%ld", v); return s; }
+inline char* ultoa(unsigned long v, char *s, int) { sprintf(s, "%lu", v); return s; }
+inline char* dtostrf(double v, int w, int p, char *s) { sprintf(s, "%*.*f", w, p, v); return s; }
+inline uint16_t word(uint8_t h, uint8_t l) { return (h<<8)|l; }
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+void pinMode(int pin, int mode);
+int digitalRead(int pin);
+void digitalWrite(int pin, int value);
+int analogRead(int pin);
+
+class String {
+public:
+	String() {}
+	String(const char *c) : s(c?c:"") {}
+	String(int v) : s(std::to_string(v)) {}
+	String(unsigned long v) : s(std::to_string(v)) {}
+	const char* c_str() const { return s.c_str(); }
+	unsigned length() const { return s.size(); }
+	long toInt() const { return atol(s.c_str()); }
+	void remove(unsigned i) { s.erase(i); }
+	String& operator+=(const String &o) { s += o.s; return *this; }
+	String& operator+=(const char *o) { s += o; return *this; }
+	String& operator+=(char c) { s += c; return *this; }
+	template<class T> String& operator+=(T v) { s += std::to_string(v); return *this; }
+	std::string s;
+};
+inline String operator+(const String &a, const String &b) { String r=a; r+=b; return r; }
+inline String operator+(const String &a, const char *b) { String r=a; r+=b; return r; }
+inline String operator+(const String &a, int b) { String r=a; r+=b; return r; }
+
+class Print {
+public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t c) = 0;
+	size_t print(const char *s) { size_t n=0; while(*s) n+=write(*s++); return n; }
+	size_t print(const String &s) { return print(s.c_str()); }
+	size_t print(char c) { return write(c); }
+	size_t print(int v, int=10) { char b[12]; return print(itoa(v, b, 10)); }
+	size_t print(unsigned int v) { char b[12]; return print(ultoa(v, b, 10)); }
+	size_t print(long v) { char b[24]; return print(ltoa(v, b, 10)); }
+	size_t print(unsigned long v) { char b[24]; return print(ultoa(v, b, 10)); }
+	size_t print(double v) { char b[32]; return print(dtostrf(v, 1, 2, b)); }
+	template<class T> size_t println(T v) { size_t n=print(v); return n+print("\n"); }
+};
+class Stream : public Print {};
+
+class IPAddress {
+public:
+	IPAddress() { memset(a, 0, 4); }
+	IPAddress(uint8_t a0, uint8_t a1, uint8_t a2, uint8_t a3) { a[0]=a0; a[1]=a1; a[2]=a2; a[3]=a3; }
+	IPAddress(const uint8_t *p) { memcpy(a, p, 4); }
+	IPAddress(uint32_t v) { memcpy(a, &v, 4); }
+	uint8_t operator[](int i) const { return a[i]; }
+	uint8_t& operator[](int i) { return a[i]; }
+	operator uint32_t() const { uint32_t v; memcpy(&v, a, 4); return v; }
+private:
+	uint8_t a[4];
+};
+
+class HardwareSerial : public Stream {
+public:
+	void begin(unsigned long) {}
+	size_t write(uint8_t c) { return fputc(c, stderr)==EOF ? 0 : 1; }
+};
+extern HardwareSerial Serial;
+
+class EspClass {
+public:
+	void restart() { exit(0); }
+	uint32_t getFreeHeap() { return 0; }
+	uint32_t getFreeSketchSpace() { return 0; }
+};
+extern EspClass ESP;
+
+#endif // _HOST_ARDUINO_H
@@ -0,0 +1,12 @@
+/* Host shim for <ESP8266WebServer.h>: declarations the firmware headers refer to */
+#ifndef _HOST_ESP8266WEBSERVER_H
+#define _HOST_ESP8266WEBSERVER_H
+
+#include <ESP8266WiFi.h>
+
+class ESP8266WebServer {
+public:
+	ESP8266WebServer(int port) {}
+};
+
+#endif
@@ -0,0 +1,10 @@
+/* Host shim for <ESP8266WiFi.h>: declarations the firmware headers refer to */
+#ifndef _HOST_ESP8266WIFI_H
+#define _HOST_ESP8266WIFI_H
+
+#include <Arduino.h>
+#include <UIPEthernet.h>
+
+class WiFiClient : public Client {};
+
+#endif
@@ -0,0 +1,13 @@
+/* Host shim for <FS.h>: declarations the firmware headers refer to */
+#ifndef _HOST_FS_H
+#define _HOST_FS_H
+
+#include <Arduino.h>
+
+// the host build stores files through the POSIX backend of storage.cpp
+class File {
+public:
+	operator bool() const { return false; }
+};
+
+#endif
@@ -0,0 +1,5 @@
+/* Host shim for <SPI.h>: declarations the firmware headers refer to */
+#ifndef _HOST_SPI_H
+#define _HOST_SPI_H
+
+#endif
@@ -0,0 +1,24 @@
+/* Host shim for <SSD1306.h>: declarations the firmware headers refer to */
+#ifndef _HOST_SSD1306_H
+#define _HOST_SSD1306_H
+
+#include <Arduino.h>
+
+enum { BLACK, WHITE };
+class SSD1306 : public Print {
+public:
+	SSD1306(uint8_t addr, uint8_t sda, uint8_t scl) {}
+	void init() {}
+	void clear() {}
+	void display() {}
+	void flipScreenVertically() {}
+	void setFont(const uint8_t *font) {}
+	void setColor(int color) {}
+	void fillRect(int x, int y, int w, int h) {}
+	void fillCircle(int x, int y, int r) {}
+	void drawString(int x, int y, String s) {}
+	void drawXbm(int x, int y, int w, int h, const byte *xbm) {}
+	size_t write(uint8_t c) { return 1; }
+};
+
+#endif
@@ -0,0 +1,39 @@
+/* Host shim for <UIPEthernet.h>: declarations the firmware headers refer to */
+#ifndef _HOST_UIPETHERNET_H
+#define _HOST_UIPETHERNET_H
+
+#include <Arduino.h>
+
+class Client : public Stream {
+public:
+	virtual int connect(IPAddress ip, uint16_t port) { return 0; }
+	virtual int connect(const char *host, uint16_t port) { return 0; }
+	virtual size_t write(uint8_t c) { return 0; }
+	virtual size_t write(const uint8_t *buf, size_t len) { return 0; }
+	virtual int available() { return 0; }
+	virtual int read() { return -1; }
+	virtual int read(uint8_t *buf, size_t len) { return 0; }
+	virtual void stop() {}
+	virtual uint8_t connected() { return 0; }
+};
+class EthernetClient : public Client {};
+class EthernetServer {
+public:
+	EthernetServer(uint16_t port) {}
+	void begin() {}
+};
+class UDP {
+public:
+	virtual ~UDP() {}
+	virtual uint8_t begin(uint16_t port) { return 0; }
+	virtual int beginPacket(IPAddress ip, uint16_t port) { return 0; }
+	virtual int beginPacket(const char *host, uint16_t port) { return 0; }
+	virtual size_t write(const uint8_t *buf, size_t len) { return 0; }
+	virtual int endPacket() { return 0; }
+	virtual int parsePacket() { return 0; }
+	virtual int read(uint8_t *buf, size_t len) { return 0; }
+	virtual void stop() {}
+};
+class EthernetUDP : public UDP {};
+
+#endif
@@ -0,0 +1,7 @@
+/* Host shim for <Udp.h>: declarations the firmware headers refer to */
+#ifndef _HOST_UDP_H
+#define _HOST_UDP_H
+
+#include <UIPEthernet.h>
+
+#endif
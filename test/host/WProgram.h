@@ -0,0 +1,7 @@
+/* Host shim for <WProgram.h>: declarations the firmware headers refer to */
+#ifndef _HOST_WPROGRAM_H
+#define _HOST_WPROGRAM_H
+
+#include <Arduino.h>
+
+#endif
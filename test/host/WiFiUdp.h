@@ -0,0 +1,12 @@
+/* Host shim for <WiFiUdp.h>: declarations the firmware headers refer to */
+#ifndef _HOST_WIFIUDP_H
+#define _HOST_WIFIUDP_H
+
+#include <UIPEthernet.h>
+
+class WiFiUDP : public UDP {
+public:
+	static void stopAll() {}
+};
+
+#endif
@@ -0,0 +1,20 @@
+/* Host shim for <Wire.h>: declarations the firmware headers refer to */
+#ifndef _HOST_WIRE_H
+#define _HOST_WIRE_H
+
+#include <Arduino.h>
+
+class TwoWire {
+public:
+	void begin();
+	void beginTransmission(int addr);
+	int endTransmission();
+	void setClock(long clock);
+	size_t write(uint8_t c);
+	int read();
+	int requestFrom(int addr, int len);
+	int available();
+};
+extern TwoWire Wire;
+
+#endif
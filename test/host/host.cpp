@@ -0,0 +1,61 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Arduino core and controller state for the host test build
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+#include <unistd.h>
+
+#include "OpenSprinkler.h"
+
+HardwareSerial Serial;
+EspClass ESP;
+
+static unsigned long long host_micros() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec*1000000ULL + ts.tv_nsec/1000;
+}
+
+unsigned long millis() { return host_micros()/1000; }
+unsigned long micros() { return host_micros(); }
+void delay(unsigned long ms) { if(ms) usleep(ms*1000); }
+void yield() {}
+void pinMode(int pin, int mode) {}
+int digitalRead(int pin) { return LOW; }
+void digitalWrite(int pin, int value) {}
+int analogRead(int pin) { return 0; }
+
+/** Controller state
+ * The modules under test only read the options, status and station attributes,
+ * so they are plain zero-initialized arrays here that a test sets up directly.
+ */
+NVConData OpenSprinkler::nvdata;
+ConStatus OpenSprinkler::status;
+byte OpenSprinkler::iopts[NUM_IOPTS];
+byte OpenSprinkler::attrib_mas[STATION_BYTES] __attribute__((aligned(4)));
+byte OpenSprinkler::attrib_mas2[STATION_BYTES] __attribute__((aligned(4)));
+byte OpenSprinkler::attrib_seq[STATION_BYTES] __attribute__((aligned(4)));
+byte OpenSprinkler::attrib_grp[MAX_NUM_STATIONS];
+uint16_t OpenSprinkler::station_flow[MAX_NUM_STATIONS];
+
+time_t OpenSprinkler::now_tz() {
+	return time(NULL)+(int32_t)3600/4*(int32_t)(iopts[IOPT_TIMEZONE]-48);
+}
@@ -0,0 +1,100 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Host test and benchmark: open file cache of the utils.cpp block I/O
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "test.h"
+#include "OpenSprinkler.h"
+
+#define UNCACHED_FILENAME "stnrec.tmp"	// same content, but not one of the cached data files
+
+/** Station data access of a boot and one /jn request: attribs_load reads
+ * the attributes of every station, then /jn reads every name */
+static void station_workload(const char *fn) {
+	byte buf[STATION_RECORD_SIZE];
+	for(byte sid=0;sid<MAX_NUM_STATIONS;sid++) {
+		ulong pos = (ulong)sid*STATION_RECORD_SIZE;
+		file_read_block(fn, buf, pos+offsetof(StationData, attrib), sizeof(StationAttrib));
+		file_read_byte(fn, pos+offsetof(StationData, type));
+	}
+	for(byte sid=0;sid<MAX_NUM_STATIONS;sid++) {
+		file_read_block(fn, buf, (ulong)sid*STATION_RECORD_SIZE, STATION_NAME_SIZE);
+	}
+}
+
+static ulong opens() { return storage_stats[STORAGE_OP_OPEN].calls; }
+static ulong seeks() { return storage_stats[STORAGE_OP_SEEK].calls; }
+
+int main() {
+	storage_begin();
+	storage_format();
+
+	// station files with a recognizable name in each record
+	byte rec[STATION_RECORD_SIZE];
+	for(byte sid=0;sid<MAX_NUM_STATIONS;sid++) {
+		memset(rec, 0, sizeof(rec));
+		sprintf((char*)rec, "S%03d", sid+1);
+		file_write_block(STATIONS_FILENAME, rec, (ulong)sid*STATION_RECORD_SIZE, sizeof(rec));
+		file_write_block(UNCACHED_FILENAME, rec, (ulong)sid*STATION_RECORD_SIZE, sizeof(rec));
+	}
+	file_flush_all();
+
+	// open and seek counts of the same workload without and with the cache
+	memset(storage_stats, 0, sizeof(storage_stats));
+	station_workload(UNCACHED_FILENAME);
+	ulong opens_before = opens(), seeks_before = seeks();
+	memset(storage_stats, 0, sizeof(storage_stats));
+	station_workload(STATIONS_FILENAME);
+	ulong opens_after = opens(), seeks_after = seeks();
+	printf("%d stations, boot attributes + /jn names: %lu opens, %lu seeks without the cache, "
+		"%lu opens, %lu seeks with it\n",
+		MAX_NUM_STATIONS, opens_before, seeks_before, opens_after, seeks_after);
+	CHECK(opens_before==3*MAX_NUM_STATIONS);
+	CHECK(opens_after==1);
+	CHECK(seeks_after<seeks_before);
+
+	// writes through a cached handle are flushed: a separate handle sees them
+	char name[8];
+	file_write_block(STATIONS_FILENAME, "Front", 0, 6);
+	StorageFile f = storage_open(STATIONS_FILENAME, "r");
+	CHECK(f.read(name, 6)==6 && strcmp(name, "Front")==0);
+	f.close();
+	file_read_block(STATIONS_FILENAME, name, STATION_RECORD_SIZE, 5);
+	CHECK(memcmp(name, "S002", 5)==0);
+
+	// more cached files than handles: the least recently used one is closed
+	file_write_block(CONFIG_FILENAME, "C", 0, 1);
+	file_write_block(SOPTS_FILENAME, "O", 0, 1);
+	file_write_block(PROG_FILENAME, "P", 0, 1);
+	memset(storage_stats, 0, sizeof(storage_stats));
+	CHECK(file_read_byte(STATIONS_FILENAME, 0)=='F');
+	CHECK(file_read_byte(PROG_FILENAME, 0)=='P');
+	CHECK(opens()==1);
+
+	// a file written with write_to_file or removed is not read through a stale handle
+	write_to_file(PROG_FILENAME, "Q", 1);
+	CHECK(file_read_byte(PROG_FILENAME, 0)=='Q');
+	remove_file(PROG_FILENAME);
+	CHECK(!file_exists(PROG_FILENAME));
+	CHECK(file_size(PROG_FILENAME)==0);
+
+	file_flush_all();
+	return test_result("filecache");
+}
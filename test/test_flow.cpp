@@ -0,0 +1,159 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Host test and benchmark: flow budget placement of concurrent runs
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "test.h"
+#include "program.h"
+
+#define QUEUE_RUNS  200
+#define CURR_TIME   1700000000UL
+#define FLOW_LIMIT  20	// IOPT_FLOW_LIMIT, in flow units
+
+static ProgramData pd;
+static byte nplaced;
+
+/** Expected flow of the scheduled runs at time x */
+static int32_t load_at(ulong x) {
+	int32_t load = 0;
+	for(byte i=0;i<nplaced;i++) {
+		const RuntimeQueueStruct &q = pd.queue[i];
+		if (q.st<=x && x<q.st+q.dur) load += pd.flow_expected(q.sid, pd.flow_limit());
+	}
+	return load;
+}
+
+/** Whether a run fits in the limit from x, checked at every start it overlaps */
+static bool fits(ulong x, ulong dur, uint16_t f) {
+	int32_t limit = pd.flow_limit();
+	if (load_at(x)+f > limit) return false;
+	for(byte i=0;i<nplaced;i++) {
+		ulong s = pd.queue[i].st;
+		if (s>x && s<x+dur && load_at(s)+f > limit) return false;
+	}
+	return true;
+}
+
+/** Earliest start not before t at which the run fits: the load only drops
+ * when a run ends, so the candidates are t and the ends after it */
+static ulong brute_place(ulong t, ulong dur, uint16_t f) {
+	ulong best = (ulong)-1;
+	if (fits(t, dur, f)) return t;
+	for(byte i=0;i<nplaced;i++) {
+		ulong e = pd.queue[i].st+pd.queue[i].dur;
+		if (e>t && e<best && fits(e, dur, f)) best = e;
+	}
+	return best;
+}
+
+/** Fill the queue with unscheduled runs of every kind of station */
+static void make_queue() {
+	for(byte sid=0;sid<MAX_NUM_STATIONS;sid++) {
+		switch(sid%8) {
+			case 0: os.station_flow[sid] = 0; break;	// not learned yet: no budget
+			case 1: os.station_flow[sid] = FLOW_LIMIT*10+50; break;	// more than the limit: runs alone
+			default: os.station_flow[sid] = 10+rand()%150;
+		}
+	}
+	pd.nqueue = QUEUE_RUNS;
+	for(byte i=0;i<QUEUE_RUNS;i++) {
+		RuntimeQueueStruct &q = pd.queue[i];
+		q.st = 0;
+		q.dur = 60+rand()%1800;
+		q.sid = rand()%MAX_NUM_STATIONS;
+		q.pid = 1;
+		pd.qorder[i] = i;
+	}
+}
+
+/** The concurrent path of schedule_station: place with the budget, stagger by 1 second */
+static ulong schedule(byte i, ulong &con_start_time) {
+	RuntimeQueueStruct *q = pd.queue+i;
+	uint16_t limit = pd.flow_limit();
+	uint16_t f = pd.flow_expected(q->sid, limit);
+	q->st = f ? pd.flow_place(con_start_time, q->dur, f, limit) : con_start_time;
+	con_start_time++;
+	pd.flow_add(q, limit);
+	return q->st;
+}
+
+int main() {
+	srand(1);
+	os.iopts[IOPT_FLOW_LIMIT] = FLOW_LIMIT;
+	os.iopts[IOPT_REMOTE_EXT_MODE] = 0;
+
+	// every placement of a 200 run queue is the earliest start that fits
+	make_queue();
+	pd.flow_prepare(CURR_TIME);
+	ulong con_start_time = CURR_TIME+1;
+	long wrong = 0;
+	for(nplaced=0;nplaced<QUEUE_RUNS;) {
+		RuntimeQueueStruct &q = pd.queue[nplaced];
+		uint16_t f = pd.flow_expected(q.sid, pd.flow_limit());
+		ulong expect = f ? brute_place(con_start_time, q.dur, f) : con_start_time;
+		if (schedule(nplaced, con_start_time)!=expect) wrong++;
+		nplaced++;
+	}
+	CHECK(wrong==0);
+
+	// the total expected flow stays within the limit at every start
+	int32_t peak = 0;
+	ulong makespan = 0;
+	for(byte i=0;i<QUEUE_RUNS;i++) {
+		int32_t l = load_at(pd.queue[i].st);
+		if (l>peak) peak = l;
+		if (pd.queue[i].st+pd.queue[i].dur>makespan) makespan = pd.queue[i].st+pd.queue[i].dur;
+	}
+	CHECK(peak<=FLOW_LIMIT*10);
+
+	// a profile rebuilt later from the queue places the next run the same way
+	ulong later = CURR_TIME+600;
+	nplaced = pd.nqueue = QUEUE_RUNS-1;
+	pd.flow_prepare(later);
+	RuntimeQueueStruct &extra = pd.queue[QUEUE_RUNS-1];
+	extra.sid = 2;
+	extra.dur = 300;
+	uint16_t f = pd.flow_expected(extra.sid, pd.flow_limit());
+	CHECK(pd.flow_place(later, extra.dur, f, pd.flow_limit())==brute_place(later, extra.dur, f));
+
+	// no limit: concurrent runs are only staggered
+	os.iopts[IOPT_FLOW_LIMIT] = 0;
+	CHECK(pd.flow_limit()==0);
+	os.iopts[IOPT_FLOW_LIMIT] = FLOW_LIMIT;
+
+	// the scheduler pass over a full queue, as schedule_all_stations runs it in the 1 Hz tick
+	const int reps = 200;
+	double worst = 0, total = 0;
+	for(int r=0;r<reps;r++) {
+		make_queue();
+		double t0 = test_nanos();
+		pd.flow_prepare(CURR_TIME);
+		con_start_time = CURR_TIME+1;
+		for(byte i=0;i<QUEUE_RUNS;i++) schedule(i, con_start_time);
+		double t = test_nanos()-t0;
+		total += t;
+		if (t>worst) worst = t;
+	}
+	printf("flow budget, %d queued runs: %.1f us per scheduler pass (worst %.1f us), "
+		"makespan %lu s, peak flow %.1f of %d\n",
+		QUEUE_RUNS, total/reps/1e3, worst/1e3, makespan-CURR_TIME, peak/10.0, FLOW_LIMIT);
+
+	return test_result("flow");
+}
@@ -0,0 +1,202 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Host test and benchmark: /jl log queries
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "test.h"
+#include "oslog.h"
+
+#include <vector>
+#include <string>
+
+#define FIRST_DAY     20000UL
+#define LOG_DAYS      30	// the last 30 days of the year have a log
+#define RUNS_PER_DAY  400	// station runs of a busy controller
+#define TEXT_PREFIX   "/txtlogs/"	// text copies of the logs, read the way /jl used to
+
+static std::vector<LogRecord> records;	// everything that was logged, in order
+
+static void log_day(ulong day) {
+	LogRecord r;
+	memset(&r, 0, sizeof(r));
+	ulong t = day*86400UL + 60;
+	for(int i=0;i<RUNS_PER_DAY;i++) {
+		t += 1 + rand()%200;
+		if(i%16==0) {
+			// water level and flow records between the runs
+			r.type = (i%32) ? LOGDATA_WATERLEVEL : LOGDATA_FLOWSENSE;
+			r.count = (r.type==LOGDATA_FLOWSENSE) ? rand()%500 : 0;
+			r.value = rand()%200;
+			r.pid = r.sid = 0;
+			r.has_flow = false;
+			r.flow = 0;
+			r.time = t++;
+			records.push_back(r);
+			log_append(r);
+		}
+		r.type = LOGDATA_STATION;
+		r.pid = 1+rand()%40;
+		r.sid = rand()%64;
+		r.count = 0;
+		r.value = 60+rand()%1800;
+		r.has_flow = (rand()%2)!=0;
+		r.flow = r.has_flow ? rand()%2000 : 0;
+		r.time = t;
+		records.push_back(r);
+		log_append(r);
+	}
+	log_flush();
+}
+
+/** Records /jl returns, rendered: what the server loop of server_json_log does */
+static std::vector<std::string> query(uint16_t types, ulong start, ulong end, ulong limit) {
+	std::vector<std::string> out;
+	char buf[LOG_RENDER_MAXSIZE];
+	LogReader reader;
+	LogRecord r;
+	reader.filter(types, start, end);
+	for(ulong i=start/86400L;i<=end/86400L && (!limit || out.size()<limit);i++) {
+		if(!reader.open(i)) continue;
+		while((!limit || out.size()<limit) && reader.next(r)) {
+			log_render(r, buf);
+			out.push_back(buf);
+		}
+		reader.close();
+	}
+	return out;
+}
+
+/** The same query answered from the list of logged records */
+static std::vector<std::string> expected(uint16_t types, ulong start, ulong end, ulong limit) {
+	std::vector<std::string> out;
+	char buf[LOG_RENDER_MAXSIZE];
+	for(size_t i=0;i<records.size() && (!limit || out.size()<limit);i++) {
+		const LogRecord &r = records[i];
+		if(!((types>>r.type)&1) || r.time<start || r.time>end) continue;
+		log_render(r, buf);
+		out.push_back(buf);
+	}
+	return out;
+}
+
+/** How /jl read the text logs before the binary logs and the index: try to
+ * open the file of every day in the range, read it one byte at a time, and
+ * filter each line by type after finding its first comma */
+static ulong query_text(ulong start_day, ulong end_day) {
+	ulong count = 0;
+	char name[32], line[LOG_RENDER_MAXSIZE+2];
+	for(ulong day=start_day;day<=end_day;day++) {
+		sprintf(name, TEXT_PREFIX "%lu.txt", day);
+		StorageFile f = storage_open(name, "r");
+		if(!f) continue;
+		int c;
+		byte len = 0;
+		while((c=f.read())>=0) {
+			if(c!='\n') {
+				if(len<sizeof(line)-1) line[len++] = c;
+				continue;
+			}
+			line[len] = 0;
+			len = 0;
+			char *comma = strchr(line, ',');
+			if(!comma) continue;
+			if(comma[1]=='"' && (!strncmp(comma+2, "wl", 2) || !strncmp(comma+2, "fl", 2))) continue;
+			count++;
+		}
+		f.close();
+	}
+	return count;
+}
+
+static void write_text_logs() {
+	char name[32], buf[LOG_RENDER_MAXSIZE];
+	StorageFile f;
+	ulong day = 0;
+	for(size_t i=0;i<records.size();i++) {
+		if(records[i].time/86400UL!=day) {
+			if(f) f.close();
+			day = records[i].time/86400UL;
+			sprintf(name, TEXT_PREFIX "%lu.txt", day);
+			f = storage_open(name, "w");
+		}
+		log_render(records[i], buf);
+		strcat(buf, "\r\n");
+		f.write(buf, strlen(buf));
+	}
+	if(f) f.close();
+}
+
+/** Time a query and count its storage calls, with both log formats */
+static void bench(const char *what, uint16_t types, ulong start_day, ulong end_day) {
+	const int reps = 5;
+	ulong start = start_day*86400UL, end = end_day*86400UL+86399UL;
+	size_t n = 0;
+	ulong m = 0;
+	memset(storage_stats, 0, sizeof(storage_stats));
+	double t0 = test_nanos();
+	for(int i=0;i<reps;i++) n = query(types, start, end, 0).size();
+	double t1 = test_nanos();
+	StorageStat bin_open = storage_stats[STORAGE_OP_OPEN], bin_read = storage_stats[STORAGE_OP_READ];
+	memset(storage_stats, 0, sizeof(storage_stats));
+	for(int i=0;i<reps;i++) m = query_text(start_day, end_day);
+	double t2 = test_nanos();
+	StorageStat txt_open = storage_stats[STORAGE_OP_OPEN], txt_read = storage_stats[STORAGE_OP_READ];
+	CHECK(n==m);
+	CHECK(bin_read.calls*10 < txt_read.calls);
+	printf("/jl over %s (%lu records): %.2f ms, %lu opens, %lu reads of %lu bytes; "
+		"text logs read per byte: %.2f ms, %lu opens, %lu reads of %lu bytes\n",
+		what, (ulong)n, (t1-t0)/reps/1e6, bin_open.calls/reps, bin_read.calls/reps, bin_read.bytes/reps,
+		(t2-t1)/reps/1e6, txt_open.calls/reps, txt_read.calls/reps, txt_read.bytes/reps);
+}
+
+int main() {
+	storage_begin();
+	storage_format();
+	srand(1);
+	for(ulong k=0;k<LOG_DAYS;k++) log_day(FIRST_DAY+k);
+	const ulong last_day = FIRST_DAY+LOG_DAYS-1;
+	const uint16_t types_default = LOG_TYPE_ALL & ~((1<<LOGDATA_WATERLEVEL) | (1<<LOGDATA_FLOWSENSE));
+
+	// whole range, the default types: every record, in order
+	ulong start = FIRST_DAY*86400UL, end = last_day*86400UL+86399UL;
+	CHECK(query(types_default, start, end, 0)==expected(types_default, start, end, 0));
+	CHECK(query(1<<LOGDATA_WATERLEVEL, start, end, 0)==expected(1<<LOGDATA_WATERLEVEL, start, end, 0));
+	CHECK(query(0, start, end, 0).empty());
+
+	// exact seconds in the middle of days, and a record limit
+	const LogRecord &a = records[RUNS_PER_DAY/2], &b = records[records.size()-RUNS_PER_DAY/3];
+	CHECK(query(types_default, a.time, b.time, 0)==expected(types_default, a.time, b.time, 0));
+	CHECK(query(types_default, a.time, a.time, 0).size()==1);
+	CHECK(query(LOG_TYPE_ALL, a.time+1, b.time-1, 100)==expected(LOG_TYPE_ALL, a.time+1, b.time-1, 100));
+
+	// the index answers for the days without a log: one open per log day
+	CHECK(log_exists(FIRST_DAY) && log_exists(last_day) && !log_exists(FIRST_DAY-1) && !log_exists(last_day+1));
+	memset(storage_stats, 0, sizeof(storage_stats));
+	query(types_default, start-335*86400UL, end, 0);
+	CHECK(storage_stats[STORAGE_OP_OPEN].calls==LOG_DAYS);
+
+	// /jl over 30 days and over the year on the busy controller: binary logs
+	// with the index and buffered reads, against the text logs read the old way
+	write_text_logs();
+	bench("30 days", types_default, FIRST_DAY, last_day);
+	bench("365 days", types_default, last_day-364, last_day);
+
+	return test_result("logquery");
+}
@@ -0,0 +1,188 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Host test and benchmark: /lr raw log download and its byte ranges
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "test.h"
+#include "oslog.h"
+
+#include <string>
+
+#define FIRST_DAY     20000UL
+#define LOG_DAYS      30
+#define RUNS_PER_DAY  400
+#define BLOCK_SIZE    8192	// ETHER_BUFFER_SIZE on the ESP8266
+#define GAP_DAY       (FIRST_DAY+10)	// a day without a log inside the range
+
+static std::string sent;	// what reached the client
+static ulong writes;
+static ulong fail_after = (ulong)-1;	// the client goes away after this many bytes
+
+static bool collect(const byte *data, ulong len) {
+	if(sent.size()+len>fail_after) return false;
+	sent.append((const char*)data, len);
+	writes++;
+	return true;
+}
+
+static std::string download(ulong start, ulong end, ulong from, ulong to) {
+	sent.clear();
+	writes = 0;
+	byte buf[BLOCK_SIZE];
+	CHECK(log_raw_copy(start, end, from, to, buf, sizeof(buf), collect));
+	return sent;
+}
+
+/** The raw files of the range, read whole and concatenated */
+static std::string files(ulong start, ulong end) {
+	std::string out;
+	char name[24];
+	for(ulong day=start;day<=end;day++) {
+		log_file_name(name, day);
+		StorageFile f = storage_open(name, "r");
+		if(!f) continue;
+		int c;
+		while((c=f.read())>=0) out += (char)c;
+		f.close();
+	}
+	return out;
+}
+
+static void log_day(ulong day) {
+	LogRecord r;
+	memset(&r, 0, sizeof(r));
+	r.type = LOGDATA_STATION;
+	ulong t = day*86400UL + 60;
+	for(int i=0;i<RUNS_PER_DAY;i++) {
+		t += 1 + rand()%200;
+		r.pid = 1+rand()%40;
+		r.sid = rand()%64;
+		r.value = 60+rand()%1800;
+		r.has_flow = (rand()%2)!=0;
+		r.flow = r.has_flow ? rand()%2000 : 0;
+		r.time = t;
+		log_append(r);
+	}
+}
+
+static bool range(const char *s, ulong total, ulong from, ulong to) {
+	ulong a = 12345, b = 12345;
+	return log_parse_range(s, total, a, b) && a==from && b==to;
+}
+
+static bool bad_range(const char *s, ulong total) {
+	ulong a, b;
+	return !log_parse_range(s, total, a, b);
+}
+
+int main() {
+	storage_begin();
+	storage_format();
+
+	// Range headers of a 1000 byte download
+	CHECK(range("bytes=0-", 1000, 0, 999));
+	CHECK(range("bytes=10-19", 1000, 10, 19));
+	CHECK(range("bytes=500-500", 1000, 500, 500));
+	CHECK(range("bytes=990-5000", 1000, 990, 999));	// clamped to the end
+	CHECK(range("bytes=-5", 1000, 995, 999));
+	CHECK(range("bytes=-5000", 1000, 0, 999));
+	CHECK(bad_range("bytes=1000-", 1000));	// starts past the end
+	CHECK(bad_range("bytes=20-10", 1000));
+	CHECK(bad_range("bytes=-0", 1000));
+	CHECK(bad_range("bytes=-5", 0));
+	CHECK(bad_range("bytes=0-", 0));
+	CHECK(bad_range("bytes=", 1000));
+	CHECK(bad_range("bytes=-", 1000));
+	CHECK(bad_range("bytes=a-b", 1000));
+	CHECK(bad_range("bytes=1-2x", 1000));
+	CHECK(bad_range("bytes=0-1,5-6", 1000));	// one range only
+	CHECK(bad_range("items=0-1", 1000));
+
+	srand(1);
+	for(ulong k=0;k<LOG_DAYS;k++) if(FIRST_DAY+k!=GAP_DAY) log_day(FIRST_DAY+k);
+	const ulong last_day = FIRST_DAY+LOG_DAYS-1;
+
+	// the download is the files of the range, concatenated; log_raw_size
+	// flushes the queued records first
+	ulong total = log_raw_size(FIRST_DAY, last_day);
+	std::string all = files(FIRST_DAY, last_day);
+	CHECK(total>0 && total==all.size());
+	CHECK(download(FIRST_DAY, last_day, 0, total-1)==all);
+	CHECK(writes<=total/BLOCK_SIZE+LOG_DAYS);	// one block per write, short ones at file ends
+	CHECK(log_raw_size(FIRST_DAY-5, FIRST_DAY-1)==0);
+	CHECK(log_raw_size(GAP_DAY, GAP_DAY)==0);
+
+	// resuming: the pieces of a download at arbitrary offsets, across file
+	// boundaries, add up to the whole
+	std::string pieces;
+	ulong from = 0;
+	while(from<total) {
+		ulong to = from + 1 + rand()%20000;
+		if(to>=total) to = total-1;
+		pieces += download(FIRST_DAY, last_day, from, to);
+		from = to+1;
+	}
+	CHECK(pieces==all);
+	CHECK(download(FIRST_DAY, last_day, total-5, total-1)==all.substr(total-5));
+	ulong day1 = log_raw_size(FIRST_DAY, FIRST_DAY);
+	CHECK(download(FIRST_DAY, last_day, day1-1, day1)==all.substr(day1-1, 2));
+
+	// the client going away stops the copy
+	sent.clear();
+	fail_after = 3*BLOCK_SIZE;
+	byte buf[BLOCK_SIZE];
+	CHECK(!log_raw_copy(FIRST_DAY, last_day, 0, total-1, buf, sizeof(buf), collect));
+	CHECK(sent.size()>2*BLOCK_SIZE && sent.size()<=3*BLOCK_SIZE && sent==all.substr(0, sent.size()));
+	fail_after = (ulong)-1;
+
+	// throughput of a 30 day export: raw blocks against /jl rendering every
+	// record to JSON
+	const int reps = 20;
+	memset(storage_stats, 0, sizeof(storage_stats));
+	double t0 = test_nanos();
+	for(int i=0;i<reps;i++) download(FIRST_DAY, last_day, 0, total-1);
+	double t1 = test_nanos();
+	StorageStat raw_read = storage_stats[STORAGE_OP_READ];
+	ulong json_bytes = 0;
+	char line[LOG_RENDER_MAXSIZE];
+	LogReader reader;
+	LogRecord r;
+	for(int i=0;i<reps;i++) {
+		json_bytes = 0;
+		reader.filter(LOG_TYPE_ALL, FIRST_DAY*86400UL, last_day*86400UL+86399UL);
+		for(ulong day=FIRST_DAY;day<=last_day;day++) {
+			if(!reader.open(day)) continue;
+			while(reader.next(r)) {
+				log_render(r, line);
+				json_bytes += strlen(line)+1;
+			}
+			reader.close();
+		}
+	}
+	double t2 = test_nanos();
+	double raw_ms = (t1-t0)/reps/1e6, json_ms = (t2-t1)/reps/1e6;
+	printf("%d days export: /lr %lu bytes in %lu reads, %.2f ms (%.1f MB/s); "
+		"/jl %lu bytes of JSON, %.2f ms (%.1f MB/s)\n",
+		LOG_DAYS, total, raw_read.calls/reps, raw_ms, total/raw_ms/1e3,
+		json_bytes, json_ms, json_bytes/json_ms/1e3);
+	CHECK(raw_ms < json_ms);
+
+	return test_result("rawlog");
+}
@@ -0,0 +1,216 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Host test and benchmark: compiled minute-of-day schedules against check_match
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "test.h"
+#include "program.h"
+
+#define FIRST_DAY  19723UL	// 1 Jan 2024, a leap year
+#define YEAR_DAYS  366
+
+/** Start time decoding as it was before the compiled schedules */
+static int16_t starttime_decode_ref(int16_t t) {
+	if((t>>15)&1) return -1;
+	int16_t offset = t&0x7ff;
+	if((t>>STARTTIME_SIGN_BIT)&1) offset = -offset;
+	if((t>>STARTTIME_SUNRISE_BIT)&1) { // sunrise time
+		t = os.nvdata.sunrise_time + offset;
+		if (t<0) t=0; // clamp it to 0 if less than 0
+	} else if((t>>STARTTIME_SUNSET_BIT)&1) {
+		t = os.nvdata.sunset_time + offset;
+		if (t>=1440) t=1439; // clamp it to 1440 if larger than 1440
+	}
+	return t;
+}
+
+/** ProgramStruct::check_day_match as it was before the compiled schedules */
+static byte check_day_match_ref(const ProgramSchedule &p, time_t t) {
+	time_t ct = t;
+	struct tm *ti = gmtime(&ct);
+	byte weekday_t = (ti->tm_wday+1)%7;  // tm_wday ranges from [0,6] with Sunday being 0
+	byte day_t = ti->tm_mday;
+	byte month_t = ti->tm_mon+1;	 // tm_mon ranges from [0,11]
+
+	byte wd = (weekday_t+5)%7;
+	byte dt = day_t;
+
+	switch(p.type) {
+		case PROGRAM_TYPE_WEEKLY:
+			if (!(p.days[0] & (1<<wd)))
+				return 0;
+		break;
+		case PROGRAM_TYPE_BIWEEKLY:
+		break;
+		case PROGRAM_TYPE_MONTHLY:
+			if (dt != (p.days[0]&0b11111))
+				return 0;
+		break;
+		case PROGRAM_TYPE_INTERVAL:
+			if (((t/SECS_PER_DAY)%p.days[1]) != p.days[0])	return 0;
+		break;
+	}
+
+	if (!p.oddeven) { }
+	else if (p.oddeven == 2) {
+		if((dt%2)!=0)  return 0;
+	} else if (p.oddeven == 1) {
+		if(dt==31)	return 0;
+		else if (dt==29 && month_t==2)	return 0;
+		else if ((dt%2)!=1)  return 0;
+	}
+	return 1;
+}
+
+/** ProgramStruct::check_match as it was before the compiled schedules */
+static byte check_match_ref(const ProgramSchedule &p, time_t t) {
+	if (!p.enabled) return 0;
+
+	int16_t start = starttime_decode_ref(p.starttimes[0]);
+	int16_t repeat = p.starttimes[1];
+	int16_t interval = p.starttimes[2];
+	int16_t current_minute = (t%86400L)/60;
+
+	if (check_day_match_ref(p, t)) {
+		if (p.starttime_type) {
+			for(byte i=0;i<MAX_NUM_STARTTIMES;i++) {
+				if (current_minute == starttime_decode_ref(p.starttimes[i]))	return 1;
+			}
+			return 0;
+		} else {
+			if (current_minute == start) return 1;
+			if (current_minute > start && interval) {
+				int16_t c = (current_minute - start) / interval;
+				if ((c * interval == (current_minute - start)) && c <= repeat) {
+					return 1;
+				}
+			}
+		}
+	}
+	if (p.starttime_type || !interval)	return 0;
+
+	if (check_day_match_ref(p, t-86400L)) {
+		int16_t c = (current_minute - start + 1440) / interval;
+		if ((c * interval == (current_minute - start + 1440)) && c <= repeat) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int16_t random_starttime() {
+	int16_t offset = rand()%240;
+	switch(rand()%4) {
+		case 0: return (1<<STARTTIME_SUNRISE_BIT) | offset | ((rand()%2)<<STARTTIME_SIGN_BIT);
+		case 1: return (1<<STARTTIME_SUNSET_BIT) | offset | ((rand()%2)<<STARTTIME_SIGN_BIT);
+		case 2: return -1;	// unused fixed start time
+		default: return rand()%1440;
+	}
+}
+
+/** Every kind of program: all schedule types, odd/even days, fixed and
+ * repeating start times, sunrise/sunset offsets, and repeats that run
+ * past midnight */
+static void make_programs() {
+	ProgramData::nprograms = MAX_NUM_PROGRAMS;
+	for(byte pid=0;pid<MAX_NUM_PROGRAMS;pid++) {
+		ProgramEntry &p = ProgramData::programs[pid];
+		memset(&p, 0, sizeof(p));
+		p.enabled = (pid%13)!=12;
+		p.oddeven = rand()%3;
+		p.type = pid%4;
+		switch(p.type) {
+			case PROGRAM_TYPE_WEEKLY: p.days[0] = rand()&0x7F; break;
+			case PROGRAM_TYPE_MONTHLY: p.days[0] = 1+rand()%31; break;
+			case PROGRAM_TYPE_INTERVAL: p.days[1] = 1+rand()%10; p.days[0] = rand()%p.days[1]; break;
+		}
+		p.starttime_type = (pid/4)%2;
+		if (p.starttime_type) {
+			for(byte i=0;i<MAX_NUM_STARTTIMES;i++) p.starttimes[i] = random_starttime();
+		} else {
+			p.starttimes[0] = (pid%3) ? random_starttime() : 1200+rand()%240;	// late starts spill over
+			p.starttimes[1] = rand()%30;
+			p.starttimes[2] = (pid%7) ? 1+rand()%180 : 0;
+		}
+	}
+}
+
+/** Sunrise and sunset of a day, moving through the year */
+static void set_sun(ulong day) {
+	int k = (day-FIRST_DAY)%YEAR_DAYS;
+	int swing = (k<183) ? k : YEAR_DAYS-k;
+	os.nvdata.sunrise_time = 420 - swing/2;
+	os.nvdata.sunset_time = 1020 + swing/2;
+}
+
+int main() {
+	srand(1);
+	make_programs();
+
+	// every minute of a year, every program: the compiled schedule as the
+	// main loop uses it, against the old check_match
+	long matches = 0, mismatches = 0;
+	for(ulong day=FIRST_DAY;day<FIRST_DAY+YEAR_DAYS;day++) {
+		set_sun(day);
+		for(ulong m=0;m<1440;m++) {
+			time_t t = day*86400UL + m*60;
+			if (m==720 && day%5==0) os.nvdata.sunset_time += 3;	// a weather update changes the times mid-day
+			ProgramData::update_schedule(t);
+			for(byte pid=0;pid<ProgramData::nprograms;pid++) {
+				byte ref = check_match_ref(ProgramData::programs[pid], t);
+				matches += ref;
+				if (ProgramData::check_match(pid, t)!=ref || ProgramData::programs[pid].check_match(t)!=ref) {
+					if (mismatches++ < 5) printf("mismatch: program %d at %lu\n", pid, (ulong)t);
+				}
+			}
+		}
+	}
+	CHECK(mismatches==0);
+	CHECK(matches>YEAR_DAYS);
+
+	// per-minute cost over the year: the old check_match of every program,
+	// against update_schedule (a compile once a day) and one bit test each
+	double t0 = test_nanos();
+	volatile long sink = 0;
+	for(ulong day=FIRST_DAY;day<FIRST_DAY+YEAR_DAYS;day++) {
+		set_sun(day);
+		for(ulong m=0;m<1440;m++) {
+			time_t t = day*86400UL + m*60;
+			for(byte pid=0;pid<ProgramData::nprograms;pid++) sink += check_match_ref(ProgramData::programs[pid], t);
+		}
+	}
+	double t1 = test_nanos();
+	for(ulong day=FIRST_DAY;day<FIRST_DAY+YEAR_DAYS;day++) {
+		set_sun(day);
+		for(ulong m=0;m<1440;m++) {
+			time_t t = day*86400UL + m*60;
+			ProgramData::update_schedule(t);
+			for(byte pid=0;pid<ProgramData::nprograms;pid++) sink += ProgramData::check_match(pid, t);
+		}
+	}
+	double t2 = test_nanos();
+	double minutes = YEAR_DAYS*1440.0;
+	printf("%d programs over a year: check_match %.2f us per minute, compiled %.2f us per minute "
+		"(including the daily compile)\n",
+		MAX_NUM_PROGRAMS, (t1-t0)/minutes/1e3, (t2-t1)/minutes/1e3);
+	CHECK(t2-t1 < t1-t0);
+
+	return test_result("schedule");
+}
@@ -0,0 +1,107 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Host test: POSIX storage backend and its counters
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "test.h"
+#include "storage.h"
+
+#include <string.h>
+
+static int listed;
+static ulong listed_bytes;
+
+static void count_file(const char *name, ulong size) {
+	listed++;
+	listed_bytes += size;
+}
+
+static void write_file(const char *name, const char *data) {
+	StorageFile f = storage_open(name, "w");
+	f.write(data, strlen(data));
+	f.close();
+}
+
+int main() {
+	CHECK(storage_begin());
+	storage_format();
+	memset(storage_stats, 0, sizeof(storage_stats));
+
+	// write, then read back through a second handle
+	StorageFile f = storage_open("/a.dat", "w");
+	CHECK(f);
+	CHECK(f.write("hello world", 11)==11);
+	f.close();
+	CHECK(storage_stats[STORAGE_OP_OPEN].calls==1);
+	CHECK(storage_stats[STORAGE_OP_WRITE].bytes==11);
+
+	ulong size = 0;
+	CHECK(storage_exists("/a.dat"));
+	CHECK(storage_stat("/a.dat", &size) && size==11);
+	CHECK(!storage_exists("/missing.dat"));
+	CHECK(!storage_open("/missing.dat", "r"));
+
+	char buf[16];
+	f = storage_open("/a.dat", "r+");
+	CHECK(f && f.size()==11);
+	CHECK(f.seek(6));
+	CHECK(f.read(buf, 5)==5 && memcmp(buf, "world", 5)==0);
+	CHECK(f.read()==-1);
+	CHECK(f.position()==11);
+
+	// overwrite in place, then append at the end
+	CHECK(f.seek(0));
+	CHECK(f.write("HELLO", 5)==5);
+	CHECK(f.seek(0, STORAGE_SEEK_END));
+	CHECK(f.write("!", 1)==1);
+	f.flush();
+	CHECK(f.size()==12);
+	f.close();
+	f = storage_open("/a.dat", "r");
+	CHECK(f.read(buf, sizeof(buf))==12 && memcmp(buf, "HELLO world!", 12)==0);
+	f.close();
+	CHECK(storage_stats[STORAGE_OP_READ].bytes==5+12);
+	CHECK(storage_stats[STORAGE_OP_SEEK].calls==3);
+
+	// files in a folder are listed by prefix, like log files
+	write_file("/logs/100.bin", "12345");
+	write_file("/logs/101.bin", "123");
+	write_file("/logs.dat", "");
+	listed = 0;
+	listed_bytes = 0;
+	storage_list("/logs/", count_file);
+	CHECK(listed==2 && listed_bytes==8);
+	listed = 0;
+	storage_list("/logs/10", count_file);
+	CHECK(listed==2);
+	listed = 0;
+	storage_list("/logs/101", count_file);
+	CHECK(listed==1);
+	CHECK(storage_stats[STORAGE_OP_LIST].calls==3);
+
+	CHECK(storage_remove("/logs/100.bin"));
+	CHECK(!storage_remove("/logs/100.bin"));
+	CHECK(!storage_exists("/logs/100.bin"));
+	CHECK(storage_stats[STORAGE_OP_REMOVE].calls==2);
+
+	storage_format();
+	CHECK(!storage_exists("/a.dat") && !storage_exists("/logs/101.bin"));
+	return test_result("storage");
+}
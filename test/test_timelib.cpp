@@ -0,0 +1,140 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Host test and benchmark: breakDate / breakTime against the year-by-year loop
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "test.h"
+#include "TimeLib.h"
+
+#define LEAP_YEAR(Y)		 ( ((1970+Y)>0) && !((1970+Y)%4) && ( ((1970+Y)%100) || !((1970+Y)%400) ) )
+
+static const uint8_t monthDays[]={31,28,31,30,31,30,31,31,30,31,30,31};
+
+/** breakTime as it was before the civil-from-days conversion: walk the years
+ * from 1970, then the months */
+static void breakTime_loop(time_t timeInput, tmElements_t &tm) {
+	uint8_t year;
+	uint8_t month, monthLength;
+	uint32_t time;
+	unsigned long days;
+
+	time = (uint32_t)timeInput;
+	tm.Second = time % 60;
+	time /= 60;
+	tm.Minute = time % 60;
+	time /= 60;
+	tm.Hour = time % 24;
+	time /= 24;
+	tm.Wday = ((time + 4) % 7) + 1;
+
+	year = 0;
+	days = 0;
+	while((unsigned)(days += (LEAP_YEAR(year) ? 366 : 365)) <= time) {
+		year++;
+	}
+	tm.Year = year;
+
+	days -= LEAP_YEAR(year) ? 366 : 365;
+	time	-= days;
+
+	days=0;
+	month=0;
+	monthLength=0;
+	for (month=0; month<12; month++) {
+		if (month==1) {
+			monthLength = LEAP_YEAR(year) ? 29 : 28;
+		} else {
+			monthLength = monthDays[month];
+		}
+		if (time >= monthLength) {
+			time -= monthLength;
+		} else {
+			break;
+		}
+	}
+	tm.Month = month + 1;
+	tm.Day = time + 1;
+}
+
+#define FIRST_DAY 0UL	// 1 Jan 1970
+#define LAST_DAY  47847UL	// 31 Dec 2100
+
+static volatile uint32_t sink;
+
+int main() {
+	// every day from 1970 to 2100, at the start, the middle and the end of the day
+	const uint32_t offsets[] = {0, 43210, 86399};
+	long mismatches = 0;
+	for(uint32_t day=FIRST_DAY;day<=LAST_DAY;day++) {
+		for(int k=0;k<3;k++) {
+			time_t t = (time_t)day*SECS_PER_DAY + offsets[k];
+			tmElements_t a, b;
+			breakTime_loop(t, a);
+			breakTime(t, b);
+			const tmDate_t &d = breakDate(t);
+			if (a.Second!=b.Second || a.Minute!=b.Minute || a.Hour!=b.Hour ||
+					a.Wday!=b.Wday || a.Day!=b.Day || a.Month!=b.Month || a.Year!=b.Year ||
+					d.Days!=day || d.Wday!=a.Wday || d.Day!=a.Day || d.Month!=a.Month ||
+					d.Year!=a.Year || d.Leap!=(LEAP_YEAR(a.Year)?1:0)) {
+				if (mismatches++ < 5) printf("mismatch at %lu\n", (unsigned long)t);
+			}
+			// makeTime inverts both
+			CHECK(makeTime(b)==t);
+		}
+	}
+	CHECK(mismatches==0);
+
+	// the scheduler asks for t and t-86400 in turn: both stay cached
+	time_t t = 1700000000UL;
+	const tmDate_t *today = &breakDate(t);
+	const tmDate_t *yesterday = &breakDate(t-SECS_PER_DAY);
+	CHECK(today!=yesterday);
+	CHECK(&breakDate(t+60)==today && today->Days==t/SECS_PER_DAY);
+	CHECK(&breakDate(t-SECS_PER_DAY+60)==yesterday && yesterday->Days==t/SECS_PER_DAY-1);
+
+	// per-call cost over 1970-2100: a different day on every call (no cache
+	// hits) for the loop and breakTime, and the scheduler pattern for breakDate
+	const long n = 2000000;
+	const uint32_t span = (LAST_DAY-FIRST_DAY+1)*SECS_PER_DAY;
+	tmElements_t tm;
+	double start = test_nanos();
+	for(long i=0;i<n;i++) {
+		breakTime_loop((time_t)(i*7919UL*SECS_PER_DAY % span), tm);
+		sink += tm.Day;
+	}
+	double loop_ns = (test_nanos()-start)/n;
+	start = test_nanos();
+	for(long i=0;i<n;i++) {
+		breakTime((time_t)(i*7919UL*SECS_PER_DAY % span), tm);
+		sink += tm.Day;
+	}
+	double civil_ns = (test_nanos()-start)/n;
+	start = test_nanos();
+	for(long i=0;i<n;i++) {
+		time_t ti = (time_t)(1700000000UL + (i/1440)*SECS_PER_DAY + (i%1440)*60);
+		sink += breakDate(ti).Day + breakDate(ti-SECS_PER_DAY).Day;
+	}
+	double cached_ns = (test_nanos()-start)/n/2;
+	printf("breakTime 1970-2100: year loop %.1f ns, civil-from-days %.1f ns, cached breakDate %.1f ns per call\n",
+		loop_ns, civil_ns, cached_ns);
+	CHECK(civil_ns < loop_ns);
+
+	return test_result("timelib");
+}